@@ -1,9 +1,31 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "scheme.h"
 
 #define BUFFER_MAX 1000
+#define PRIMITIVES_MAX 256
 
 #define caar(obj)   car(car(obj))
 #define cadr(obj)   car(cdr(obj))
@@ -36,10 +58,19 @@
 
 /* MODEL */
 
-typedef enum {BOOLEAN, CHARACTER, COMPOUND_PROC, EOF_OBJECT,
-	      FIXNUM, INPUT_PORT, OUTPUT_PORT,
-              PAIR, PRIMITIVE_PROC, STRING, SYMBOL,
-              THE_EMPTY_LIST, THE_EMPTY_STRING} object_type;
+typedef enum {BOOLEAN, CHANNEL, CHARACTER, COMPOUND_PROC,
+              CONDITION_VARIABLE, CONTINUATION, EOF_OBJECT, ERROR_OBJECT,
+              FIXNUM, FRAME, INLINE_PROC, INPUT_PORT, ISOLATE, MACRO, MUTEX,
+              OUTPUT_PORT, PAIR, PRIMITIVE_PROC, STRING, SYMBOL,
+              THE_EMPTY_LIST, THE_EMPTY_STRING, THREAD,
+              VECTOR} object_type;
+
+/* primitives that eval open-codes, and the nodes analysis compiles
+ * special forms to; see ANALYZE */
+typedef enum {INLINE_ADD, INLINE_CAR, INLINE_CDR, INLINE_CONS, INLINE_IS_EQ,
+              INLINE_IS_LESS_THAN, INLINE_IS_NULL, INLINE_IS_NUMBER_EQUAL,
+              INLINE_IS_PAIR, INLINE_SUB, INLINE_FOLD, INLINE_CASE,
+              INLINE_LOOP, INLINE_RECUR, INLINE_GLOBAL} inline_opcode;
 
 typedef struct object {
   object_type type;
@@ -48,6 +79,9 @@ typedef struct object {
     struct {
       char value;
     } boolean;
+    struct {
+      struct channel *channel;
+    } channel;
     struct {
       char value;
     } character;
@@ -56,14 +90,47 @@ typedef struct object {
       struct object *body;
       struct object *env;
     } compound_proc;
+    struct {
+      struct condition_variable *condition_variable;
+    } condition_variable;
+    struct {
+      struct continuation *k;
+    } continuation;
+    struct {
+      struct object *message;
+      struct object *irritants;
+    } error_object;
     struct {
       long value;
     } fixnum;
+    struct {
+      struct object *variables;
+      struct object **values;
+      struct object *enclosing;
+    } frame;
+    struct {
+      long opcode;
+      struct object *cell;
+      struct object *primitive;
+    } inline_proc;
     struct {
       FILE *stream;
+      struct fd_port *fd_port; /* see EVENTS */
     } input_port;
+    struct {
+      struct isolate *isolate;
+    } isolate;
+    struct {
+      struct object *literals; /* (ellipsis literal ...) */
+      struct object *rules;
+      struct object *transformer;
+    } macro;
+    struct {
+      struct mutex *mutex;
+    } mutex;
     struct {
       FILE *stream;
+      struct fd_port *fd_port;
     } output_port;
     struct {
       struct object *car;
@@ -74,54 +141,281 @@ typedef struct object {
     } primitive_proc;
     struct {
       char *value;
+      struct object *original; /* what an alias renames, else () */
     } symbol;
     struct {
       char *value;
     } string;
+    struct {
+      struct green_thread *thread;
+    } thread;
+    struct {
+      long length;
+      struct object **items;
+    } vector;
   } data;
 } object;
 
-object *alloc_object(void) {
-  object *obj;
+/* What the profilers see of the C stack: an eval that enters the body
+ * of a compound procedure or calls a primitive while profiling links
+ * one of these into profile_stack until it returns.  See PROFILER. */
+
+typedef struct profile_frame {
+  struct object *procedure;
+  struct profile_frame *caller;
+} profile_frame;
+
+/* A continuation is a setjmp point plus, once the call/cc that
+ * captured it has returned, a copy of the C stack between that point
+ * and stack_base. While the capturing frame is still live (the common
+ * escaping case) invoking the continuation is a plain longjmp. Escape
+ * only continuations (guard, the REPL) never copy the stack, and
+ * neither does a call/cc whose continuation cannot have been kept;
+ * those are freed once they die.  See CONTINUATIONS. */
+
+typedef struct continuation {
+  jmp_buf jmp;
+  char *stack_low;
+  long stack_size;
+  char *stack_copy;
+  char live;
+  char escape_only;
+  char kept; /* never freed, as a copy or its maker may use it again */
+  struct object *object; /* what make_continuation made of it, or NULL */
+  struct object *saved_winders; /* what the capture saw */
+  struct object *saved_handlers;
+  struct object *saved_running_call;
+  profile_frame *saved_profile_stack;
+  long saved_mutations;
+  struct continuation *next;
+} continuation;
+
+/* Green threads wait in these, first come first served.  See
+ * THREADS. */
+
+typedef struct thread_queue {
+  struct green_thread *first;
+  struct green_thread *last;
+} thread_queue;
+
+char tracking_allocations;
+
+/* Everything one interpreter owns lives in its context, apart from the
+ * constants all interpreters share, and the code below reaches the
+ * running interpreter's through scheme, as S(field).  See EMBEDDING
+ * and ISOLATES. */
+
+struct scheme_context {
+  /* counters for runtime-stats */
+  long heap_objects;
+  long heap_bytes;
+  long lookup_count;
+  long eval_count;
+  long call_count;
+  long primitive_call_count;
+
+  struct arena_chunk *arena; /* where its objects are; see MODEL */
+
+  object *symbol_table;
+  object **symbol_index;
+  unsigned long symbol_index_size;
+  unsigned long symbol_count;
+
+  object *and_symbol;
+  object *arrow_symbol;
+  object *begin_symbol;
+  object *case_symbol;
+  object *define_symbol;
+  object *define_syntax_symbol;
+  object *ellipsis_symbol;
+  object *else_symbol;
+  object *er_macro_transformer_symbol;
+  object *guard_symbol;
+  object *if_symbol;
+  object *lambda_symbol;
+  object *let_symbol;
+  object *ok_symbol;
+  object *or_symbol;
+  object *quote_symbol;
+  object *set_symbol;
+  object *syntax_rules_symbol;
+  object *underscore_symbol;
+
+  object *the_global_environment;
+
+  char *stack_base;
+  continuation *live_continuations;
+  continuation *top_level;
+  continuation *exit_point; /* where exit returns to; see EMBEDDING */
+  int exit_status; /* what it was given there, or -1 */
+  object *continuation_value;
+  continuation expired; /* what a freed continuation's object refers to */
+
+  profile_frame *volatile profile_stack;
+  object *toplevel_form; /* the form the REPL or load is evaluating */
+  object *running_call; /* the call whose primitive is running */
+  FILE *source_stream; /* what load notes source forms for */
+  long source_file_index;
+  struct source_form *source_forms;
+  long source_form_count;
+  long source_form_capacity;
+  long source_forms_located; /* how many are in source_locations */
+  struct object_table *source_locations; /* pair to offset *
+                                            SOURCE_FILES_MAX + file */
+  struct object_table *source_origins; /* what analysis made to its
+                                          source */
+  FILE *locating_stream; /* what read notes pair locations for */
+  long locating_file;
+  object *winders;
+  object *handlers;
+
+  object *command_line;
+
+  object *ellipsis_match;
+  object *macro_renames;
+  object *rename_procedure;
+  object *compare_procedure;
+  struct object_table *expansions;
+  struct object_table *alias_scopes;
+
+  char spawned; /* an isolate's or a worker's; see ISOLATES */
+  char pool_worker; /* see PARALLEL */
+  long mutation_count; /* global definitions, mutations and stores so far */
+  char *pool_snapshot; /* what parallel calls run in; see PARALLEL */
+  struct object_table *pool_shared; /* its objects' indices */
+  long pool_snapshot_id;
+  long pool_snapshot_mutations; /* mutation_count when it was taken */
+
+  /* green threads; see THREADS */
+  struct green_thread *current_thread; /* NULL until threads are used */
+  struct green_thread *first_thread; /* what the interpreter started on */
+  struct green_thread *finished_thread; /* whose stack is to be freed */
+  thread_queue run_queue;
+  thread_queue io_queue; /* threads waiting for ports */
+  struct green_thread *timed_threads; /* those inside with-timeout */
+  long preempt_countdown;
+  int epoll_fd; /* see EVENTS */
+  char epoll_open;
+};
+
+__thread scheme_context *scheme; /* the interpreter this thread runs */
+
+#define S(field) (scheme->field)
+
+void track_allocation(object_type type, long count, long bytes);
+
+/* Every allocation is counted here, for runtime-stats and time; count
+ * is 0 for the extra bytes a constructor mallocs after alloc_object
+ * has counted the object itself. */
+void count_allocation(object_type type, long count, long bytes) {
+  S(heap_objects) += count;
+  S(heap_bytes) += bytes;
+
+  if (tracking_allocations) {
+    track_allocation(type, count, bytes);
+  }
+}
 
-  obj = malloc(sizeof(object));
+/* An interpreter's objects, and the strings and arrays they hold, are
+ * carved out of large chunks of its own, which scheme_destroy frees
+ * together.  A block too big to share a chunk gets one to itself,
+ * linked in behind the chunk being filled. */
 
-  if (obj == NULL) {
+#define ARENA_CHUNK_SIZE (1L << 16)
+
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  long size;
+  long used;
+} arena_chunk;
+
+arena_chunk *make_arena_chunk(long size) {
+  arena_chunk *chunk;
+
+  chunk = malloc(sizeof(arena_chunk) + size);
+
+  if (chunk == NULL) {
     fprintf(stderr, "out of memory\n");
     exit(1);
   }
 
+  chunk->size = size;
+  chunk->used = 0;
+
+  return chunk;
+}
+
+void *arena_alloc(long size) {
+  arena_chunk *chunk;
+
+  size = (size + sizeof(long) - 1) & ~(long)(sizeof(long) - 1);
+
+  if (size > ARENA_CHUNK_SIZE / 4) {
+    chunk = make_arena_chunk(size);
+    chunk->used = size;
+
+    if (S(arena) == NULL) {
+      chunk->next = NULL;
+      S(arena) = chunk;
+    } else {
+      chunk->next = S(arena)->next;
+      S(arena)->next = chunk;
+    }
+
+    return chunk + 1;
+  }
+
+  if (S(arena) == NULL || S(arena)->used + size > S(arena)->size) {
+    chunk = make_arena_chunk(ARENA_CHUNK_SIZE);
+    chunk->next = S(arena);
+    S(arena) = chunk;
+  }
+
+  S(arena)->used += size;
+
+  return (char *)(S(arena) + 1) + S(arena)->used - size;
+}
+
+void free_arena(arena_chunk *chunk) {
+  arena_chunk *next;
+
+  for (; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+}
+
+object *alloc_object(object_type type) {
+  object *obj;
+
+  obj = arena_alloc(sizeof(object));
+  obj->type = type;
+
+  count_allocation(type, 1, sizeof(object));
+
   return obj;
 }
 
+/* constants shared by every interpreter in the process */
+
 object *the_empty_list;
 object *the_empty_string;
 
 object *false;
 object *true;
 
-object *symbol_table;
-
-object *and_symbol;
-object *begin_symbol;
-object *cond_symbol;
-object *define_symbol;
-object *else_symbol;
 object *eof_object;
-object *if_symbol;
-object *lambda_symbol;
-object *let_symbol;
-object *ok_symbol;
-object *or_symbol;
-object *quote_symbol;
-object *set_symbol;
 
 object *the_empty_environment;
-object *the_global_environment;
+
+char profiling; /* see update_profiling */
+char tracing;
+char backtraces;
 
 object *car(object *pair);
 object *cdr(object *pair);
 object *cons(object *car, object *cdr);
+void throw_error(char *message, object *irritant) __attribute__((noreturn));
 void set_car(object *obj, object *value);
 void set_cdr(object *obj, object *value);
 
@@ -143,27 +437,77 @@ object *cdr(object *pair) {
 object *cons(object *car, object *cdr) {
   object *obj;
 
-  obj = alloc_object();
-  obj->type = PAIR;
+  obj = alloc_object(PAIR);
   obj->data.pair.car = car;
   obj->data.pair.cdr = cdr;
 
   return obj;
 }
 
+/* An environment is the empty list, a pair of a list frame (vars . vals)
+ * and the enclosing environment, or a flat FRAME object made for a
+ * procedure call, which holds its own enclosing environment. */
+
+char is_frame(object *obj);
+
 object *enclosing_environment(object *env) {
-  return cdr(env);
+  return is_frame(env) ? env->data.frame.enclosing : cdr(env);
 }
 
 object *first_frame(object *env);
 object *frame_values(object *frame);
 object *frame_variables(object *frame);
 char is_the_empty_list(object *obj);
+object *extend_environment(object *vars, object *vals, object *base_env);
+
+/* Returns the slot holding var in a flat frame, or NULL. */
+object **frame_slot(object *var, object *frame) {
+  object *vars;
+  object **vals;
+
+  vars = frame->data.frame.variables;
+  vals = frame->data.frame.values;
+
+  while (!is_the_empty_list(vars)) {
+    if (var == car(vars)) {
+      return vals;
+    }
+
+    vars = cdr(vars);
+    vals++;
+  }
+
+  return NULL;
+}
 
 void define_variable(object *var, object *val, object *env) {
   object *frame;
   object *vars;
   object *vals;
+  object **slot;
+
+  if (is_frame(env)) {
+    slot = frame_slot(var, env);
+
+    if (slot != NULL) {
+      *slot = val;
+
+      return;
+    }
+
+    /* flat frames cannot grow: internal definitions go in a list frame
+     * just below */
+    env->data.frame.enclosing =
+      extend_environment(cons(var, the_empty_list),
+                         cons(val, the_empty_list),
+                         env->data.frame.enclosing);
+
+    return;
+  }
+
+  if (env == S(the_global_environment)) {
+    S(mutation_count)++;
+  }
 
   frame = first_frame(env);
   vars = frame_variables(frame);
@@ -207,6 +551,10 @@ char is_boolean(object *obj) {
   return obj->type == BOOLEAN;
 }
 
+char is_channel(object *obj) {
+  return obj->type == CHANNEL;
+}
+
 char is_character(object *obj) {
   return obj->type == CHARACTER;
 }
@@ -215,6 +563,10 @@ char is_compound_proc(object *obj) {
   return obj->type == COMPOUND_PROC;
 }
 
+char is_continuation(object *obj) {
+  return obj->type == CONTINUATION;
+}
+
 char is_eof_object(object *obj) {
   return obj->type == EOF_OBJECT;
 }
@@ -223,19 +575,53 @@ char is_false(object *obj) {
   return obj == false;
 }
 
+char is_error_object(object *obj) {
+  return obj->type == ERROR_OBJECT;
+}
+
 char is_fixnum(object *obj) {
   return obj->type == FIXNUM;
 }
 
 char is_initial(int c) {
   return isalpha(c) || c == '*' || c == '/' || c == '>' ||
-    c == '<' || c == '=' || c == '?' || c == '!';
+    c == '<' || c == '=' || c == '?' || c == '!' || c == '_' ||
+    c == '$' || c == '%' || c == '&' || c == ':' || c == '^' || c == '~';
+}
+
+char is_alias(object *obj) {
+  return obj->type == SYMBOL &&
+    !is_the_empty_list(obj->data.symbol.original);
+}
+
+char is_condition_variable(object *obj) {
+  return obj->type == CONDITION_VARIABLE;
+}
+
+char is_frame(object *obj) {
+  return obj->type == FRAME;
+}
+
+char is_inline_proc(object *obj) {
+  return obj->type == INLINE_PROC;
 }
 
 char is_input_port(object *obj) {
   return obj->type == INPUT_PORT;
 }
 
+char is_isolate(object *obj) {
+  return obj->type == ISOLATE;
+}
+
+char is_macro(object *obj) {
+  return obj->type == MACRO;
+}
+
+char is_mutex(object *obj) {
+  return obj->type == MUTEX;
+}
+
 char is_output_port(object *obj) {
   return obj->type == OUTPUT_PORT;
 }
@@ -264,16 +650,88 @@ char is_the_empty_string(object *obj) {
   return obj->type == THE_EMPTY_STRING;
 }
 
+char is_thread(object *obj) {
+  return obj->type == THREAD;
+}
+
 char is_true(object *obj) {
   return !is_false(obj);
 }
 
+char is_vector(object *obj) {
+  return obj->type == VECTOR;
+}
+
+char is_eqv(object *obj1, object *obj2) {
+  if (obj1->type != obj2->type) {
+    return 0;
+  }
+
+  switch (obj1->type) {
+  case FIXNUM:
+    return obj1->data.fixnum.value == obj2->data.fixnum.value;
+
+  case CHARACTER:
+    return obj1->data.character.value == obj2->data.character.value;
+
+  case STRING:
+    return strcmp(obj1->data.string.value, obj2->data.string.value) == 0;
+
+  default:
+    return obj1 == obj2;
+  }
+}
+
+char is_equal(object *obj1, object *obj2) {
+  long i;
+
+  if (is_vector(obj1) && is_vector(obj2)) {
+    if (obj1->data.vector.length != obj2->data.vector.length) {
+      return 0;
+    }
+
+    for (i = 0; i < obj1->data.vector.length; i++) {
+      if (!is_equal(obj1->data.vector.items[i], obj2->data.vector.items[i])) {
+        return 0;
+      }
+    }
+
+    return 1;
+  }
+
+  while (is_pair(obj1) && is_pair(obj2)) {
+    if (!is_equal(car(obj1), car(obj2))) {
+      return 0;
+    }
+
+    obj1 = cdr(obj1);
+    obj2 = cdr(obj2);
+  }
+
+  return is_eqv(obj1, obj2);
+}
+
 object *lookup_variable_value(object *var, object *env) {
   object *frame;
   object *vars;
   object *vals;
+  object **slot;
+
+  S(lookup_count)++;
 
   while (!is_the_empty_list(env)) {
+    if (is_frame(env)) {
+      slot = frame_slot(var, env);
+
+      if (slot != NULL) {
+        return *slot;
+      }
+
+      env = enclosing_environment(env);
+
+      continue;
+    }
+
     frame = first_frame(env);
     vars = frame_variables(frame);
     vals = frame_values(frame);
@@ -290,15 +748,50 @@ object *lookup_variable_value(object *var, object *env) {
     env = enclosing_environment(env);
   }
 
-  fprintf(stderr, "unbound variable\n");
-  exit(1);
+  throw_error("unbound variable", var);
+}
+
+/* Returns the pair in a frame's value list that holds var's value, or
+ * NULL if var is unbound or bound in a flat frame. */
+object *lookup_binding_cell(object *var, object *env) {
+  object *frame;
+  object *vars;
+  object *vals;
+
+  while (!is_the_empty_list(env)) {
+    if (is_frame(env)) {
+      if (frame_slot(var, env) != NULL) {
+        return NULL;
+      }
+
+      env = enclosing_environment(env);
+
+      continue;
+    }
+
+    frame = first_frame(env);
+    vars = frame_variables(frame);
+    vals = frame_values(frame);
+
+    while (!is_the_empty_list(vars)) {
+      if (var == car(vars)) {
+        return vals;
+      }
+
+      vars = cdr(vars);
+      vals = cdr(vals);
+    }
+
+    env = enclosing_environment(env);
+  }
+
+  return NULL;
 }
 
 object *make_character(char value) {
   object *obj;
 
-  obj = alloc_object();
-  obj->type = CHARACTER;
+  obj = alloc_object(CHARACTER);
   obj->data.character.value = value;
 
   return obj;
@@ -309,8 +802,7 @@ object *make_compound_proc(object *parameters,
                            object *env) {
   object *obj;
 
-  obj = alloc_object();
-  obj->type = COMPOUND_PROC;
+  obj = alloc_object(COMPOUND_PROC);
   obj->data.compound_proc.parameters = parameters;
   obj->data.compound_proc.body = body;
   obj->data.compound_proc.env = env;
@@ -330,11 +822,30 @@ object *make_environment(void) {
   return env;
 }
 
+object *make_continuation(continuation *k) {
+  object *obj;
+
+  obj = alloc_object(CONTINUATION);
+  obj->data.continuation.k = k;
+  k->object = obj;
+
+  return obj;
+}
+
+object *make_error_object(object *message, object *irritants) {
+  object *obj;
+
+  obj = alloc_object(ERROR_OBJECT);
+  obj->data.error_object.message = message;
+  obj->data.error_object.irritants = irritants;
+
+  return obj;
+}
+
 object *make_fixnum(long value) {
   object *obj;
 
-  obj = alloc_object();
-  obj->type = FIXNUM;
+  obj = alloc_object(FIXNUM);
   obj->data.fixnum.value = value;
 
   return obj;
@@ -344,1587 +855,10627 @@ object *make_frame(object *vars, object *vals) {
   return cons(vars, vals);
 }
 
-object *make_input_port(FILE *stream) {
+/* A flat frame for count variables; the values follow the object in
+ * the same block and are left for the caller to fill. */
+object *make_flat_frame(object *variables, long count, object *enclosing) {
   object *obj;
 
-  obj = alloc_object();
-  obj->type = INPUT_PORT;
-  obj->data.input_port.stream = stream;
+  obj = arena_alloc(sizeof(object) + count * sizeof(object *));
+  count_allocation(FRAME, 1, sizeof(object) + count * sizeof(object *));
+  obj->type = FRAME;
+  obj->data.frame.variables = variables;
+  obj->data.frame.values = (object **)(obj + 1);
+  obj->data.frame.enclosing = enclosing;
 
   return obj;
 }
 
-object *make_output_port(FILE *stream) {
+/* An uninterned symbol standing for symbol in a macro expansion. */
+object *make_alias(object *symbol) {
   object *obj;
 
-  obj = alloc_object();
-  obj->type = OUTPUT_PORT;
-  obj->data.output_port.stream = stream;
+  obj = alloc_object(SYMBOL);
+  obj->data.symbol.value = symbol->data.symbol.value;
+  obj->data.symbol.original = symbol;
 
   return obj;
 }
 
-object *make_primitive_proc(object *(*fn)(struct object *arguments)) {
+object *make_inline_proc(long opcode, object *cell, object *primitive) {
   object *obj;
 
-  obj = alloc_object();
-  obj->type = PRIMITIVE_PROC;
-  obj->data.primitive_proc.fn = fn;
+  obj = alloc_object(INLINE_PROC);
+  obj->data.inline_proc.opcode = opcode;
+  obj->data.inline_proc.cell = cell;
+  obj->data.inline_proc.primitive = primitive;
 
   return obj;
 }
 
-object *make_string(char *value) {
+object *make_input_port(FILE *stream) {
   object *obj;
 
-  obj = alloc_object();
-  obj->type = STRING;
-  obj->data.string.value = malloc(strlen(value) + 1);
-
-  if (obj->data.string.value == NULL) {
-    fprintf(stderr, "out of memory\n");
-    exit(1);
-  }
-
-  strcpy(obj->data.string.value, value);
+  obj = alloc_object(INPUT_PORT);
+  obj->data.input_port.stream = stream;
+  obj->data.input_port.fd_port = NULL;
 
   return obj;
 }
 
-object *make_symbol(char *value) {
+object *make_output_port(FILE *stream) {
   object *obj;
-  object *element;
-
-  element = symbol_table;
-
-  while (!is_the_empty_list(element)) {
-    if (strcmp(car(element)->data.symbol.value, value) == 0) {
-      return car(element);
-    }
 
-    element = cdr(element);
-  }
+  obj = alloc_object(OUTPUT_PORT);
+  obj->data.output_port.stream = stream;
+  obj->data.output_port.fd_port = NULL;
 
-  obj = alloc_object();
-  obj->type = SYMBOL;
-  obj->data.symbol.value = malloc(strlen(value) + 1);
+  return obj;
+}
 
-  if (obj->data.symbol.value == NULL) {
-    fprintf(stderr, "out of memory\n");
-    exit(1);
-  }
+object *make_macro(object *literals, object *rules, object *transformer) {
+  object *obj;
 
-  strcpy(obj->data.symbol.value, value);
-  symbol_table = cons(obj, symbol_table);
+  obj = alloc_object(MACRO);
+  obj->data.macro.literals = literals;
+  obj->data.macro.rules = rules;
+  obj->data.macro.transformer = transformer;
 
   return obj;
 }
 
-void set_car(object *obj, object *value) {
-  obj->data.pair.car = value;
-}
+object *make_primitive_proc(object *(*fn)(struct object *arguments)) {
+  object *obj;
 
-void set_cdr(object *obj, object *value) {
-  obj->data.pair.cdr = value;
+  obj = alloc_object(PRIMITIVE_PROC);
+  obj->data.primitive_proc.fn = fn;
+
+  return obj;
 }
 
-void set_variable_value(object *var, object *val, object *env) {
-  object *frame;
-  object *vars;
-  object *vals;
+/* Primitives are also registered by name so heap images, which cannot
+ * hold C function pointers, can find them again. */
 
-  while (!is_the_empty_list(env)) {
-    frame = first_frame(env);
-    vars = frame_variables(frame);
-    vals = frame_values(frame);
+typedef struct primitive {
+  char *name;
+  object *(*fn)(struct object *arguments);
+} primitive;
 
-    while (!is_the_empty_list(vars)) {
-      if (var == car(vars)) {
-	set_car(vals, val);
+primitive primitives[PRIMITIVES_MAX];
+int primitive_count = 0;
 
-	return;
-      }
+void register_primitive(char *name,
+                        object *(*fn)(struct object *arguments)) {
+  int i;
 
-      vars = cdr(vars);
-      vals = cdr(vals);
+  for (i = 0; i < primitive_count; i++) {
+    if (primitives[i].fn == fn && strcmp(primitives[i].name, name) == 0) {
+      return;
     }
+  }
 
-    env = enclosing_environment(env);
+  if (primitive_count == PRIMITIVES_MAX) {
+    fprintf(stderr, "too many primitives\n");
+    exit(1);
   }
 
-  fprintf(stderr, "unbound variable\n");
-  exit(1);
+  primitives[primitive_count].name = name;
+  primitives[primitive_count].fn = fn;
+  primitive_count++;
 }
 
-object *setup_environment(void) {
-  object *initial_env;
+char *primitive_name(object *(*fn)(struct object *arguments)) {
+  int i;
 
-  initial_env = extend_environment(the_empty_list,
-				   the_empty_list,
-				   the_empty_environment);
+  for (i = 0; i < primitive_count; i++) {
+    if (primitives[i].fn == fn) {
+      return primitives[i].name;
+    }
+  }
 
-  return initial_env;
+  return NULL;
 }
 
-/* BIFS */
-
-object *proc_add(object *arguments) {
-  long result = 0;
+object *(*primitive_named(char *name))(struct object *arguments) {
+  int i;
 
-  while (!is_the_empty_list(arguments)) {
-    result += (car(arguments))->data.fixnum.value;
-    arguments = cdr(arguments);
+  for (i = 0; i < primitive_count; i++) {
+    if (strcmp(primitives[i].name, name) == 0) {
+      return primitives[i].fn;
+    }
   }
 
-  return make_fixnum(result);
+  return NULL;
 }
 
-object *proc_apply(object *arguments) {
-  fprintf(stderr, "illegal state. The body of the apply "
-          "primitive procedure should not execute.\n");
+object *make_string(char *value) {
+  object *obj;
 
-  exit(1);
-}
+  obj = alloc_object(STRING);
+  obj->data.string.value = arena_alloc(strlen(value) + 1);
+  strcpy(obj->data.string.value, value);
+  count_allocation(STRING, 0, strlen(value) + 1);
 
-object *proc_car(object *arguments) {
-  return caar(arguments);
+  return obj;
 }
 
-object *proc_close_input_port(object *arguments) {
-  int result;
+/* symbol_table stays a list, which is what images save; this open
+ * addressed index over it makes interning constant time */
 
-  result = fclose(car(arguments)->data.input_port.stream);
+unsigned long hash_string(char *str) {
+  unsigned long hash;
 
-  if (result == EOF) {
-    fprintf(stderr, "could not close input port\n");
-    exit(1);
+  hash = 14695981039346656037UL;
+
+  while (*str != '\0') {
+    hash = (hash ^ (unsigned char)*str++) * 1099511628211UL;
   }
 
-  return ok_symbol;
+  return hash;
 }
 
-object *proc_close_output_port(object *arguments) {
-  int result;
+object **symbol_slot(char *value) {
+  unsigned long i;
 
-  result = fclose(car(arguments)->data.input_port.stream);
+  i = hash_string(value) & (S(symbol_index_size) - 1);
 
-  if (result == EOF) {
-    fprintf(stderr, "could not close output port\n");
-    exit(1);
+  while (S(symbol_index)[i] != NULL &&
+         strcmp(S(symbol_index)[i]->data.symbol.value, value) != 0) {
+    i = (i + 1) & (S(symbol_index_size) - 1);
   }
 
-  return ok_symbol;
+  return S(symbol_index) + i;
 }
 
-object *proc_cdr(object *arguments) {
-  return cdar(arguments);
-}
+void index_symbol(object *symbol) {
+  object **old_index;
+  unsigned long old_size;
+  unsigned long i;
 
-object *proc_cons(object *arguments) {
-  return cons(car(arguments), cadr(arguments));
-}
+  if (2 * (S(symbol_count) + 1) > S(symbol_index_size)) {
+    old_index = S(symbol_index);
+    old_size = S(symbol_index_size);
 
-object *proc_environment(object *arguments) {
-  return make_environment();
-}
+    S(symbol_index_size) = old_size == 0 ? 1024 : old_size * 2;
+    S(symbol_index) = calloc(S(symbol_index_size), sizeof(object *));
 
-void write(FILE *out, object *obj);
+    if (S(symbol_index) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
 
-object *proc_error(object *arguments) {
-  while (!is_the_empty_list(arguments)) {
-    write(stderr, car(arguments));
-    fprintf(stderr, " ");
-    arguments = cdr(arguments);
+    for (i = 0; i < old_size; i++) {
+      if (old_index[i] != NULL) {
+        *symbol_slot(old_index[i]->data.symbol.value) = old_index[i];
+      }
+    }
+
+    free(old_index);
   }
 
-  printf("\nexiting\n");
-  exit(1);
+  *symbol_slot(symbol->data.symbol.value) = symbol;
+  S(symbol_count)++;
 }
 
-object *proc_eval(object *arguments) {
-  fprintf(stderr, "illegal state. The body of the eval "
-          "primitive procedure should not execute.\n");
+void index_symbol_table(void) {
+  object *element;
 
-  exit(1);
-}
+  free(S(symbol_index));
+  S(symbol_index) = NULL;
+  S(symbol_index_size) = 0;
+  S(symbol_count) = 0;
 
-object *proc_interaction_environment(object *arguments) {
-  return the_global_environment;
+  for (element = S(symbol_table);
+       !is_the_empty_list(element);
+       element = cdr(element)) {
+    index_symbol(car(element));
+  }
 }
 
-object *proc_is_eof_object(object *arguments) {
-  return is_eof_object(car(arguments)) ? true : false;
+object *make_symbol(char *value) {
+  object *obj;
+  object **slot;
+
+  if (S(symbol_index) != NULL && *(slot = symbol_slot(value)) != NULL) {
+    return *slot;
+  }
+
+  obj = alloc_object(SYMBOL);
+  obj->data.symbol.value = arena_alloc(strlen(value) + 1);
+  strcpy(obj->data.symbol.value, value);
+  count_allocation(SYMBOL, 0, strlen(value) + 1);
+  obj->data.symbol.original = the_empty_list;
+  S(symbol_table) = cons(obj, S(symbol_table));
+  index_symbol(obj);
+
+  return obj;
 }
 
-object *proc_is_input_port(object *arguments) {
-  return is_input_port(car(arguments)) ? true : false;
+object *make_vector(long length, object *fill) {
+  object *obj;
+  long i;
+
+  obj = alloc_object(VECTOR);
+  obj->data.vector.length = length;
+  obj->data.vector.items = arena_alloc((length == 0 ? 1 : length) *
+                                       sizeof(object *));
+  count_allocation(VECTOR, 0, length * sizeof(object *));
+
+  for (i = 0; i < length; i++) {
+    obj->data.vector.items[i] = fill;
+  }
+
+  return obj;
 }
 
-object *proc_is_output_port(object *arguments) {
-  return is_output_port(car(arguments)) ? true : false;
+void set_car(object *obj, object *value) {
+  obj->data.pair.car = value;
 }
 
-object *proc_list(object *arguments) {
-  return arguments;
+void set_cdr(object *obj, object *value) {
+  obj->data.pair.cdr = value;
 }
 
-object *eval(object *exp, object *env);
-object *read(FILE *in);
+void set_variable_value(object *var, object *val, object *env) {
+  object *frame;
+  object *vars;
+  object *vals;
+  object **slot;
 
-object *proc_load(object *arguments) {
-  char *filename;
-  FILE *in;
-  object *exp;
-  object *result;
+  S(mutation_count)++;
 
-  filename = car(arguments)->data.string.value;
-  in = fopen(filename, "r");
+  while (!is_the_empty_list(env)) {
+    if (is_frame(env)) {
+      slot = frame_slot(var, env);
 
-  if (in == NULL) {
-    fprintf(stderr, "could not load file \"%s\"", filename);
-    exit(1);
-  }
+      if (slot != NULL) {
+        *slot = val;
 
-  while ((exp = read(in)) != NULL) {
-    result = eval(exp, the_global_environment);
-  }
+        return;
+      }
 
-  fclose(in);
+      env = enclosing_environment(env);
 
-  return result;
-}
+      continue;
+    }
 
-object *proc_make_input_port(object *arguments) {
-  char *filename;
-  FILE *in;
+    frame = first_frame(env);
+    vars = frame_variables(frame);
+    vals = frame_values(frame);
 
-  filename = car(arguments)->data.string.value;
-  in = fopen(filename, "r");
+    while (!is_the_empty_list(vars)) {
+      if (var == car(vars)) {
+	set_car(vals, val);
 
-  if (in == NULL) {
-    fprintf(stderr, "could not load file \"%s\"", filename);
-    exit(1);
+	return;
+      }
+
+      vars = cdr(vars);
+      vals = cdr(vals);
+    }
+
+    env = enclosing_environment(env);
   }
 
-  return make_input_port(in);
+  throw_error("unbound variable", var);
 }
 
-object *proc_mul(object *arguments) {
-  long result = 1;
+object *setup_environment(void) {
+  object *initial_env;
 
-  while (!is_the_empty_list(arguments)) {
-    result *= (car(arguments))->data.fixnum.value;
-    arguments = cdr(arguments);
-  }
+  initial_env = extend_environment(the_empty_list,
+				   the_empty_list,
+				   the_empty_environment);
 
-  return make_fixnum(result);
+  return initial_env;
 }
 
-object *proc_null_environment(object *arguments) {
-  return setup_environment();
-}
+/* A hash table keyed by object identity. */
 
-object *proc_open_output_port(object *arguments) {
-  char *filename;
-  FILE *out;
+typedef struct object_table {
+  unsigned long size;
+  unsigned long count;
+  object **keys;
+  long *values;
+} object_table;
 
-  filename = car(arguments)->data.string.value;
-  out = fopen(filename, "w");
+object_table *make_object_table(void) {
+  object_table *table;
 
-  if (out == NULL) {
-    fprintf(stderr, "could not open file \"%s\"\n", filename);
+  table = malloc(sizeof(object_table));
+
+  if (table != NULL) {
+    table->size = 64;
+    table->count = 0;
+    table->keys = calloc(table->size, sizeof(object *));
+    table->values = malloc(table->size * sizeof(long));
+  }
+
+  if (table == NULL || table->keys == NULL || table->values == NULL) {
+    fprintf(stderr, "out of memory\n");
     exit(1);
   }
 
-  return make_output_port(out);
+  return table;
 }
 
-object *proc_read(object *arguments) {
-  FILE *in;
-  object *result;
+void free_object_table(object_table *table) {
+  free(table->keys);
+  free(table->values);
+  free(table);
+}
 
-  in = is_the_empty_list(arguments) ?
-    stdin :
-    car(arguments)->data.input_port.stream;
+unsigned long object_table_slot(object_table *table, object *key) {
+  unsigned long i;
 
-  result = read(in);
+  i = (((unsigned long)key >> 4) * 2654435761UL) & (table->size - 1);
 
-  return result == NULL ? eof_object : result;
-}
+  while (table->keys[i] != NULL && table->keys[i] != key) {
+    i = (i + 1) & (table->size - 1);
+  }
 
-object *proc_read_char(object *arguments) {
-  FILE *in;
-  int result;
+  return i;
+}
 
-  in = is_the_empty_list(arguments) ?
-    stdin :
-    car(arguments)->data.input_port.stream;
+long object_table_get(object_table *table, object *key, long missing) {
+  unsigned long i;
 
-  result = getc(in);
+  i = object_table_slot(table, key);
 
-  return result == EOF ? eof_object : make_character(result);
+  return table->keys[i] == NULL ? missing : table->values[i];
 }
 
-int peek(FILE *in);
+void object_table_put(object_table *table, object *key, long value) {
+  object **keys;
+  long *values;
+  unsigned long size;
+  unsigned long i;
 
-object *proc_peek_char(object *arguments) {
-  FILE *in;
-  int result;
+  if (2 * (table->count + 1) > table->size) {
+    keys = table->keys;
+    values = table->values;
+    size = table->size;
 
-  in = is_the_empty_list(arguments) ?
-    stdin :
-    car(arguments)->data.input_port.stream;
+    table->size *= 2;
+    table->count = 0;
+    table->keys = calloc(table->size, sizeof(object *));
+    table->values = malloc(table->size * sizeof(long));
 
-  result = peek(in);
+    if (table->keys == NULL || table->values == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
 
-  return result == EOF ? eof_object : make_character(result);
-}
+    for (i = 0; i < size; i++) {
+      if (keys[i] != NULL) {
+        object_table_put(table, keys[i], values[i]);
+      }
+    }
 
-object *proc_set_car(object *arguments) {
-  set_car(car(arguments), cadr(arguments));
+    free(keys);
+    free(values);
+  }
 
-  return ok_symbol;
-}
+  i = object_table_slot(table, key);
 
-object *proc_set_cdr(object *arguments) {
-  set_cdr(car(arguments), cadr(arguments));
+  if (table->keys[i] == NULL) {
+    table->keys[i] = key;
+    table->count++;
+  }
 
-  return ok_symbol;
+  table->values[i] = value;
 }
 
-object *proc_sub(object *arguments) {
-  long result;
+/* BIFS */
 
-  result = (car(arguments))->data.fixnum.value;
+object *proc_add(object *arguments) {
+  long result = 0;
 
-  while (!is_the_empty_list(arguments = cdr(arguments))) {
-    result -= (car(arguments))->data.fixnum.value;
+  while (!is_the_empty_list(arguments)) {
+    result += (car(arguments))->data.fixnum.value;
+    arguments = cdr(arguments);
   }
 
   return make_fixnum(result);
 }
 
-object *proc_quotient(object *arguments) {
-  return make_fixnum(((car(arguments))->data.fixnum.value) /
-		     ((cadr(arguments))->data.fixnum.value));
+object *proc_apply(object *arguments) {
+  fprintf(stderr, "illegal state. The body of the apply "
+          "primitive procedure should not execute.\n");
 
+  exit(1);
 }
 
-object *proc_remainder(object *arguments) {
-  return make_fixnum(((car(arguments))->data.fixnum.value) %
-		     ((cadr(arguments))->data.fixnum.value));
-}
+object *apply_procedure(object *procedure, object *arguments);
+object *call_with_current_continuation(object *receiver);
+object *cxr(object *obj, char *path);
+object *proc_list_copy(object *arguments);
 
-object *proc_write(object *arguments) {
-  object *exp;
-  FILE *out;
+object *proc_car(object *arguments) {
+  return cxr(car(arguments), "a");
+}
 
-  exp = car(arguments);
-  arguments = cdr(arguments);
-  out = is_the_empty_list(arguments) ?
-    stdout :
-    car(arguments)->data.output_port.stream;
+struct fd_port;
+void close_fd_port(FILE *out, struct fd_port *port);
 
-  write(out, exp);
-  fflush(out);
+object *proc_close_input_port(object *arguments) {
+  int result;
 
-  return ok_symbol;
-}
+  if (car(arguments)->data.input_port.fd_port != NULL) {
+    close_fd_port(NULL, car(arguments)->data.input_port.fd_port);
 
-object *proc_write_char(object *arguments) {
-  object *character;
-  FILE *out;
+    return S(ok_symbol);
+  }
 
-  character = car(arguments);
-  arguments = cdr(arguments);
-  out = is_the_empty_list(arguments) ?
-    stdout :
-    car(arguments)->data.output_port.stream;
+  result = fclose(car(arguments)->data.input_port.stream);
 
-  putc(character->data.character.value, out);
-  fflush(out);
+  if (result == EOF) {
+    throw_error("could not close input port", car(arguments));
+  }
 
-  return ok_symbol;
+  return S(ok_symbol);
 }
 
-object *proc_is_boolean(object *arguments) {
-  return is_boolean(car(arguments)) ? true : false;
-}
+object *proc_close_output_port(object *arguments) {
+  int result;
 
-object *proc_is_char(object *arguments) {
-  return is_character(car(arguments)) ? true : false;
-}
+  if (car(arguments)->data.output_port.fd_port != NULL) {
+    close_fd_port(car(arguments)->data.output_port.stream,
+                  car(arguments)->data.output_port.fd_port);
 
-object *proc_is_eq(object *arguments) {
-  object *obj1;
-  object *obj2;
+    return S(ok_symbol);
+  }
 
-  obj1 = car(arguments);
-  obj2 = cadr(arguments);
+  result = fclose(car(arguments)->data.output_port.stream);
 
-  if (obj1->type != obj2->type) {
-    return false;
+  if (result == EOF) {
+    throw_error("could not close output port", car(arguments));
   }
 
-  switch (obj1->type) {
-  case FIXNUM:
-    return (obj1->data.fixnum.value ==
-	    obj2->data.fixnum.value) ?
-      true : false;
+  return S(ok_symbol);
+}
 
-    break;
 
-  case CHARACTER:
-    return (obj1->data.character.value ==
-	    obj2->data.character.value) ?
-      true : false;
+object *proc_call_cc(object *arguments) {
+  return call_with_current_continuation(car(arguments));
+}
 
-    break;
+object *proc_cdr(object *arguments) {
+  return cxr(car(arguments), "d");
+}
 
-  case STRING:
-    return (strcmp(obj1->data.string.value,
-		   obj2->data.string.value) == 0) ?
-      true : false;
-
-    break;
-
-  default:
-    return (obj1 == obj2) ? true : false;
-
-  }
+object *proc_command_line(object *arguments) {
+  return S(command_line);
 }
 
-object *proc_is_greater_than(object *arguments) {
-  long previous;
-  long next;
+object *proc_cons(object *arguments) {
+  return cons(car(arguments), cadr(arguments));
+}
 
-  previous = (car(arguments))->data.fixnum.value;
+#define JIFFIES_PER_SECOND 1000000000L
 
-  while (!is_the_empty_list(arguments = cdr(arguments))) {
-    next = (car(arguments))->data.fixnum.value;
+long clock_jiffies(clockid_t clock) {
+  struct timespec now;
 
-    if (previous <= next) {
-      return false;
-    }
+  clock_gettime(clock, &now);
 
-    previous = next;
-  }
+  return now.tv_sec * JIFFIES_PER_SECOND + now.tv_nsec;
+}
 
-  return true;
+object *proc_current_jiffy(object *arguments) {
+  return make_fixnum(clock_jiffies(CLOCK_MONOTONIC));
 }
 
-object *proc_is_integer(object *arguments) {
-  return is_fixnum(car(arguments)) ? true : false;
+object *proc_jiffies_per_second(object *arguments) {
+  return make_fixnum(JIFFIES_PER_SECOND);
 }
 
-object *proc_is_less_than(object *arguments) {
-  long previous;
-  long next;
+object *proc_dynamic_wind(object *arguments) {
+  object *before;
+  object *thunk;
+  object *after;
+  object *result;
 
-  previous = (car(arguments))->data.fixnum.value;
+  before = car(arguments);
+  thunk = cadr(arguments);
+  after = caddr(arguments);
 
-  while (!is_the_empty_list(arguments = cdr(arguments))) {
-    next = (car(arguments))->data.fixnum.value;
+  apply_procedure(before, the_empty_list);
+  S(winders) = cons(cons(before, after), S(winders));
 
-    if (previous >= next) {
-      return false;
-    }
+  result = apply_procedure(thunk, the_empty_list);
 
-    previous = next;
-  }
+  S(winders) = cdr(S(winders));
+  apply_procedure(after, the_empty_list);
 
-  return true;
+  return result;
 }
 
-object *proc_is_null(object *arguments) {
-  return is_the_empty_list(car(arguments)) ? true : false;
-}
+void do_winds(object *to);
+void throw_to_continuation(continuation *k, object *value);
 
-object *proc_is_number_equal(object *arguments) {
-  long value;
+/* Ends the process, or the scheme_eval_string call it is made in. */
+object *proc_exit(object *arguments) {
+  object *status;
+  int code;
 
-  value = (car(arguments))->data.fixnum.value;
+  status = is_the_empty_list(arguments) ? true : car(arguments);
+  code = is_fixnum(status) ? status->data.fixnum.value :
+    is_false(status) ? 1 : 0;
 
-  while (!is_the_empty_list(arguments = cdr(arguments))) {
-    if (value != (car(arguments))->data.fixnum.value) {
-      return false;
-    }
+  if (S(exit_point) != NULL) {
+    S(exit_status) = code;
+    throw_to_continuation(S(exit_point), S(ok_symbol));
   }
 
-  return true;
+  do_winds(the_empty_list);
+  fflush(stdout);
+
+  exit(code);
 }
 
-object *proc_is_pair(object *arguments) {
-  return is_pair(car(arguments)) ? true : false;
+object *proc_environment(object *arguments) {
+  return make_environment();
 }
 
-object *proc_is_procedure(object *arguments) {
-  object *obj;
+void write_object(FILE *out, object *obj);
 
-  obj = car(arguments);
+object *raise_object(object *obj, char continuable);
 
-  return (is_primitive_proc(obj) || is_compound_proc(obj)) ? true : false;
+object *proc_error(object *arguments) {
+  return raise_object(make_error_object(car(arguments), cdr(arguments)), 0);
 }
 
-object *proc_is_string(object *arguments) {
-  return is_string(car(arguments)) ? true : false;
+object *proc_error_object_irritants(object *arguments) {
+  return car(arguments)->data.error_object.irritants;
 }
 
-object *proc_is_symbol(object *arguments) {
-  return is_symbol(car(arguments)) ? true : false;
+object *proc_error_object_message(object *arguments) {
+  return car(arguments)->data.error_object.message;
 }
 
-object *proc_char_to_integer(object *arguments) {
-  return make_fixnum((car(arguments))->data.character.value);
-}
+object *proc_eval(object *arguments) {
+  fprintf(stderr, "illegal state. The body of the eval "
+          "primitive procedure should not execute.\n");
 
-object *proc_integer_to_char(object *arguments) {
-  return make_character((car(arguments))->data.fixnum.value);
+  exit(1);
 }
 
-object *proc_number_to_string(object *arguments) {
-  char buffer[100];
+object *proc_interaction_environment(object *arguments) {
+  return S(the_global_environment);
+}
 
-  sprintf(buffer, "%ld", (car(arguments))->data.fixnum.value);
+object *proc_is_error_object(object *arguments) {
+  return is_error_object(car(arguments)) ? true : false;
+}
 
-  return make_string(buffer);
+object *proc_is_eof_object(object *arguments) {
+  return is_eof_object(car(arguments)) ? true : false;
 }
 
-object *proc_string_to_number(object *arguments) {
-  return make_fixnum(atoi((car(arguments))->data.string.value));
+object *proc_is_input_port(object *arguments) {
+  return is_input_port(car(arguments)) ? true : false;
 }
 
-object *proc_string_to_symbol(object *arguments) {
-  return make_symbol((car(arguments))->data.string.value);
+object *proc_is_output_port(object *arguments) {
+  return is_output_port(car(arguments)) ? true : false;
 }
 
-object *proc_symbol_to_string(object *arguments) {
-  return make_string((car(arguments))->data.symbol.value);
+object *proc_list(object *arguments) {
+  return arguments;
 }
 
-void init(void) {
-  the_empty_list = alloc_object();
-  the_empty_list->type = THE_EMPTY_LIST;
+/* The list operations below walk their arguments iteratively and build
+ * results front to back through a tail pointer. */
 
-  the_empty_string = alloc_object();
-  the_empty_string->type = THE_EMPTY_STRING;
+/* Follows a c[ad]+r path, applied right to left as in the name. */
+object *cxr(object *obj, char *path) {
+  char message[32];
+  char *op;
 
-  false = alloc_object();
-  false->type = BOOLEAN;
-  false->data.boolean.value = 0;
+  for (op = path + strlen(path) - 1; op >= path; op--) {
+    if (!is_pair(obj)) {
+      sprintf(message, "c%sr: not a pair", path);
+      throw_error(message, obj);
+    }
 
-  true = alloc_object();
-  true->type = BOOLEAN;
-  true->data.boolean.value = 1;
+    obj = *op == 'a' ? car(obj) : cdr(obj);
+  }
+
+  return obj;
+}
 
-  symbol_table = the_empty_list;
+#define define_cxr(path) \
+  object *proc_c##path##r(object *arguments) { \
+    return cxr(car(arguments), #path); \
+  }
 
-  and_symbol = make_symbol("and");
-  begin_symbol = make_symbol("begin");
-  cond_symbol = make_symbol("cond");
-  define_symbol = make_symbol("define");
-  else_symbol = make_symbol("else");
-  if_symbol = make_symbol("if");
-  lambda_symbol = make_symbol("lambda");
-  let_symbol = make_symbol("let");
-  ok_symbol = make_symbol("ok");
-  or_symbol = make_symbol("or");
-  quote_symbol = make_symbol("quote");
-  set_symbol = make_symbol("set!");
+define_cxr(aa)
+define_cxr(ad)
+define_cxr(da)
+define_cxr(dd)
+define_cxr(aaa)
+define_cxr(aad)
+define_cxr(ada)
+define_cxr(add)
+define_cxr(daa)
+define_cxr(dad)
+define_cxr(dda)
+define_cxr(ddd)
+define_cxr(aaaa)
+define_cxr(aaad)
+define_cxr(aada)
+define_cxr(aadd)
+define_cxr(adaa)
+define_cxr(adad)
+define_cxr(adda)
+define_cxr(addd)
+define_cxr(daaa)
+define_cxr(daad)
+define_cxr(dada)
+define_cxr(dadd)
+define_cxr(ddaa)
+define_cxr(ddad)
+define_cxr(ddda)
+define_cxr(dddd)
+
+/* The length of list, which must be a proper list; name, unless it is
+ * NULL, is the procedure to blame when it is not. */
+long list_length_for(object *list, char *name) {
+  char message[40];
+  object *slow;
+  long length;
+
+  slow = list;
+  length = 0;
+
+  while (is_pair(list)) {
+    list = cdr(list);
+    length++;
+
+    if (length % 2 == 0) {
+      slow = cdr(slow);
+
+      if (slow == list && is_pair(list)) {
+        sprintf(message, "%s%scircular list",
+                name == NULL ? "" : name, name == NULL ? "" : ": ");
+        throw_error(message, NULL);
+      }
+    }
+  }
 
-  eof_object = alloc_object();
-  eof_object->type = EOF_OBJECT;
+  if (!is_the_empty_list(list)) {
+    sprintf(message, "%s%snot a proper list",
+            name == NULL ? "" : name, name == NULL ? "" : ": ");
+    throw_error(message, list);
+  }
 
-  the_empty_environment = the_empty_list;
-  the_global_environment = make_environment();
+  return length;
 }
 
-void populate_environment(object *env) {
-
-#define add_procedure(scheme_name, c_name) \
-  define_variable(make_symbol(scheme_name), \
-		  make_primitive_proc(c_name), \
-		  env);
+long list_length(object *list) {
+  return list_length_for(list, NULL);
+}
 
-  add_procedure("null?", proc_is_null);
-  add_procedure("boolean?", proc_is_boolean);
-  add_procedure("symbol?", proc_is_symbol);
-  add_procedure("integer?", proc_is_integer);
-  add_procedure("char?", proc_is_char);
-  add_procedure("string?", proc_is_string);
-  add_procedure("pair?", proc_is_pair);
-  add_procedure("procedure?", proc_is_procedure);
+/* appends a fresh cell holding obj after *tail, or starts *head */
+void list_append_cell(object **head, object **tail, object *obj) {
+  object *cell;
 
-  add_procedure("char->integer", proc_char_to_integer);
-  add_procedure("integer->char", proc_integer_to_char);
-  add_procedure("number->string", proc_number_to_string);
-  add_procedure("string->number", proc_string_to_number);
-  add_procedure("symbol->string", proc_symbol_to_string);
-  add_procedure("string->symbol", proc_string_to_symbol);
+  cell = cons(obj, the_empty_list);
 
-  add_procedure("+", proc_add);
-  add_procedure("-", proc_sub);
-  add_procedure("*", proc_mul);
-  add_procedure("quotient", proc_quotient);
-  add_procedure("remainder", proc_remainder);
-  add_procedure("=", proc_is_number_equal);
-  add_procedure("<", proc_is_less_than);
-  add_procedure(">", proc_is_greater_than);
+  if (is_the_empty_list(*head)) {
+    *head = cell;
+  } else {
+    set_cdr(*tail, cell);
+  }
 
-  add_procedure("cons", proc_cons);
-  add_procedure("car", proc_car);
-  add_procedure("cdr", proc_cdr);
-  add_procedure("set-car!", proc_set_car);
-  add_procedure("set-cdr!", proc_set_cdr);
-  add_procedure("list", proc_list);
+  *tail = cell;
+}
 
-  add_procedure("eq?", proc_is_eq);
+object *proc_append(object *arguments) {
+  object *head;
+  object *tail;
+  object *list;
 
-  add_procedure("apply", proc_apply);
-  add_procedure("interaction-environment",
-                proc_interaction_environment);
-  add_procedure("null-environment", proc_null_environment);
-  add_procedure("environment", proc_environment);
-  add_procedure("eval", proc_eval);
+  if (is_the_empty_list(arguments)) {
+    return the_empty_list;
+  }
 
-  add_procedure("load", proc_load);
-  add_procedure("open-input-port", proc_open_output_port);
-  add_procedure("close-input-port", proc_close_input_port);
-  add_procedure("input-port?", proc_is_input_port);
-  add_procedure("read", proc_read);
-  add_procedure("read-char", proc_read_char);
-  add_procedure("peek-char", proc_peek_char);
-  add_procedure("eof-object?", proc_is_eof_object);
-  add_procedure("open-output-port", proc_open_output_port);
-  add_procedure("close-output-port", proc_close_output_port);
-  add_procedure("output-port?", proc_is_output_port);
-  add_procedure("write-char", proc_write_char);
-  add_procedure("write", proc_write);
+  head = the_empty_list;
+  tail = the_empty_list;
 
-  add_procedure("error", proc_error);
-}
+  while (!is_the_empty_list(cdr(arguments))) {
+    for (list = car(arguments); is_pair(list); list = cdr(list)) {
+      list_append_cell(&head, &tail, car(list));
+    }
 
-/* READ */
+    if (!is_the_empty_list(list)) {
+      throw_error("append: not a proper list", car(arguments));
+    }
 
-char is_delimiter(int c) {
-  return isspace(c) || c == EOF ||
-    c == '(' || c == ')' ||
-    c == '"' || c == ';';
-}
+    arguments = cdr(arguments);
+  }
 
-int peek(FILE *in) {
-  int c;
+  /* the last list is shared, not copied */
+  if (is_the_empty_list(head)) {
+    return car(arguments);
+  }
 
-  c = getc(in);
-  ungetc(c, in);
+  set_cdr(tail, car(arguments));
 
-  return c;
+  return head;
 }
 
-void eat_whitespace(FILE *in) {
-  int c;
+object *proc_assoc(object *arguments) {
+  object *obj;
+  object *list;
+  object *compare;
 
-  while ((c = getc(in)) != EOF) {
-    if (isspace(c)) {
-      continue;
-    }
+  obj = car(arguments);
+  compare = is_the_empty_list(cddr(arguments)) ? NULL : caddr(arguments);
 
-    if (c == ';') {
-      while (((c = getc(in)) != EOF) && (c != '\n'));
-      continue;
+  for (list = cadr(arguments); is_pair(list); list = cdr(list)) {
+    if (!is_pair(car(list))) {
+      throw_error("assoc: not an association list", cadr(arguments));
     }
 
-    ungetc(c, in);
-
-    break;
+    if (compare == NULL ?
+        is_equal(obj, caar(list)) :
+        is_true(apply_procedure(compare,
+                                cons(obj, cons(caar(list),
+                                               the_empty_list))))) {
+      return car(list);
+    }
   }
+
+  return false;
 }
 
-void eat_expected_string(FILE *in, char *str) {
-  int c;
+object *proc_assq(object *arguments) {
+  object *obj;
+  object *list;
 
-  while (*str != '\0') {
-    c = getc(in);
+  obj = car(arguments);
 
-    if (c != *str) {
-      fprintf(stderr, "unexpected character '%c'\n", c);
-      exit(1);
+  for (list = cadr(arguments); is_pair(list); list = cdr(list)) {
+    if (!is_pair(car(list))) {
+      throw_error("assq: not an association list", cadr(arguments));
     }
 
-    str++;
+    if (is_eqv(obj, caar(list))) {
+      return car(list);
+    }
   }
+
+  return false;
 }
 
-void peek_expected_delimiter(FILE *in) {
-  if (!is_delimiter(peek(in))) {
-    fprintf(stderr, "character not followed by delimiter\n");
-    exit(1);
+object *proc_for_each(object *arguments) {
+  object *procedure;
+  object *lists;
+  object *list;
+  object *args;
+  object *tail;
+
+  procedure = car(arguments);
+  lists = cdr(arguments);
+
+  if (is_the_empty_list(cdr(lists))) {
+    for (list = car(lists); is_pair(list); list = cdr(list)) {
+      apply_procedure(procedure, cons(car(list), the_empty_list));
+    }
+
+    return true;
   }
-}
 
-object *read_character(FILE *in) {
-  int c;
+  lists = proc_list_copy(cons(lists, the_empty_list));
 
-  c = getc(in);
+  while (1) {
+    args = the_empty_list;
+    tail = the_empty_list;
 
-  switch (c) {
-  case EOF:
-    fprintf(stderr, "incomplete character literal\n");
-    exit(1);
-  case 's':
-    if (peek(in) == 'p') {
-      eat_expected_string(in, "pace");
-      peek_expected_delimiter(in);
+    for (list = lists; !is_the_empty_list(list); list = cdr(list)) {
+      if (!is_pair(car(list))) {
+        return true;
+      }
 
-      return make_character(' ');
+      list_append_cell(&args, &tail, caar(list));
+      set_car(list, cdar(list));
     }
 
-    break;
-  case 'n':
-    if (peek(in) == 'e') {
-      eat_expected_string(in, "ewline");
-      peek_expected_delimiter(in);
+    apply_procedure(procedure, args);
+  }
+}
 
-      return make_character('\n');
-    }
+object *proc_last_pair(object *arguments) {
+  object *list;
 
-    break;
+  list = car(arguments);
+
+  if (!is_pair(list)) {
+    throw_error("last-pair: not a pair", list);
   }
 
-  peek_expected_delimiter(in);
+  while (is_pair(cdr(list))) {
+    list = cdr(list);
+  }
 
-  return make_character(c);
+  return list;
 }
 
-object *read_pair(FILE *in) {
-  int c;
-  object *car_obj;
-  object *cdr_obj;
+object *proc_length(object *arguments) {
+  return make_fixnum(list_length_for(car(arguments), "length"));
+}
 
-  eat_whitespace(in);
+object *proc_list_copy(object *arguments) {
+  object *head;
+  object *tail;
+  object *list;
 
-  c = getc(in);
+  head = the_empty_list;
+  tail = the_empty_list;
 
-  if (c == ')') { /* read the empty list */
-    return the_empty_list;
+  for (list = car(arguments); is_pair(list); list = cdr(list)) {
+    list_append_cell(&head, &tail, car(list));
   }
 
-  ungetc(c, in);
+  if (is_the_empty_list(head)) {
+    return list;
+  }
 
-  car_obj = read(in);
+  set_cdr(tail, list);
 
-  eat_whitespace(in);
+  return head;
+}
 
-  c = getc(in);
+object *list_tail(object *list, object *k, char *name) {
+  char message[32];
+  long i;
 
-  if (c == '.') { /* read improper list */
-    c = peek(in);
+  if (!is_fixnum(k) || k->data.fixnum.value < 0) {
+    sprintf(message, "%s: bad index", name);
+    throw_error(message, k);
+  }
 
-    if (!is_delimiter(c)) {
-      fprintf(stderr, "dot not followed by delimiter\n");
-      exit(1);
+  for (i = k->data.fixnum.value; i > 0; i--) {
+    if (!is_pair(list)) {
+      sprintf(message, "%s: index out of range", name);
+      throw_error(message, k);
     }
 
-    cdr_obj = read(in);
-    eat_whitespace(in);
-    c = getc(in);
-
-    if (c != ')') {
-      fprintf(stderr,
-              "where was the trailing right paren?\n");
-      exit(1);
-    }
-  } else {
-    ungetc(c, in);
-    cdr_obj = read_pair(in);
+    list = cdr(list);
   }
 
-  return cons(car_obj, cdr_obj);
+  return list;
 }
 
-object *read(FILE *in) {
-  int c;
-  int i;
-  short sign = 1;
-  long num = 0;
-  char buffer[BUFFER_MAX];
+object *proc_list_ref(object *arguments) {
+  object *list;
 
-  eat_whitespace(in);
+  list = list_tail(car(arguments), cadr(arguments), "list-ref");
 
-  c = getc(in);
+  if (!is_pair(list)) {
+    throw_error("list-ref: index out of range", cadr(arguments));
+  }
 
-  if (c == '#') {
-    c = getc(in);
+  return car(list);
+}
 
-    switch (c) {
-    case 't':
-      return true;
-    case 'f':
-      return false;
-    case '\\':
-      return read_character(in);
-    default:
-      fprintf(stderr, "unknown boolean or character literal\n");
-      exit(1);
+object *proc_list_tail(object *arguments) {
+  return list_tail(car(arguments), cadr(arguments), "list-tail");
+}
+
+object *proc_map(object *arguments) {
+  object *procedure;
+  object *lists;
+  object *list;
+  object *args;
+  object *head;
+  object *tail;
+  object *args_tail;
+
+  procedure = car(arguments);
+  lists = cdr(arguments);
+  head = the_empty_list;
+  tail = the_empty_list;
+
+  if (is_the_empty_list(cdr(lists))) {
+    for (list = car(lists); is_pair(list); list = cdr(list)) {
+      list_append_cell(&head, &tail,
+                       apply_procedure(procedure,
+                                       cons(car(list), the_empty_list)));
     }
+
+    return head;
   }
 
-  if (isdigit(c) || (c == '-' && (isdigit(peek(in))))) {
-    if (c == '-') {
-      sign = -1;
-    } else {
-      ungetc(c, in);
+  /* several lists: step a private copy of the spine of cursors */
+  lists = proc_list_copy(cons(lists, the_empty_list));
+
+  while (1) {
+    args = the_empty_list;
+    args_tail = the_empty_list;
+
+    for (list = lists; !is_the_empty_list(list); list = cdr(list)) {
+      if (!is_pair(car(list))) {
+        return head;
+      }
+
+      list_append_cell(&args, &args_tail, caar(list));
+      set_car(list, cdar(list));
     }
 
-    while (isdigit(c = getc(in))) {
-      num = (num * 10) + (c - '0');
+    list_append_cell(&head, &tail, apply_procedure(procedure, args));
+  }
+}
+
+object *proc_member(object *arguments) {
+  object *obj;
+  object *list;
+  object *compare;
+
+  obj = car(arguments);
+  compare = is_the_empty_list(cddr(arguments)) ? NULL : caddr(arguments);
+
+  for (list = cadr(arguments); is_pair(list); list = cdr(list)) {
+    if (compare == NULL ?
+        is_equal(obj, car(list)) :
+        is_true(apply_procedure(compare,
+                                cons(obj, cons(car(list),
+                                               the_empty_list))))) {
+      return list;
     }
+  }
 
-    num *= sign;
+  return false;
+}
 
-    if (is_delimiter(c)) {
-      ungetc(c, in);
+object *proc_memq(object *arguments) {
+  object *obj;
+  object *list;
 
-      return make_fixnum(num);
+  obj = car(arguments);
+
+  for (list = cadr(arguments); is_pair(list); list = cdr(list)) {
+    if (is_eqv(obj, car(list))) {
+      return list;
     }
+  }
 
-    fprintf(stderr, "number not followed by delimiter\n");
-    exit(1);
+  return false;
+}
+
+object *proc_reverse(object *arguments) {
+  object *result;
+  object *list;
+
+  result = the_empty_list;
+
+  for (list = car(arguments); is_pair(list); list = cdr(list)) {
+    result = cons(car(list), result);
   }
 
-  if (is_initial(c) ||
-      ((c == '+' || c == '-') &&
-       is_delimiter(peek(in)))) { /* read a symbol */
-    i = 0;
+  if (!is_the_empty_list(list)) {
+    throw_error("reverse: not a proper list", car(arguments));
+  }
 
-    while (is_initial(c) || isdigit(c) || c == '+' || c == '-') {
-      if (i < BUFFER_MAX - 1) {
-        buffer[i++] = c;
-      } else {
-        fprintf(stderr, "symbol too long. "
-                "Maximum length is %d\n", BUFFER_MAX);
-        exit(1);
-      }
+  return result;
+}
 
-      c = getc(in);
+long vector_index(object *vector, object *k, char *name) {
+  char message[40];
+
+  if (!is_vector(vector)) {
+    sprintf(message, "%s: not a vector", name);
+    throw_error(message, vector);
+  }
+
+  if (!is_fixnum(k) ||
+      k->data.fixnum.value < 0 ||
+      k->data.fixnum.value >= vector->data.vector.length) {
+    sprintf(message, "%s: index out of range", name);
+    throw_error(message, k);
+  }
+
+  return k->data.fixnum.value;
+}
+
+object *list_to_vector(object *list, char *name) {
+  object *vector;
+  long i;
+
+  vector = make_vector(list_length_for(list, name), false);
+
+  for (i = 0; !is_the_empty_list(list); i++, list = cdr(list)) {
+    vector->data.vector.items[i] = car(list);
+  }
+
+  return vector;
+}
+
+object *vector_to_list(object *vector) {
+  object *list;
+  long i;
+
+  list = the_empty_list;
+
+  for (i = vector->data.vector.length - 1; i >= 0; i--) {
+    list = cons(vector->data.vector.items[i], list);
+  }
+
+  return list;
+}
+
+object *proc_is_vector(object *arguments) {
+  return is_vector(car(arguments)) ? true : false;
+}
+
+object *proc_list_to_vector(object *arguments) {
+  return list_to_vector(car(arguments), "list->vector");
+}
+
+object *proc_make_vector(object *arguments) {
+  if (!is_fixnum(car(arguments)) || car(arguments)->data.fixnum.value < 0) {
+    throw_error("make-vector: bad length", car(arguments));
+  }
+
+  return make_vector(car(arguments)->data.fixnum.value,
+                     is_the_empty_list(cdr(arguments)) ?
+                     false :
+                     cadr(arguments));
+}
+
+object *proc_vector(object *arguments) {
+  return list_to_vector(arguments, NULL);
+}
+
+object *proc_vector_length(object *arguments) {
+  if (!is_vector(car(arguments))) {
+    throw_error("vector-length: not a vector", car(arguments));
+  }
+
+  return make_fixnum(car(arguments)->data.vector.length);
+}
+
+object *proc_vector_ref(object *arguments) {
+  return car(arguments)->data.vector.items[
+    vector_index(car(arguments), cadr(arguments), "vector-ref")];
+}
+
+object *proc_vector_set(object *arguments) {
+  S(mutation_count)++;
+  car(arguments)->data.vector.items[
+    vector_index(car(arguments), cadr(arguments), "vector-set!")] =
+    caddr(arguments);
+
+  return S(ok_symbol);
+}
+
+object *proc_vector_to_list(object *arguments) {
+  if (!is_vector(car(arguments))) {
+    throw_error("vector->list: not a vector", car(arguments));
+  }
+
+  return vector_to_list(car(arguments));
+}
+
+/* Sorting is a stable merge sort: natural runs relinked in place for
+ * lists, a buffered bottom-up merge for vectors. When the comparator
+ * is the built-in < or > and every element is a fixnum, comparisons
+ * are done in C without calling back into eval. */
+
+#define SORT_GENERIC 0
+#define SORT_FIXNUM_LESS 1
+#define SORT_FIXNUM_GREATER 2
+
+object *proc_is_less_than(object *arguments);
+object *proc_is_greater_than(object *arguments);
+
+char sort_less(object *less, int mode, object *a, object *b) {
+  switch (mode) {
+  case SORT_FIXNUM_LESS:
+    return a->data.fixnum.value < b->data.fixnum.value;
+  case SORT_FIXNUM_GREATER:
+    return a->data.fixnum.value > b->data.fixnum.value;
+  }
+
+  return is_true(apply_procedure(less,
+                                 cons(a, cons(b, the_empty_list))));
+}
+
+int sort_mode(object *less, object **items, long count, object *list) {
+  long i;
+
+  if (!is_primitive_proc(less) ||
+      (less->data.primitive_proc.fn != proc_is_less_than &&
+       less->data.primitive_proc.fn != proc_is_greater_than)) {
+    return SORT_GENERIC;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (!is_fixnum(items[i])) {
+      return SORT_GENERIC;
     }
+  }
 
-    if (is_delimiter(c)) {
-      buffer[i] = '\0';
-      ungetc(c, in);
+  for (; is_pair(list); list = cdr(list)) {
+    if (!is_fixnum(car(list))) {
+      return SORT_GENERIC;
+    }
+  }
 
-      return make_symbol(buffer);
+  return less->data.primitive_proc.fn == proc_is_less_than ?
+    SORT_FIXNUM_LESS :
+    SORT_FIXNUM_GREATER;
+}
+
+object *merge_lists(object *a, object *b, object *less, int mode) {
+  object *head;
+  object *tail;
+  object *next;
+
+  head = the_empty_list;
+  tail = the_empty_list;
+
+  while (!is_the_empty_list(a) && !is_the_empty_list(b)) {
+    /* ties go to a, which holds the earlier elements */
+    if (sort_less(less, mode, car(b), car(a))) {
+      next = b;
+      b = cdr(b);
+    } else {
+      next = a;
+      a = cdr(a);
     }
 
-    fprintf(stderr, "symbol not followed by a delimiter. "
-            "Found '%c'\n", c);
-    exit(1);
+    if (is_the_empty_list(head)) {
+      head = next;
+    } else {
+      set_cdr(tail, next);
+    }
+
+    tail = next;
   }
 
-  if (c == '"') {
-    i = 0;
+  next = is_the_empty_list(a) ? b : a;
 
-    while ((c = getc(in)) != '"') {
-      if (c == '\\') {
-	c = getc(in);
+  if (is_the_empty_list(head)) {
+    return next;
+  }
 
-	if (c == 'n') {
-	  c = '\n';
-	}
-      }
+  set_cdr(tail, next);
 
-      if (c == EOF) {
-	fprintf(stderr, "non-terminated string literal\n");
-	exit(1);
-      }
+  return head;
+}
 
-      if (i < BUFFER_MAX - 1) {
-	buffer[i++] = c;
-      } else {
-	fprintf(stderr,
-		"string too long. Maximum length is %d\n",
-		BUFFER_MAX);
-	exit(1);
+/* Sorts a proper list by relinking its pairs. */
+object *sort_list(object *list, object *less) {
+  object *pending[64];
+  object *run;
+  object *end;
+  object *next;
+  object *result;
+  int mode;
+  int i;
+
+  mode = sort_mode(less, NULL, 0, list);
+
+  for (i = 0; i < 64; i++) {
+    pending[i] = NULL;
+  }
+
+  while (!is_the_empty_list(list)) {
+    run = list;
+    end = list;
+
+    if (is_pair(cdr(end)) && sort_less(less, mode, cadr(end), car(end))) {
+      /* a strictly descending run, reversed as it is cut off */
+      list = cdr(list);
+      set_cdr(run, the_empty_list);
+
+      while (!is_the_empty_list(list) &&
+             sort_less(less, mode, car(list), car(run))) {
+        next = cdr(list);
+        set_cdr(list, run);
+        run = list;
+        list = next;
       }
+    } else {
+      while (is_pair(cdr(end)) &&
+             !sort_less(less, mode, cadr(end), car(end))) {
+        end = cdr(end);
+      }
+
+      list = cdr(end);
+      set_cdr(end, the_empty_list);
     }
 
-    if (i == 0) { /* read the empty string */
-      return the_empty_string;
+    /* binary counter of runs: pending[i] holds about 2^i runs */
+    for (i = 0; pending[i] != NULL; i++) {
+      run = merge_lists(pending[i], run, less, mode);
+      pending[i] = NULL;
     }
 
-    buffer[i] = '\0';
+    pending[i] = run;
+  }
 
-    return make_string(buffer);
+  result = the_empty_list;
+
+  for (i = 0; i < 64; i++) {
+    if (pending[i] != NULL) {
+      result = merge_lists(pending[i], result, less, mode);
+    }
   }
 
-  if (c == '(') { /* read the empty list or pair */
-    return read_pair(in);
+  return result;
+}
+
+/* Sorts a vector's items in place. */
+void sort_vector(object *vector, object *less) {
+  object **items;
+  object **from;
+  object **to;
+  object **swap;
+  long count;
+  long width;
+  long left;
+  long middle;
+  long right;
+  long i;
+  long j;
+  long k;
+  int mode;
+
+  items = vector->data.vector.items;
+  count = vector->data.vector.length;
+  mode = sort_mode(less, items, count, the_empty_list);
+
+  from = items;
+  to = malloc((count == 0 ? 1 : count) * sizeof(object *));
+
+  if (to == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
   }
 
-  if (c == '\'') { /* read quoted expression */
-    return cons(quote_symbol, cons(read(in), the_empty_string));
+  for (width = 1; width < count; width *= 2) {
+    for (left = 0; left < count; left += 2 * width) {
+      middle = left + width < count ? left + width : count;
+      right = left + 2 * width < count ? left + 2 * width : count;
+      i = left;
+      j = middle;
+
+      for (k = left; k < right; k++) {
+        if (i < middle &&
+            (j >= right || !sort_less(less, mode, from[j], from[i]))) {
+          to[k] = from[i++];
+        } else {
+          to[k] = from[j++];
+        }
+      }
+    }
+
+    swap = from;
+    from = to;
+    to = swap;
   }
 
-  if (c == EOF) {
-    return NULL;
+  if (from != items) {
+    memcpy(items, from, count * sizeof(object *));
+    free(from);
+  } else {
+    free(to);
   }
+}
 
-  fprintf(stderr, "bad input. Unexpected '%c'\n", c);
-  exit(1);
+/* Both (sort sequence less?) and (sort less? sequence) are accepted. */
+object *sort(object *arguments, char in_place) {
+  object *sequence;
+  object *less;
+  object *copy;
+
+  sequence = car(arguments);
+  less = cadr(arguments);
+
+  if (is_primitive_proc(sequence) || is_compound_proc(sequence)) {
+    sequence = cadr(arguments);
+    less = car(arguments);
+  }
+
+  if (is_vector(sequence)) {
+    if (!in_place) {
+      copy = make_vector(sequence->data.vector.length, false);
+      memcpy(copy->data.vector.items, sequence->data.vector.items,
+             sequence->data.vector.length * sizeof(object *));
+      sequence = copy;
+    }
+
+    sort_vector(sequence, less);
+
+    return sequence;
+  }
+
+  list_length_for(sequence, in_place ? "sort!" : "sort");
+
+  return sort_list(in_place ?
+                   sequence :
+                   proc_list_copy(cons(sequence, the_empty_list)),
+                   less);
 }
 
-/* EVAL */
+object *proc_sort(object *arguments) {
+  return sort(arguments, 0);
+}
 
-object *and_tests(object *exp) {
-  return cdr(exp);
+object *proc_sort_in_place(object *arguments) {
+  S(mutation_count)++;
+
+  return sort(arguments, 1);
 }
 
-object *apply_operator(object *arguments) {
-  return car(arguments);
+object *analyze(object *exp, object *env);
+object *eval(object *exp, object *env);
+object *read_object(FILE *in);
+void note_source_form(object *form, long file, long start);
+
+object *load_stream(FILE *in) {
+  object *exp;
+  object *result;
+  long start;
+
+  result = S(ok_symbol);
+
+  while ((start = ftell(in), exp = read_object(in)) != NULL) {
+    if (in == S(source_stream)) {
+      note_source_form(exp, S(source_file_index), start);
+    }
+
+    S(toplevel_form) = exp;
+    S(running_call) = NULL;
+    result = eval(analyze(exp, S(the_global_environment)),
+                  S(the_global_environment));
+  }
+
+  return result;
 }
 
-object *prepare_apply_operands(object *arguments);
+object *read_source_file(char *filename, FILE *in);
+
+void record_trace_event(char phase, object *procedure, char *label);
+void begin_traced_load(char *filename);
+void end_traced_load(void);
+
+object *proc_load(object *arguments) {
+  char *filename;
+  FILE *in;
+  object *forms;
+  object *result;
+  object *form;
+  char traced;
+
+  filename = car(arguments)->data.string.value;
+  in = fopen(filename, "r");
+
+  if (in == NULL) {
+    throw_error("could not load file", car(arguments));
+  }
+
+  traced = tracing && !S(spawned);
+
+  if (traced) {
+    begin_traced_load(filename);
+  }
+
+  forms = read_source_file(filename, in);
+  fclose(in);
+
+  result = S(ok_symbol);
+  form = S(toplevel_form);
+
+  while (!is_the_empty_list(forms)) {
+    S(toplevel_form) = car(forms);
+    S(running_call) = NULL;
+    result = eval(analyze(car(forms), S(the_global_environment)),
+                  S(the_global_environment));
+    forms = cdr(forms);
+  }
+
+  S(toplevel_form) = form;
+
+  if (traced) {
+    end_traced_load();
+  }
+
+  return result;
+}
+
+object *proc_make_input_port(object *arguments) {
+  char *filename;
+  FILE *in;
+
+  filename = car(arguments)->data.string.value;
+  in = fopen(filename, "r");
+
+  if (in == NULL) {
+    throw_error("could not load file", car(arguments));
+  }
+
+  return make_input_port(in);
+}
+
+object *proc_mul(object *arguments) {
+  long result = 1;
+
+  while (!is_the_empty_list(arguments)) {
+    result *= (car(arguments))->data.fixnum.value;
+    arguments = cdr(arguments);
+  }
+
+  return make_fixnum(result);
+}
+
+object *proc_null_environment(object *arguments) {
+  return setup_environment();
+}
+
+object *proc_open_output_port(object *arguments) {
+  char *filename;
+  FILE *out;
+
+  filename = car(arguments)->data.string.value;
+  out = fopen(filename, "w");
+
+  if (out == NULL) {
+    throw_error("could not open file", car(arguments));
+  }
+
+  return make_output_port(out);
+}
+
+object *proc_raise(object *arguments) {
+  return raise_object(car(arguments), 0);
+}
+
+object *proc_raise_continuable(object *arguments) {
+  return raise_object(car(arguments), 1);
+}
+
+object *read_fd_port(struct fd_port *port);
+int fd_port_char(struct fd_port *port, char take);
+
+object *proc_read(object *arguments) {
+  FILE *in;
+  object *result;
+
+  if (!is_the_empty_list(arguments) &&
+      car(arguments)->data.input_port.fd_port != NULL) {
+    return read_fd_port(car(arguments)->data.input_port.fd_port);
+  }
+
+  in = is_the_empty_list(arguments) ?
+    stdin :
+    car(arguments)->data.input_port.stream;
+
+  result = read_object(in);
+
+  return result == NULL ? eof_object : result;
+}
+
+object *proc_read_char(object *arguments) {
+  FILE *in;
+  int result;
+
+  if (!is_the_empty_list(arguments) &&
+      car(arguments)->data.input_port.fd_port != NULL) {
+    result = fd_port_char(car(arguments)->data.input_port.fd_port, 1);
+
+    return result == EOF ? eof_object : make_character(result);
+  }
+
+  in = is_the_empty_list(arguments) ?
+    stdin :
+    car(arguments)->data.input_port.stream;
+
+  result = getc(in);
+
+  return result == EOF ? eof_object : make_character(result);
+}
+
+int peek(FILE *in);
+
+object *proc_peek_char(object *arguments) {
+  FILE *in;
+  int result;
+
+  if (!is_the_empty_list(arguments) &&
+      car(arguments)->data.input_port.fd_port != NULL) {
+    result = fd_port_char(car(arguments)->data.input_port.fd_port, 0);
+
+    return result == EOF ? eof_object : make_character(result);
+  }
+
+  in = is_the_empty_list(arguments) ?
+    stdin :
+    car(arguments)->data.input_port.stream;
+
+  result = peek(in);
+
+  return result == EOF ? eof_object : make_character(result);
+}
+
+void save_image(char *filename);
+
+object *proc_save_image(object *arguments) {
+  save_image(car(arguments)->data.string.value);
+
+  return S(ok_symbol);
+}
+
+object *proc_set_car(object *arguments) {
+  S(mutation_count)++;
+  set_car(car(arguments), cadr(arguments));
+
+  return S(ok_symbol);
+}
+
+object *proc_set_cdr(object *arguments) {
+  S(mutation_count)++;
+  set_cdr(car(arguments), cadr(arguments));
+
+  return S(ok_symbol);
+}
+
+object *proc_sub(object *arguments) {
+  long result;
+
+  result = (car(arguments))->data.fixnum.value;
+
+  while (!is_the_empty_list(arguments = cdr(arguments))) {
+    result -= (car(arguments))->data.fixnum.value;
+  }
+
+  return make_fixnum(result);
+}
+
+object *proc_quotient(object *arguments) {
+  return make_fixnum(((car(arguments))->data.fixnum.value) /
+		     ((cadr(arguments))->data.fixnum.value));
+
+}
+
+/* The interpreter's counters as an alist; heap-bytes counts what was
+ * ever allocated, since nothing is freed. */
+object *proc_runtime_stats(object *arguments) {
+  object *stats;
+
+  stats = the_empty_list;
+  stats = cons(cons(make_symbol("heap-bytes"), make_fixnum(S(heap_bytes))),
+               stats);
+  stats = cons(cons(make_symbol("heap-objects"), make_fixnum(S(heap_objects))),
+               stats);
+  stats = cons(cons(make_symbol("symbols"), make_fixnum(S(symbol_count))),
+               stats);
+  stats = cons(cons(make_symbol("variable-lookups"),
+                    make_fixnum(S(lookup_count))),
+               stats);
+  stats = cons(cons(make_symbol("primitive-calls"),
+                    make_fixnum(S(primitive_call_count))),
+               stats);
+  stats = cons(cons(make_symbol("procedure-calls"),
+                    make_fixnum(S(call_count))),
+               stats);
+  stats = cons(cons(make_symbol("evals"), make_fixnum(S(eval_count))), stats);
+
+  return stats;
+}
+
+object *proc_remainder(object *arguments) {
+  return make_fixnum(((car(arguments))->data.fixnum.value) %
+		     ((cadr(arguments))->data.fixnum.value));
+}
+
+object *proc_with_exception_handler(object *arguments) {
+  object *result;
+
+  S(handlers) = cons(car(arguments), S(handlers));
+  result = apply_procedure(cadr(arguments), the_empty_list);
+  S(handlers) = cdr(S(handlers));
+
+  return result;
+}
+
+void drain_fd_port(FILE *out, struct fd_port *port);
+
+/* Flushes out, which is the stream of the port arguments start with,
+ * or stdout. */
+void flush_output(FILE *out, object *arguments) {
+  if (!is_the_empty_list(arguments) &&
+      car(arguments)->data.output_port.fd_port != NULL) {
+    drain_fd_port(out, car(arguments)->data.output_port.fd_port);
+  } else {
+    fflush(out);
+  }
+}
+
+object *proc_write(object *arguments) {
+  object *exp;
+  FILE *out;
+
+  exp = car(arguments);
+  arguments = cdr(arguments);
+  out = is_the_empty_list(arguments) ?
+    stdout :
+    car(arguments)->data.output_port.stream;
+
+  write_object(out, exp);
+  flush_output(out, arguments);
+
+  return S(ok_symbol);
+}
+
+object *proc_write_char(object *arguments) {
+  object *character;
+  FILE *out;
+
+  character = car(arguments);
+  arguments = cdr(arguments);
+  out = is_the_empty_list(arguments) ?
+    stdout :
+    car(arguments)->data.output_port.stream;
+
+  putc(character->data.character.value, out);
+  flush_output(out, arguments);
+
+  return S(ok_symbol);
+}
+
+object *proc_is_boolean(object *arguments) {
+  return is_boolean(car(arguments)) ? true : false;
+}
+
+object *proc_is_char(object *arguments) {
+  return is_character(car(arguments)) ? true : false;
+}
+
+object *proc_is_eq(object *arguments) {
+  return is_eqv(car(arguments), cadr(arguments)) ? true : false;
+}
+
+object *proc_is_equal(object *arguments) {
+  return is_equal(car(arguments), cadr(arguments)) ? true : false;
+}
+
+object *proc_is_greater_than(object *arguments) {
+  long previous;
+  long next;
+
+  previous = (car(arguments))->data.fixnum.value;
+
+  while (!is_the_empty_list(arguments = cdr(arguments))) {
+    next = (car(arguments))->data.fixnum.value;
+
+    if (previous <= next) {
+      return false;
+    }
+
+    previous = next;
+  }
+
+  return true;
+}
+
+object *proc_is_integer(object *arguments) {
+  return is_fixnum(car(arguments)) ? true : false;
+}
+
+object *proc_is_less_than(object *arguments) {
+  long previous;
+  long next;
+
+  previous = (car(arguments))->data.fixnum.value;
+
+  while (!is_the_empty_list(arguments = cdr(arguments))) {
+    next = (car(arguments))->data.fixnum.value;
+
+    if (previous >= next) {
+      return false;
+    }
+
+    previous = next;
+  }
+
+  return true;
+}
+
+object *proc_is_null(object *arguments) {
+  return is_the_empty_list(car(arguments)) ? true : false;
+}
+
+object *proc_is_number_equal(object *arguments) {
+  long value;
+
+  value = (car(arguments))->data.fixnum.value;
+
+  while (!is_the_empty_list(arguments = cdr(arguments))) {
+    if (value != (car(arguments))->data.fixnum.value) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+object *proc_is_pair(object *arguments) {
+  return is_pair(car(arguments)) ? true : false;
+}
+
+object *proc_is_procedure(object *arguments) {
+  object *obj;
+
+  obj = car(arguments);
+
+  return (is_primitive_proc(obj) ||
+          is_compound_proc(obj) ||
+          is_continuation(obj)) ? true : false;
+}
+
+object *proc_is_string(object *arguments) {
+  return is_string(car(arguments)) ? true : false;
+}
+
+object *proc_is_symbol(object *arguments) {
+  return is_symbol(car(arguments)) ? true : false;
+}
+
+object *proc_char_to_integer(object *arguments) {
+  return make_fixnum((car(arguments))->data.character.value);
+}
+
+object *proc_integer_to_char(object *arguments) {
+  return make_character((car(arguments))->data.fixnum.value);
+}
+
+object *proc_number_to_string(object *arguments) {
+  char buffer[100];
+
+  sprintf(buffer, "%ld", (car(arguments))->data.fixnum.value);
+
+  return make_string(buffer);
+}
+
+object *proc_string_to_number(object *arguments) {
+  return make_fixnum(atoi((car(arguments))->data.string.value));
+}
+
+object *proc_string_to_symbol(object *arguments) {
+  return make_symbol((car(arguments))->data.string.value);
+}
+
+object *proc_symbol_to_string(object *arguments) {
+  return make_string((car(arguments))->data.symbol.value);
+}
+
+char stdlib_source[] =
+#include "stdlib_source.h"
+  ;
+
+void eval_string(char *str);
+
+void init_symbols(void) {
+  S(and_symbol) = make_symbol("and");
+  S(arrow_symbol) = make_symbol("=>");
+  S(begin_symbol) = make_symbol("begin");
+  S(case_symbol) = make_symbol("case");
+  S(define_symbol) = make_symbol("define");
+  S(define_syntax_symbol) = make_symbol("define-syntax");
+  S(ellipsis_symbol) = make_symbol("...");
+  S(else_symbol) = make_symbol("else");
+  S(er_macro_transformer_symbol) = make_symbol("er-macro-transformer");
+  S(guard_symbol) = make_symbol("guard");
+  S(if_symbol) = make_symbol("if");
+  S(lambda_symbol) = make_symbol("lambda");
+  S(let_symbol) = make_symbol("let");
+  S(ok_symbol) = make_symbol("ok");
+  S(or_symbol) = make_symbol("or");
+  S(quote_symbol) = make_symbol("quote");
+  S(set_symbol) = make_symbol("set!");
+  S(syntax_rules_symbol) = make_symbol("syntax-rules");
+  S(underscore_symbol) = make_symbol("_");
+}
+
+void init_macros(void);
+object *proc_compare(object *arguments);
+object *proc_profile(object *arguments);
+object *proc_call_with_timing(object *arguments);
+object *proc_track_allocations(object *arguments);
+object *proc_allocation_report(object *arguments);
+object *proc_trace_events(object *arguments);
+object *proc_trace_dump(object *arguments);
+object *proc_rename(object *arguments);
+object *proc_make_channel(object *arguments);
+object *proc_channel_send(object *arguments);
+object *proc_channel_receive(object *arguments);
+object *proc_spawn(object *arguments);
+object *proc_isolate_join(object *arguments);
+object *proc_parallel_map(object *arguments);
+object *proc_parallel_for_each(object *arguments);
+object *proc_make_thread(object *arguments);
+object *proc_thread_start(object *arguments);
+object *proc_thread_yield(object *arguments);
+object *proc_thread_join(object *arguments);
+object *proc_current_thread(object *arguments);
+object *proc_is_thread(object *arguments);
+object *proc_make_mutex(object *arguments);
+object *proc_mutex_lock(object *arguments);
+object *proc_mutex_unlock(object *arguments);
+object *proc_is_mutex(object *arguments);
+object *proc_make_condition_variable(object *arguments);
+object *proc_condition_variable_signal(object *arguments);
+object *proc_condition_variable_broadcast(object *arguments);
+object *proc_is_condition_variable(object *arguments);
+object *proc_open_fd_input_port(object *arguments);
+object *proc_open_fd_output_port(object *arguments);
+object *proc_open_pipe(object *arguments);
+object *proc_open_unix_socket(object *arguments);
+object *proc_with_timeout(object *arguments);
+object *proc_serve_repl(object *arguments);
+
+/* The constants outlive any one interpreter, so are not in an arena. */
+object *alloc_constant(object_type type) {
+  object *obj;
+
+  obj = malloc(sizeof(object));
+
+  if (obj == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  obj->type = type;
+  count_allocation(type, 1, sizeof(object));
+
+  return obj;
+}
+
+/* the constants are made once, by the first interpreter */
+void init_constants(void) {
+  if (the_empty_list != NULL) {
+    return;
+  }
+
+  the_empty_list = alloc_constant(THE_EMPTY_LIST);
+
+  the_empty_string = alloc_constant(THE_EMPTY_STRING);
+
+  false = alloc_constant(BOOLEAN);
+  false->data.boolean.value = 0;
+
+  true = alloc_constant(BOOLEAN);
+  true->data.boolean.value = 1;
+
+  eof_object = alloc_constant(EOF_OBJECT);
+
+  the_empty_environment = the_empty_list;
+}
+
+void init_model(void) {
+  init_constants();
+
+  S(symbol_table) = the_empty_list;
+  index_symbol_table();
+  init_symbols();
+
+  S(live_continuations) = NULL;
+  S(top_level) = NULL;
+  S(expired).escape_only = 1;
+  S(expired).kept = 1;
+  S(expired).saved_winders = the_empty_list;
+  S(expired).saved_handlers = the_empty_list;
+  S(winders) = the_empty_list;
+  S(handlers) = the_empty_list;
+  S(command_line) = the_empty_list;
+
+  init_macros();
+}
+
+void init(void) {
+  init_model();
+
+  S(the_global_environment) = make_environment();
+
+  eval_string(stdlib_source);
+}
+
+void load_image(char *filename);
+
+void init_from_image(char *filename) {
+  init_model();
+
+  /* only for the side effect of registering the primitives */
+  populate_environment(setup_environment());
+
+  load_image(filename);
+}
+
+void populate_environment(object *env) {
+
+#define add_procedure(scheme_name, c_name) \
+  register_primitive(scheme_name, c_name); \
+  define_variable(make_symbol(scheme_name), \
+		  make_primitive_proc(c_name), \
+		  env);
+
+  add_procedure("null?", proc_is_null);
+  add_procedure("boolean?", proc_is_boolean);
+  add_procedure("symbol?", proc_is_symbol);
+  add_procedure("integer?", proc_is_integer);
+  add_procedure("char?", proc_is_char);
+  add_procedure("string?", proc_is_string);
+  add_procedure("pair?", proc_is_pair);
+  add_procedure("procedure?", proc_is_procedure);
+
+  add_procedure("char->integer", proc_char_to_integer);
+  add_procedure("integer->char", proc_integer_to_char);
+  add_procedure("number->string", proc_number_to_string);
+  add_procedure("string->number", proc_string_to_number);
+  add_procedure("symbol->string", proc_symbol_to_string);
+  add_procedure("string->symbol", proc_string_to_symbol);
+
+  add_procedure("+", proc_add);
+  add_procedure("-", proc_sub);
+  add_procedure("*", proc_mul);
+  add_procedure("quotient", proc_quotient);
+  add_procedure("remainder", proc_remainder);
+  add_procedure("=", proc_is_number_equal);
+  add_procedure("<", proc_is_less_than);
+  add_procedure(">", proc_is_greater_than);
+
+  add_procedure("cons", proc_cons);
+  add_procedure("car", proc_car);
+  add_procedure("cdr", proc_cdr);
+  add_procedure("set-car!", proc_set_car);
+  add_procedure("set-cdr!", proc_set_cdr);
+  add_procedure("list", proc_list);
+
+  add_procedure("caar", proc_caar);
+  add_procedure("cadr", proc_cadr);
+  add_procedure("cdar", proc_cdar);
+  add_procedure("cddr", proc_cddr);
+  add_procedure("caaar", proc_caaar);
+  add_procedure("caadr", proc_caadr);
+  add_procedure("cadar", proc_cadar);
+  add_procedure("caddr", proc_caddr);
+  add_procedure("cdaar", proc_cdaar);
+  add_procedure("cdadr", proc_cdadr);
+  add_procedure("cddar", proc_cddar);
+  add_procedure("cdddr", proc_cdddr);
+  add_procedure("caaaar", proc_caaaar);
+  add_procedure("caaadr", proc_caaadr);
+  add_procedure("caadar", proc_caadar);
+  add_procedure("caaddr", proc_caaddr);
+  add_procedure("cadaar", proc_cadaar);
+  add_procedure("cadadr", proc_cadadr);
+  add_procedure("caddar", proc_caddar);
+  add_procedure("cadddr", proc_cadddr);
+  add_procedure("cdaaar", proc_cdaaar);
+  add_procedure("cdaadr", proc_cdaadr);
+  add_procedure("cdadar", proc_cdadar);
+  add_procedure("cdaddr", proc_cdaddr);
+  add_procedure("cddaar", proc_cddaar);
+  add_procedure("cddadr", proc_cddadr);
+  add_procedure("cdddar", proc_cdddar);
+  add_procedure("cddddr", proc_cddddr);
+
+  add_procedure("length", proc_length);
+  add_procedure("append", proc_append);
+  add_procedure("reverse", proc_reverse);
+  add_procedure("list-tail", proc_list_tail);
+  add_procedure("list-ref", proc_list_ref);
+  add_procedure("list-copy", proc_list_copy);
+  add_procedure("last-pair", proc_last_pair);
+  add_procedure("memq", proc_memq);
+  add_procedure("memv", proc_memq);
+  add_procedure("member", proc_member);
+  add_procedure("assq", proc_assq);
+  add_procedure("assv", proc_assq);
+  add_procedure("assoc", proc_assoc);
+  add_procedure("map", proc_map);
+  add_procedure("for-each", proc_for_each);
+
+  add_procedure("vector?", proc_is_vector);
+  add_procedure("make-vector", proc_make_vector);
+  add_procedure("vector", proc_vector);
+  add_procedure("vector-length", proc_vector_length);
+  add_procedure("vector-ref", proc_vector_ref);
+  add_procedure("vector-set!", proc_vector_set);
+  add_procedure("vector->list", proc_vector_to_list);
+  add_procedure("list->vector", proc_list_to_vector);
+
+  add_procedure("sort", proc_sort);
+  add_procedure("sort!", proc_sort_in_place);
+  add_procedure("list-sort", proc_sort);
+  add_procedure("vector-sort", proc_sort);
+  add_procedure("vector-sort!", proc_sort_in_place);
+
+  add_procedure("eq?", proc_is_eq);
+  add_procedure("eqv?", proc_is_eq);
+  add_procedure("equal?", proc_is_equal);
+
+  add_procedure("apply", proc_apply);
+  add_procedure("interaction-environment",
+                proc_interaction_environment);
+  add_procedure("null-environment", proc_null_environment);
+  add_procedure("environment", proc_environment);
+  add_procedure("eval", proc_eval);
+
+  /* passed to er-macro-transformer procedures, not bound */
+  register_primitive("rename", proc_rename);
+  register_primitive("compare", proc_compare);
+
+  add_procedure("call-with-current-continuation", proc_call_cc);
+  add_procedure("call/cc", proc_call_cc);
+  add_procedure("dynamic-wind", proc_dynamic_wind);
+
+  add_procedure("profile", proc_profile);
+  add_procedure("track-allocations", proc_track_allocations);
+  add_procedure("allocation-report", proc_allocation_report);
+  add_procedure("trace-events", proc_trace_events);
+  add_procedure("trace-dump", proc_trace_dump);
+
+  add_procedure("load", proc_load);
+  add_procedure("save-image", proc_save_image);
+  add_procedure("open-input-port", proc_make_input_port);
+  add_procedure("close-input-port", proc_close_input_port);
+  add_procedure("input-port?", proc_is_input_port);
+  add_procedure("read", proc_read);
+  add_procedure("read-char", proc_read_char);
+  add_procedure("peek-char", proc_peek_char);
+  add_procedure("eof-object?", proc_is_eof_object);
+  add_procedure("open-output-port", proc_open_output_port);
+  add_procedure("close-output-port", proc_close_output_port);
+  add_procedure("output-port?", proc_is_output_port);
+  add_procedure("write-char", proc_write_char);
+  add_procedure("write", proc_write);
+
+  add_procedure("command-line", proc_command_line);
+  add_procedure("exit", proc_exit);
+
+  add_procedure("current-jiffy", proc_current_jiffy);
+  add_procedure("jiffies-per-second", proc_jiffies_per_second);
+  add_procedure("runtime-stats", proc_runtime_stats);
+  add_procedure("call-with-timing", proc_call_with_timing);
+
+  add_procedure("spawn", proc_spawn);
+  add_procedure("isolate-join", proc_isolate_join);
+  add_procedure("make-channel", proc_make_channel);
+  add_procedure("channel-send", proc_channel_send);
+  add_procedure("channel-receive", proc_channel_receive);
+  add_procedure("parallel-map", proc_parallel_map);
+  add_procedure("parallel-for-each", proc_parallel_for_each);
+
+  add_procedure("make-thread", proc_make_thread);
+  add_procedure("thread-start!", proc_thread_start);
+  add_procedure("thread-yield!", proc_thread_yield);
+  add_procedure("thread-join!", proc_thread_join);
+  add_procedure("current-thread", proc_current_thread);
+  add_procedure("thread?", proc_is_thread);
+  add_procedure("make-mutex", proc_make_mutex);
+  add_procedure("mutex-lock!", proc_mutex_lock);
+  add_procedure("mutex-unlock!", proc_mutex_unlock);
+  add_procedure("mutex?", proc_is_mutex);
+  add_procedure("make-condition-variable", proc_make_condition_variable);
+  add_procedure("condition-variable-signal!",
+                proc_condition_variable_signal);
+  add_procedure("condition-variable-broadcast!",
+                proc_condition_variable_broadcast);
+  add_procedure("condition-variable?", proc_is_condition_variable);
+  add_procedure("open-fd-input-port", proc_open_fd_input_port);
+  add_procedure("open-fd-output-port", proc_open_fd_output_port);
+  add_procedure("open-pipe", proc_open_pipe);
+  add_procedure("open-unix-socket", proc_open_unix_socket);
+  add_procedure("with-timeout", proc_with_timeout);
+  add_procedure("serve-repl", proc_serve_repl);
+
+  add_procedure("error", proc_error);
+  add_procedure("error-object?", proc_is_error_object);
+  add_procedure("error-object-message", proc_error_object_message);
+  add_procedure("error-object-irritants", proc_error_object_irritants);
+  add_procedure("raise", proc_raise);
+  add_procedure("raise-continuable", proc_raise_continuable);
+  add_procedure("with-exception-handler", proc_with_exception_handler);
+}
+
+/* SOURCE LOCATIONS */
+
+/* Reading a source file notes only where each top-level form starts.
+ * The locations of the pairs inside a form are worked out the first
+ * time one is asked for, by reading the forms again from their files
+ * and matching the copies against the originals pair by pair, so
+ * loading pays next to nothing for them.  Analysis notes, for the
+ * lambdas and macro expansions it makes, the form they came from.
+ * Lines and columns are found when a location is written. */
+
+#define SOURCE_FILES_MAX 4096
+
+typedef struct source_file {
+  char *name;
+  long size; /* the file's size and time when first read, to */
+  long mtime; /* tell when it has changed since */
+  long *lines; /* offsets where lines start, or NULL until needed */
+  long line_count;
+} source_file;
+
+typedef struct source_form {
+  object *form;
+  long file;
+  long start; /* offset to read the form again from */
+} source_form;
+
+/* the files are shared by all interpreters; the forms and tables are
+ * in each one's context */
+source_file source_files[SOURCE_FILES_MAX];
+long source_file_count;
+pthread_mutex_t source_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the index for filename, or -1 if there are too many files. */
+long source_file_number(char *filename) {
+  struct stat st;
+  long i;
+
+  pthread_mutex_lock(&source_files_lock);
+
+  for (i = 0; i < source_file_count; i++) {
+    if (strcmp(source_files[i].name, filename) == 0) {
+      break;
+    }
+  }
+
+  if (i == source_file_count &&
+      (i == SOURCE_FILES_MAX || stat(filename, &st) != 0)) {
+    i = -1;
+  } else if (i == source_file_count) {
+    source_files[i].name = malloc(strlen(filename) + 1);
+
+    if (source_files[i].name == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+
+    strcpy(source_files[i].name, filename);
+    source_files[i].size = st.st_size;
+    source_files[i].mtime = st.st_mtime;
+    source_files[i].lines = NULL;
+    source_file_count++;
+  }
+
+  pthread_mutex_unlock(&source_files_lock);
+
+  return i;
+}
+
+/* Has load note the forms it reads from in as being from file; a
+ * NULL stream or a file of -1 stops it. */
+void record_source_forms(FILE *in, long file) {
+  S(source_stream) = file < 0 ? NULL : in;
+  S(source_file_index) = file;
+}
+
+void note_source_form(object *form, long file, long start) {
+  if (!is_pair(form) || file < 0 || start < 0) {
+    return;
+  }
+
+  if (S(source_form_count) == S(source_form_capacity)) {
+    S(source_form_capacity) = S(source_form_capacity) == 0 ?
+      256 : 2 * S(source_form_capacity);
+    S(source_forms) = realloc(S(source_forms),
+                              S(source_form_capacity) * sizeof(source_form));
+
+    if (S(source_forms) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  S(source_forms)[S(source_form_count)].form = form;
+  S(source_forms)[S(source_form_count)].file = file;
+  S(source_forms)[S(source_form_count)].start = start;
+  S(source_form_count)++;
+}
+
+/* Notes that analysis made made from the source form from. */
+void note_source_origin(object *made, object *from) {
+  if (made == from || !is_pair(made) || !is_pair(from)) {
+    return;
+  }
+
+  if (S(source_origins) == NULL) {
+    S(source_origins) = make_object_table();
+  }
+
+  object_table_put(S(source_origins), made, (long)from);
+}
+
+/* Called by read for each pair it makes from locating_stream. */
+void set_source_location(object *pair, long offset) {
+  object_table_put(S(source_locations),
+                   pair, offset * SOURCE_FILES_MAX + S(locating_file));
+}
+
+/* Gives the pairs in original the locations of the same pairs in
+ * copy, as far as the two have the same shape. */
+void match_source_locations(object *original, object *copy) {
+  long location;
+
+  while (is_pair(original) && is_pair(copy)) {
+    location = object_table_get(S(source_locations), copy, -1);
+
+    if (location != -1) {
+      object_table_put(S(source_locations), original, location);
+    }
+
+    match_source_locations(car(original), car(copy));
+    original = cdr(original);
+    copy = cdr(copy);
+  }
+}
+
+/* Reads again the forms noted since the last call, from files that
+ * have not changed, to find where their pairs are. */
+void locate_source_forms(void) {
+  source_form *entry;
+  struct stat st;
+  FILE *in;
+  object *copy;
+  long file;
+
+  if (S(source_locations) == NULL) {
+    S(source_locations) = make_object_table();
+  }
+
+  in = NULL;
+  file = -1;
+
+  for (; S(source_forms_located) < S(source_form_count);
+       S(source_forms_located)++) {
+    entry = &S(source_forms)[S(source_forms_located)];
+
+    if (entry->file != file) {
+      if (in != NULL) {
+        fclose(in);
+      }
+
+      file = entry->file;
+      in = fopen(source_files[file].name, "r");
+
+      if (in != NULL &&
+          (fstat(fileno(in), &st) != 0 ||
+           st.st_size != source_files[file].size ||
+           st.st_mtime != source_files[file].mtime)) {
+        fclose(in);
+        in = NULL;
+      }
+    }
+
+    if (in == NULL || fseek(in, entry->start, SEEK_SET) != 0) {
+      continue;
+    }
+
+    S(locating_stream) = in;
+    S(locating_file) = file;
+    copy = read_object(in);
+    S(locating_stream) = NULL;
+    match_source_locations(entry->form, copy);
+  }
+
+  if (in != NULL) {
+    fclose(in);
+  }
+}
+
+/* The location of a pair read from a file, or of the form analysis
+ * made it from, or -1. */
+long source_location(object *obj) {
+  long location;
+
+  if (!is_pair(obj) || S(source_form_count) == 0) {
+    return -1;
+  }
+
+  if (S(source_forms_located) < S(source_form_count)) {
+    locate_source_forms();
+  }
+
+  while ((location = object_table_get(S(source_locations), obj, -1)) == -1 &&
+         S(source_origins) != NULL &&
+         (obj = (object *)object_table_get(S(source_origins), obj, 0)) !=
+         NULL) {
+  }
+
+  return location;
+}
+
+void load_source_lines(source_file *file) {
+  FILE *in;
+  long capacity;
+  long offset;
+  int c;
+
+  capacity = 256;
+  file->lines = malloc(capacity * sizeof(long));
+
+  if (file->lines == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  file->lines[0] = 0;
+  file->line_count = 1;
+  in = fopen(file->name, "r");
+
+  for (offset = 1; in != NULL && (c = getc(in)) != EOF; offset++) {
+    if (c != '\n') {
+      continue;
+    }
+
+    if (file->line_count == capacity) {
+      capacity *= 2;
+      file->lines = realloc(file->lines, capacity * sizeof(long));
+
+      if (file->lines == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+      }
+    }
+
+    file->lines[file->line_count++] = offset;
+  }
+
+  if (in != NULL) {
+    fclose(in);
+  }
+}
+
+/* Writes file:line:column for obj and returns 1, or returns 0 if obj
+ * has no location. */
+char write_source_location(FILE *out, object *obj) {
+  source_file *file;
+  long location;
+  long offset;
+  long low;
+  long high;
+  long middle;
+
+  location = source_location(obj);
+
+  if (location == -1) {
+    return 0;
+  }
+
+  file = &source_files[location % SOURCE_FILES_MAX];
+  offset = location / SOURCE_FILES_MAX;
+
+  pthread_mutex_lock(&source_files_lock);
+
+  if (file->lines == NULL) {
+    load_source_lines(file);
+  }
+
+  pthread_mutex_unlock(&source_files_lock);
+
+  /* the last line starting at or before offset */
+  low = 0;
+  high = file->line_count - 1;
+
+  while (low < high) {
+    middle = (low + high + 1) / 2;
+
+    if (file->lines[middle] <= offset) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+
+  fprintf(out, "%s:%ld:%ld",
+          file->name, low + 1, offset - file->lines[low] + 1);
+
+  return 1;
+}
+
+/* READ */
+
+char is_delimiter(int c) {
+  return isspace(c) || c == EOF ||
+    c == '(' || c == ')' ||
+    c == '"' || c == ';';
+}
+
+int peek(FILE *in) {
+  int c;
+
+  c = getc(in);
+  ungetc(c, in);
+
+  return c;
+}
+
+void eat_whitespace(FILE *in) {
+  int c;
+
+  while ((c = getc(in)) != EOF) {
+    if (isspace(c)) {
+      continue;
+    }
+
+    if (c == ';') {
+      while (((c = getc(in)) != EOF) && (c != '\n'));
+      continue;
+    }
+
+    ungetc(c, in);
+
+    break;
+  }
+}
+
+object *list_to_vector(object *list, char *name);
+
+object *read_error_irritant(int c) {
+  return c == EOF ? eof_object : make_character(c);
+}
+
+void eat_expected_string(FILE *in, char *str) {
+  int c;
+
+  while (*str != '\0') {
+    c = getc(in);
+
+    if (c != *str) {
+      throw_error("unexpected character", read_error_irritant(c));
+    }
+
+    str++;
+  }
+}
+
+void peek_expected_delimiter(FILE *in) {
+  if (!is_delimiter(peek(in))) {
+    throw_error("character not followed by delimiter", NULL);
+  }
+}
+
+object *read_character(FILE *in) {
+  int c;
+
+  c = getc(in);
+
+  switch (c) {
+  case EOF:
+    throw_error("incomplete character literal", NULL);
+  case 's':
+    if (peek(in) == 'p') {
+      eat_expected_string(in, "pace");
+      peek_expected_delimiter(in);
+
+      return make_character(' ');
+    }
+
+    break;
+  case 'n':
+    if (peek(in) == 'e') {
+      eat_expected_string(in, "ewline");
+      peek_expected_delimiter(in);
+
+      return make_character('\n');
+    }
+
+    break;
+  }
+
+  peek_expected_delimiter(in);
+
+  return make_character(c);
+}
+
+object *read_pair(FILE *in) {
+  int c;
+  object *car_obj;
+  object *cdr_obj;
+  object *pair;
+  long offset;
+
+  eat_whitespace(in);
+
+  c = getc(in);
+
+  if (c == ')') { /* read the empty list */
+    return the_empty_list;
+  }
+
+  if (c == EOF) {
+    throw_error("unexpected end of file in list", NULL);
+  }
+
+  ungetc(c, in);
+
+  offset = in == S(locating_stream) ? ftell(in) : -1;
+  car_obj = read_object(in);
+
+  eat_whitespace(in);
+
+  c = getc(in);
+
+  if (c == '.' && peek(in) == '.') { /* a symbol such as ... */
+    ungetc(c, in);
+    cdr_obj = read_pair(in);
+  } else if (c == '.') { /* read improper list */
+    c = peek(in);
+
+    if (!is_delimiter(c)) {
+      throw_error("dot not followed by delimiter", NULL);
+    }
+
+    cdr_obj = read_object(in);
+    eat_whitespace(in);
+    c = getc(in);
+
+    if (c != ')') {
+      throw_error("where was the trailing right paren?", NULL);
+    }
+  } else {
+    ungetc(c, in);
+    cdr_obj = read_pair(in);
+  }
+
+  pair = cons(car_obj, cdr_obj);
+
+  if (offset >= 0) {
+    set_source_location(pair, offset);
+  }
+
+  return pair;
+}
+
+object *read_object(FILE *in) {
+  int c;
+  int i;
+  short sign = 1;
+  long num = 0;
+  long offset;
+  object *obj;
+  char buffer[BUFFER_MAX];
+
+  eat_whitespace(in);
+
+  c = getc(in);
+
+  if (c == '#') {
+    c = getc(in);
+
+    switch (c) {
+    case 't':
+      return true;
+    case 'f':
+      return false;
+    case '\\':
+      return read_character(in);
+    case '(':
+      return list_to_vector(read_pair(in), NULL);
+    default:
+      throw_error("unknown boolean or character literal",
+                  read_error_irritant(c));
+    }
+  }
+
+  if (isdigit(c) || (c == '-' && (isdigit(peek(in))))) {
+    if (c == '-') {
+      sign = -1;
+    } else {
+      ungetc(c, in);
+    }
+
+    while (isdigit(c = getc(in))) {
+      num = (num * 10) + (c - '0');
+    }
+
+    num *= sign;
+
+    if (is_delimiter(c)) {
+      ungetc(c, in);
+
+      return make_fixnum(num);
+    }
+
+    throw_error("number not followed by delimiter", NULL);
+  }
+
+  if (is_initial(c) ||
+      (c == '.' && peek(in) == '.') ||
+      ((c == '+' || c == '-') &&
+       is_delimiter(peek(in)))) { /* read a symbol */
+    i = 0;
+
+    while (is_initial(c) || isdigit(c) || c == '+' || c == '-' ||
+           c == '.') {
+      if (i < BUFFER_MAX - 1) {
+        buffer[i++] = c;
+      } else {
+        throw_error("symbol too long. Maximum length is",
+                    make_fixnum(BUFFER_MAX));
+      }
+
+      c = getc(in);
+    }
+
+    if (is_delimiter(c)) {
+      buffer[i] = '\0';
+      ungetc(c, in);
+
+      return make_symbol(buffer);
+    }
+
+    throw_error("symbol not followed by a delimiter. Found",
+                read_error_irritant(c));
+  }
+
+  if (c == '"') {
+    i = 0;
+
+    while ((c = getc(in)) != '"') {
+      if (c == '\\') {
+	c = getc(in);
+
+	if (c == 'n') {
+	  c = '\n';
+	}
+      }
+
+      if (c == EOF) {
+	throw_error("non-terminated string literal", NULL);
+      }
+
+      if (i < BUFFER_MAX - 1) {
+	buffer[i++] = c;
+      } else {
+	throw_error("string too long. Maximum length is",
+		    make_fixnum(BUFFER_MAX));
+      }
+    }
+
+    if (i == 0) { /* read the empty string */
+      return the_empty_string;
+    }
+
+    buffer[i] = '\0';
+
+    return make_string(buffer);
+  }
+
+  if (c == '(') { /* read the empty list or pair */
+    offset = in == S(locating_stream) ? ftell(in) - 1 : -1;
+    obj = read_pair(in);
+
+    /* a list is where its parenthesis is */
+    if (offset >= 0 && is_pair(obj)) {
+      set_source_location(obj, offset);
+    }
+
+    return obj;
+  }
+
+  if (c == '\'') { /* read quoted expression */
+    offset = in == S(locating_stream) ? ftell(in) - 1 : -1;
+    obj = read_object(in);
+
+    if (obj == NULL) {
+      throw_error("unexpected end of file after quote", NULL);
+    }
+
+    obj = cons(S(quote_symbol), cons(obj, the_empty_list));
+
+    if (offset >= 0) {
+      set_source_location(obj, offset);
+    }
+
+    return obj;
+  }
+
+  if (c == EOF) {
+    return NULL;
+  }
+
+  throw_error("bad input. Unexpected", read_error_irritant(c));
+}
+
+/* EVAL */
+
+object *and_tests(object *exp) {
+  return cdr(exp);
+}
+
+object *apply_operator(object *arguments) {
+  return car(arguments);
+}
+
+object *prepare_apply_operands(object *arguments);
+
+object *apply_operands(object *arguments) {
+  return prepare_apply_operands(cdr(arguments));
+}
+
+object *assignment_value(object *exp) {
+  return caddr(exp);
+}
+
+object *assignment_variable(object *exp) {
+  return cadr(exp);
+}
+
+object *begin_actions(object *exp) {
+  return cdr(exp);
+}
+
+object *cond_actions(object *clause) {
+  return cdr(clause);
+}
+
+object *cond_predicate(object *clause) {
+  return car(clause);
+}
+
+object *make_lambda(object *parameters, object *body);
+
+object *definition_value(object *exp) {
+  if (is_symbol(cadr(exp))) {
+      return caddr(exp);
+  }
+
+  return make_lambda(cdadr(exp), cddr(exp));
+}
+
+object *definition_variable(object *exp) {
+  if (is_symbol(cadr(exp))) {
+    return cadr(exp);
+  }
+
+  return caadr(exp);
+}
+
+/* Definitions made in an environment other than the global one are
+ * not counted where they are made, so eval counts them here. */
+object *eval_environment(object *arguments) {
+  if (cadr(arguments) != S(the_global_environment)) {
+    S(mutation_count)++;
+  }
+
+  return cadr(arguments);
+}
+
+object *eval_expression(object *arguments) {
+  return car(arguments);
+}
+
+char is_cond_else_clause(object *clause);
+object *sequence_to_exp(object *seq);
+
+object *first_exp(object *seq) {
+  return car(seq);
+}
+
+object *first_operand(object *ops) {
+  return car(ops);
+}
+
+/* A fold node is (fold value . original): value was computed at
+ * analysis time from primitives whose binding cells the fold lists as
+ * (cell . primitive) pairs, and original is what to run instead once
+ * any of them is redefined. */
+object *fold_value(object *exp) {
+  return cadr(exp);
+}
+
+object *fold_original(object *exp) {
+  return cddr(exp);
+}
+
+char is_fold_valid(object *fold) {
+  object *deps;
+
+  for (deps = fold->data.inline_proc.cell;
+       !is_the_empty_list(deps);
+       deps = cdr(deps)) {
+    if (car(caar(deps)) != cdar(deps)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* A case node is (case key body ...), the last body for else.  Its
+ * cell is the dispatch table, a vector of the tails of that list whose
+ * car is the body to run.  Its primitive is the smallest key when the
+ * table is indexed by key, or () when the table is hashed: then slot i
+ * holds a key at 2i and its tail at 2i + 1, and a free slot holds the
+ * table itself and the else tail. */
+object *case_key(object *exp) {
+  return cadr(exp);
+}
+
+object *case_bodies(object *exp) {
+  return cddr(exp);
+}
+
+long case_ordinal(object *key) {
+  return is_fixnum(key) ?
+    key->data.fixnum.value :
+    (unsigned char)key->data.character.value;
+}
+
+/* Hashes keys that are eqv? alike; symbols by name, which stays the
+ * same in a heap image. */
+unsigned long case_hash(object *key) {
+  unsigned long hash;
+  char *c;
+
+  switch (key->type) {
+  case FIXNUM:
+  case CHARACTER:
+    return case_ordinal(key);
+  case STRING:
+  case SYMBOL:
+    hash = 0;
+
+    for (c = key->type == STRING ?
+           key->data.string.value :
+           key->data.symbol.value;
+         *c != '\0';
+         c++) {
+      hash = hash * 31 + (unsigned char)*c;
+    }
+
+    return hash;
+  default:
+    return key->type;
+  }
+}
+
+/* Returns the body a case node runs for key. */
+object *case_branch(object *node, object *key) {
+  object *table;
+  object *low;
+  object **items;
+  unsigned long mask;
+  unsigned long i;
+  long offset;
+
+  table = node->data.inline_proc.cell;
+  low = node->data.inline_proc.primitive;
+  items = table->data.vector.items;
+
+  if (is_the_empty_list(low)) {
+    mask = table->data.vector.length / 2 - 1;
+
+    for (i = case_hash(key) & mask; ; i = (i + 1) & mask) {
+      if (items[2 * i] == table || is_eqv(items[2 * i], key)) {
+        return car(items[2 * i + 1]);
+      }
+    }
+  }
+
+  offset = key->type == low->type ? case_ordinal(key) - case_ordinal(low) : -1;
+
+  if (offset < 0 || offset >= table->data.vector.length - 1) {
+    offset = table->data.vector.length - 1;
+  }
+
+  return car(items[offset]);
+}
+
+object *guard_body(object *exp) {
+  return cddr(exp);
+}
+
+object *guard_clauses(object *exp) {
+  return cdadr(exp);
+}
+
+object *guard_variable(object *exp) {
+  return caadr(exp);
+}
+
+object *if_alternative(object *exp) {
+  if (is_the_empty_list(cdddr(exp))) {
+    return false;
+  }
+
+  return cadddr(exp);
+}
+
+object *if_consequent(object *exp) {
+  return caddr(exp);
+}
+
+object *if_predicate(object *exp) {
+  return cadr(exp);
+}
+
+char is_tagged_list(object *exp, object *tag);
+
+char is_application(object *exp) {
+  return is_pair(exp);
+}
+
+char is_assignment(object *exp) {
+  return is_tagged_list(exp, S(set_symbol));
+}
+
+char is_and(object *exp) {
+  return is_tagged_list(exp, S(and_symbol));
+}
+
+char is_begin(object *exp) {
+  return is_tagged_list(exp, S(begin_symbol));
+}
+
+char is_cond_else_clause(object *clause) {
+  return cond_predicate(clause) == S(else_symbol);
+}
+
+char is_definition(object *exp) {
+  return is_tagged_list(exp, S(define_symbol));
+}
+
+char is_guard(object *exp) {
+  return is_tagged_list(exp, S(guard_symbol));
+}
+
+char is_if(object *exp) {
+  return is_tagged_list(exp, S(if_symbol));
+}
+
+char is_lambda(object *exp) {
+  return is_tagged_list(exp, S(lambda_symbol));
+}
+
+char is_inline_call(object *exp) {
+  return is_pair(exp) && is_inline_proc(car(exp));
+}
+
+/* A loop node is (loop body init ...), a named let whose calls to its
+ * tag all became jumps: recur nodes (recur operand ...) whose cell is
+ * the loop node.  The loop node's cell is the loop's variables, which
+ * also tell its frame apart, and its primitive is the body again. */
+object *loop_body(object *exp) {
+  return cadr(exp);
+}
+
+object *loop_inits(object *exp) {
+  return cddr(exp);
+}
+
+char is_last_exp(object *seq) {
+  return is_the_empty_list(cdr(seq));
+}
+
+char is_no_operands(object *ops) {
+  return is_the_empty_list(ops);
+}
+
+char is_or(object *exp) {
+  return is_tagged_list(exp, S(or_symbol));
+}
+
+char is_quoted(object *exp) {
+  return is_tagged_list(exp, S(quote_symbol));
+}
+
+char is_self_evaluating(object *exp) {
+  return is_boolean(exp) ||
+    is_fixnum(exp) ||
+    is_character(exp) ||
+    is_the_empty_string(exp) ||
+    is_string(exp) ||
+    is_vector(exp);
+}
+
+char is_tagged_list(object *exp, object *tag) {
+  object *the_car;
+
+  if (is_pair(exp)) {
+    the_car = car(exp);
+
+    return is_symbol(the_car) && (the_car == tag);
+  }
+
+  return 0;
+}
+
+char is_variable(object *exp) {
+  return is_symbol(exp);
+}
+
+object *lambda_body(object *exp) {
+  return cddr(exp);
+}
+
+object *lambda_parameters(object *exp) {
+  return cadr(exp);
+}
+
+object *make_application(object *operator, object *operands);
+
+object *make_application(object *operator, object *operands) {
+  return cons(operator, operands);
+}
+
+object *make_begin(object *exp) {
+  return cons(S(begin_symbol), exp);
+}
+
+object *make_lambda(object *parameters, object *body) {
+  return cons(S(lambda_symbol), cons(parameters, body));
+}
+
+object *operands(object *exp) {
+  return cdr(exp);
+}
+
+object *operator(object *exp) {
+  return car(exp);
+}
+
+object *or_tests(object *exp) {
+  return cdr(exp);
+}
+
+object *prepare_apply_operands(object *arguments) {
+  if (is_the_empty_list(cdr(arguments))) {
+    return car(arguments);
+  }
+
+  return cons(car(arguments),
+              prepare_apply_operands(cdr(arguments)));
+}
+
+object *rest_operands(object *ops) {
+  return cdr(ops);
+}
+
+object *rest_exps(object *seq) {
+  return cdr(seq);
+}
+
+object *sequence_to_exp(object *seq) {
+  if (is_the_empty_list(seq)) {
+    return seq;
+  }
+
+  if (is_last_exp(seq)) {
+    return first_exp(seq);
+  }
+
+  return make_begin(seq);
+}
+
+object *text_of_quotation(object *exp) {
+  return cadr(exp);
+}
+
+object *list_of_values(object *exps, object *env) {
+  if (is_no_operands(exps)) {
+    return the_empty_list;
+  }
+
+  return cons(eval(first_operand(exps), env),
+	      list_of_values(rest_operands(exps), env));
+}
+
+object *eval_assignment(object *exp, object *env) {
+  set_variable_value(assignment_variable(exp),
+		     eval(assignment_value(exp), env),
+		     env);
+
+  return S(ok_symbol);
+}
+
+object *eval_definition(object *exp, object *env) {
+  define_variable(definition_variable(exp),
+		  eval(definition_value(exp), env),
+		  env);
+
+  return S(ok_symbol);
+}
+
+/* The expression a procedure body runs as; analysis leaves bodies with
+ * a single expression, so only unanalyzed ones need a begin. */
+object *body_expression(object *body) {
+  return is_last_exp(body) ? first_exp(body) : make_begin(body);
+}
+
+/* Returns a flat frame for a call with a fixed number of parameters, or
+ * NULL if the parameter list is variadic or the operand count differs.
+ * The values are filled by the caller. */
+object *make_call_frame(object *parameters, object *operands,
+                        object *enclosing) {
+  object *vars;
+  long count;
+
+  count = 0;
+
+  for (vars = parameters;
+       is_pair(vars) && is_pair(operands);
+       vars = cdr(vars), operands = cdr(operands)) {
+    count++;
+  }
+
+  if (!is_the_empty_list(vars) || !is_the_empty_list(operands)) {
+    return NULL;
+  }
+
+  return make_flat_frame(parameters, count, enclosing);
+}
+
+object *eval_call_frame(object *frame, object *operands, object *env) {
+  object **slot;
+
+  for (slot = frame->data.frame.values;
+       !is_no_operands(operands);
+       operands = rest_operands(operands)) {
+    *slot++ = eval(first_operand(operands), env);
+  }
+
+  return frame;
+}
+
+#define LOOP_MAX_VARIABLES 16
+
+/* Evaluates the operands of a jump, then rebinds the loop's frame to
+ * them and returns it. */
+object *rebind_loop_frame(object *recur, object *operands, object *env) {
+  object *values[LOOP_MAX_VARIABLES];
+  object *variables;
+  object *frame;
+  long count;
+  long i;
+
+  variables = recur->data.inline_proc.cell->data.inline_proc.cell;
+  count = 0;
+
+  for (; !is_no_operands(operands); operands = rest_operands(operands)) {
+    values[count++] = eval(first_operand(operands), env);
+  }
+
+  for (frame = env;
+       !is_frame(frame) || frame->data.frame.variables != variables;
+       frame = enclosing_environment(frame)) {
+  }
+
+  for (i = 0; i < count; i++) {
+    frame->data.frame.values[i] = values[i];
+  }
+
+  return frame;
+}
+
+/* Binds a procedure's parameters to an argument list. */
+object *bind_arguments(object *parameters, object *arguments,
+                       object *enclosing) {
+  object *frame;
+  object **slot;
+
+  frame = make_call_frame(parameters, arguments, enclosing);
+
+  if (frame == NULL) {
+    return extend_environment(parameters, arguments, enclosing);
+  }
+
+  for (slot = frame->data.frame.values;
+       !is_the_empty_list(arguments);
+       arguments = cdr(arguments)) {
+    *slot++ = car(arguments);
+  }
+
+  return frame;
+}
+
+/* Runs an open-coded primitive call whose global binding is still the
+ * primitive.  Operands of the wrong type go to the primitive itself. */
+object *eval_inline_call(object *inline_proc, object *exp, object *env) {
+  object *x;
+  object *y;
+  object *rest;
+  object *arguments;
+  object *caller;
+  object *result;
+
+  x = eval(first_operand(operands(exp)), env);
+  rest = rest_operands(operands(exp));
+  y = is_no_operands(rest) ? NULL : eval(first_operand(rest), env);
+  S(primitive_call_count)++;
+
+  switch (inline_proc->data.inline_proc.opcode) {
+  case INLINE_ADD:
+    if (is_fixnum(x) && is_fixnum(y)) {
+      return make_fixnum(x->data.fixnum.value + y->data.fixnum.value);
+    }
+    break;
+  case INLINE_CAR:
+    if (is_pair(x)) {
+      return car(x);
+    }
+    break;
+  case INLINE_CDR:
+    if (is_pair(x)) {
+      return cdr(x);
+    }
+    break;
+  case INLINE_CONS:
+    return cons(x, y);
+  case INLINE_IS_EQ:
+    return is_eqv(x, y) ? true : false;
+  case INLINE_IS_LESS_THAN:
+    if (is_fixnum(x) && is_fixnum(y)) {
+      return x->data.fixnum.value < y->data.fixnum.value ? true : false;
+    }
+    break;
+  case INLINE_IS_NULL:
+    return is_the_empty_list(x) ? true : false;
+  case INLINE_IS_NUMBER_EQUAL:
+    if (is_fixnum(x) && is_fixnum(y)) {
+      return x->data.fixnum.value == y->data.fixnum.value ? true : false;
+    }
+    break;
+  case INLINE_IS_PAIR:
+    return is_pair(x) ? true : false;
+  case INLINE_SUB:
+    if (is_fixnum(x) && is_fixnum(y)) {
+      return make_fixnum(x->data.fixnum.value - y->data.fixnum.value);
+    }
+    break;
+  }
+
+  arguments = y == NULL ? the_empty_list : cons(y, the_empty_list);
+  caller = S(running_call);
+  S(running_call) = exp;
+  result = (inline_proc->data.inline_proc.primitive->data.primitive_proc.fn)
+    (cons(x, arguments));
+  S(running_call) = caller;
+
+  return result;
+}
+
+object *apply_profiled(object *procedure, object *arguments);
+object *continuation_argument(object *arguments);
+void enter_profile_frame(profile_frame *record, object *procedure);
+void leave_profile_frame(profile_frame *record);
+object *eval_guard(object *exp, object *env);
+void throw_to_continuation(continuation *k, object *value);
+void preempt_thread(void);
+
+object *eval(object *exp, object *env) {
+  object *arguments;
+  object *procedure;
+  object *result;
+  object *frame;
+  object *caller;
+  profile_frame record;
+
+  record.procedure = NULL;
+
+ tailcall:
+  S(eval_count)++;
+
+  if (is_self_evaluating(exp)) {
+    result = exp;
+
+    goto done;
+  }
+
+  if (is_variable(exp)) {
+    result = lookup_variable_value(exp, env);
+
+    goto done;
+  }
+
+  if (is_inline_call(exp)) {
+    procedure = operator(exp);
+
+    switch (procedure->data.inline_proc.opcode) {
+    case INLINE_CASE:
+      exp = case_branch(procedure, eval(case_key(exp), env));
+
+      goto tailcall;
+    case INLINE_FOLD:
+      exp = is_fold_valid(procedure) ? fold_value(exp) : fold_original(exp);
+
+      goto tailcall;
+    case INLINE_LOOP:
+      frame = make_call_frame(procedure->data.inline_proc.cell,
+                              loop_inits(exp),
+                              env);
+      env = eval_call_frame(frame, loop_inits(exp), env);
+      exp = loop_body(exp);
+
+      goto tailcall;
+    case INLINE_GLOBAL:
+      result = lookup_variable_value(procedure->data.inline_proc.cell,
+                                     S(the_global_environment));
+
+      goto done;
+    case INLINE_RECUR:
+      env = rebind_loop_frame(procedure, operands(exp), env);
+      exp = procedure->data.inline_proc.cell->data.inline_proc.primitive;
+
+      if (--S(preempt_countdown) < 0) {
+        preempt_thread();
+      }
+
+      goto tailcall;
+    }
+
+    if (car(procedure->data.inline_proc.cell) ==
+        procedure->data.inline_proc.primitive) {
+      result = eval_inline_call(procedure, exp, env);
+
+      goto done;
+    }
+
+    /* the global was redefined since the call was analyzed */
+    procedure = car(procedure->data.inline_proc.cell);
+    arguments = list_of_values(operands(exp), env);
+
+    goto apply;
+  }
+
+  if (is_quoted(exp)) {
+    result = text_of_quotation(exp);
+
+    goto done;
+  }
+
+  if (is_assignment(exp)) {
+    result = eval_assignment(exp, env);
+
+    goto done;
+  }
+
+  if (is_definition(exp)) {
+    result = eval_definition(exp, env);
+
+    goto done;
+  }
+
+  if (is_if(exp)) {
+    exp = is_true(eval(if_predicate(exp), env)) ?
+      if_consequent(exp) :
+      if_alternative(exp);
+
+    goto tailcall;
+  }
+
+  if (is_lambda(exp)) {
+    result = make_compound_proc(lambda_parameters(exp),
+                                lambda_body(exp),
+                                env);
+
+    goto done;
+  }
+
+  if (is_begin(exp)) {
+    exp = begin_actions(exp);
+
+    while (!is_last_exp(exp)) {
+      eval(first_exp(exp), env);
+      exp = rest_exps(exp);
+    }
+
+    exp = first_exp(exp);
+
+    goto tailcall;
+  }
+
+  if (is_guard(exp)) {
+    result = eval_guard(exp, env);
+
+    goto done;
+  }
+
+  if (is_and(exp)) {
+    exp = and_tests(exp);
+
+    if (is_the_empty_list(exp)) {
+      result = true;
+
+      goto done;
+    }
+
+    while (!is_last_exp(exp)) {
+      result = eval(first_exp(exp), env);
+
+      if (is_false(result)) {
+        goto done;
+      }
+
+      exp = rest_exps(exp);
+    }
+
+    exp = first_exp(exp);
+
+    goto tailcall;
+  }
+
+  if (is_or(exp)) {
+    exp = or_tests(exp);
+
+    if (is_the_empty_list(exp)) {
+      result = false;
+
+      goto done;
+    }
+
+    while (!is_last_exp(exp)) {
+      result = eval(first_exp(exp), env);
+
+      if (is_true(result)) {
+        goto done;
+      }
+
+      exp = rest_exps(exp);
+    }
+
+    exp = first_exp(exp);
+
+    goto tailcall;
+  }
+
+  if (is_application(exp)) {
+    procedure = operator(exp);
+
+    /* ((lambda ...) ...), which is what let becomes, needs no closure */
+    if (is_lambda(procedure)) {
+      frame = make_call_frame(lambda_parameters(procedure),
+                              operands(exp),
+                              env);
+
+      if (frame != NULL) {
+        env = eval_call_frame(frame, operands(exp), env);
+        exp = body_expression(lambda_body(procedure));
+
+        goto tailcall;
+      }
+    }
+
+    procedure = eval(procedure, env);
+
+    if (is_compound_proc(procedure)) {
+      frame = make_call_frame(procedure->data.compound_proc.parameters,
+                              operands(exp),
+                              procedure->data.compound_proc.env);
+
+      if (frame != NULL) {
+        env = eval_call_frame(frame, operands(exp), env);
+        exp = body_expression(procedure->data.compound_proc.body);
+        S(call_count)++;
+
+        if (profiling) {
+          enter_profile_frame(&record, procedure);
+        }
+
+        if (--S(preempt_countdown) < 0) {
+          preempt_thread();
+        }
+
+        goto tailcall;
+      }
+    }
+
+    arguments = list_of_values(operands(exp), env);
+
+  apply:
+    if (is_primitive_proc(procedure)) {
+      S(primitive_call_count)++;
+
+      if (procedure->data.primitive_proc.fn == proc_eval) {
+        env = eval_environment(arguments);
+        exp = analyze(eval_expression(arguments), env);
+
+        goto tailcall;
+      }
+
+      if (procedure->data.primitive_proc.fn == proc_apply) {
+        procedure = apply_operator(arguments);
+        arguments = apply_operands(arguments);
+
+        goto apply;
+      }
+
+      caller = S(running_call);
+      S(running_call) = exp;
+      result = profiling ?
+        apply_profiled(procedure, arguments) :
+        (procedure->data.primitive_proc.fn)(arguments);
+      S(running_call) = caller;
+
+      goto done;
+    }
+
+    if (is_compound_proc(procedure)) {
+      env = bind_arguments(procedure->data.compound_proc.parameters,
+                           arguments,
+                           procedure->data.compound_proc.env);
+      exp = body_expression(procedure->data.compound_proc.body);
+      S(call_count)++;
+
+      if (profiling) {
+        enter_profile_frame(&record, procedure);
+      }
+
+      if (--S(preempt_countdown) < 0) {
+        preempt_thread();
+      }
+
+      goto tailcall;
+    }
+
+    if (is_continuation(procedure)) {
+      throw_to_continuation(procedure->data.continuation.k,
+                            continuation_argument(arguments));
+    }
+
+    throw_error("unknown procedure type", procedure);
+  }
+
+  throw_error("cannot eval unknown expression type", exp);
+
+ done:
+  if (record.procedure != NULL) {
+    leave_profile_frame(&record);
+  }
+
+  return result;
+}
+
+object *apply_procedure(object *procedure, object *arguments) {
+  if (is_primitive_proc(procedure)) {
+    S(primitive_call_count)++;
+
+    if (procedure->data.primitive_proc.fn == proc_eval) {
+      return eval(analyze(eval_expression(arguments),
+                          eval_environment(arguments)),
+                  eval_environment(arguments));
+    }
+
+    if (procedure->data.primitive_proc.fn == proc_apply) {
+      return apply_procedure(apply_operator(arguments),
+                             apply_operands(arguments));
+    }
+
+    if (profiling) {
+      return apply_profiled(procedure, arguments);
+    }
+
+    return (procedure->data.primitive_proc.fn)(arguments);
+  }
+
+  if (is_compound_proc(procedure)) {
+    S(call_count)++;
+
+    if (--S(preempt_countdown) < 0) {
+      preempt_thread();
+    }
+
+    if (profiling) {
+      return apply_profiled(procedure, arguments);
+    }
+
+    return eval(body_expression(procedure->data.compound_proc.body),
+                bind_arguments(procedure->data.compound_proc.parameters,
+                               arguments,
+                               procedure->data.compound_proc.env));
+  }
+
+  if (is_continuation(procedure)) {
+    throw_to_continuation(procedure->data.continuation.k,
+                          continuation_argument(arguments));
+  }
+
+  throw_error("unknown procedure type", procedure);
+}
+
+/* MACROS */
+
+/* Macros are expanded during analysis, once per source form.  Symbols
+ * a template introduces are replaced by aliases, uninterned symbols
+ * that remember their original.  An alias bound by a binding form of
+ * the same expansion stays distinct from any user variable of the
+ * same name; a free alias resolves to its original, which refers to
+ * the global binding or special form of that name.  alias_scopes
+ * remembers the scope each alias's macro was defined in, so that a
+ * free alias used as a variable where a binding the macro cannot see
+ * shadows its original still means the global, see analyze_variable. */
+
+void init_macros(void) {
+  S(ellipsis_match) = cons(false, false);
+  S(macro_renames) = the_empty_list;
+  S(rename_procedure) = NULL;
+  S(compare_procedure) = NULL;
+  S(expansions) = make_object_table();
+  S(alias_scopes) = make_object_table();
+}
+
+/* Scope is the list of lexically bound names seen by analysis: a
+ * symbol for a variable, (name . macro) for a local macro. */
+char is_in_scope(object *var, object *scope) {
+  for (; !is_the_empty_list(scope); scope = cdr(scope)) {
+    if (car(scope) == var || (is_pair(car(scope)) && caar(scope) == var)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+object *alias_original(object *symbol) {
+  while (is_alias(symbol)) {
+    symbol = symbol->data.symbol.original;
+  }
+
+  return symbol;
+}
+
+/* The symbol an identifier means where it occurs: a free alias means
+ * its original. */
+object *resolve_symbol(object *symbol, object *scope) {
+  while (is_alias(symbol) && !is_in_scope(symbol, scope)) {
+    symbol = symbol->data.symbol.original;
+  }
+
+  return symbol;
+}
+
+/* Replaces aliases in quoted data by their originals, copying only
+ * what changes. */
+object *strip_syntax(object *datum) {
+  object *car_obj;
+  object *cdr_obj;
+
+  if (is_alias(datum)) {
+    return alias_original(datum);
+  }
+
+  if (is_pair(datum)) {
+    car_obj = strip_syntax(car(datum));
+    cdr_obj = strip_syntax(cdr(datum));
+
+    return car_obj == car(datum) && cdr_obj == cdr(datum) ?
+      datum :
+      cons(car_obj, cdr_obj);
+  }
+
+  if (is_vector(datum)) {
+    car_obj = vector_to_list(datum);
+    cdr_obj = strip_syntax(car_obj);
+
+    return car_obj == cdr_obj ? datum : list_to_vector(cdr_obj, NULL);
+  }
+
+  return datum;
+}
+
+object *rename_symbol(object *symbol) {
+  object *renames;
+
+  for (renames = S(macro_renames);
+       !is_the_empty_list(renames);
+       renames = cdr(renames)) {
+    if (caar(renames) == symbol) {
+      return cdar(renames);
+    }
+  }
+
+  S(macro_renames) = cons(cons(symbol, make_alias(symbol)), S(macro_renames));
+
+  return cdar(S(macro_renames));
+}
+
+object *proc_rename(object *arguments) {
+  if (!is_symbol(car(arguments))) {
+    throw_error("rename: not a symbol", car(arguments));
+  }
+
+  return rename_symbol(car(arguments));
+}
+
+object *proc_compare(object *arguments) {
+  return alias_original(car(arguments)) == alias_original(cadr(arguments)) ?
+    true :
+    false;
+}
+
+/* Returns the macro a symbol names in scope, or NULL.  The scope the
+ * macro was defined in is stored into definition. */
+object *lookup_macro(object *symbol, object *scope, object *env,
+                     object **definition) {
+  object *cell;
+
+  symbol = resolve_symbol(symbol, scope);
+
+  for (; !is_the_empty_list(scope); scope = cdr(scope)) {
+    if (car(scope) == symbol) {
+      return NULL;
+    }
+
+    if (is_pair(car(scope)) && caar(scope) == symbol) {
+      *definition = cdr(scope);
+
+      return cdar(scope);
+    }
+  }
+
+  *definition = the_empty_list;
+  cell = lookup_binding_cell(symbol, env);
+
+  return cell != NULL && is_macro(car(cell)) ? car(cell) : NULL;
+}
+
+object *make_transformer(object *spec, object *scope, object *env) {
+  object *literals;
+  object *transformer;
+
+  if (is_pair(spec) &&
+      resolve_symbol(car(spec), scope) == S(syntax_rules_symbol) &&
+      is_pair(cdr(spec))) {
+    spec = cdr(spec);
+    literals = S(ellipsis_symbol);
+
+    if (is_symbol(car(spec)) && is_pair(cdr(spec))) {
+      literals = car(spec);
+      spec = cdr(spec);
+    }
+
+    return make_macro(cons(literals, car(spec)), cdr(spec), false);
+  }
+
+  if (is_pair(spec) &&
+      resolve_symbol(car(spec), scope) == S(er_macro_transformer_symbol) &&
+      is_pair(cdr(spec))) {
+    transformer = eval(analyze(cadr(spec), env), env);
+
+    if (is_primitive_proc(transformer) || is_compound_proc(transformer)) {
+      return make_macro(the_empty_list, the_empty_list, transformer);
+    }
+  }
+
+  throw_error("bad macro transformer", spec);
+}
+
+object *match_binding(object *var, object *bindings) {
+  for (; !is_the_empty_list(bindings); bindings = cdr(bindings)) {
+    if (caar(bindings) == var) {
+      return car(bindings);
+    }
+  }
+
+  return NULL;
+}
+
+char is_pattern_literal(object *symbol, object *literals) {
+  for (literals = cdr(literals);
+       is_pair(literals);
+       literals = cdr(literals)) {
+    if (car(literals) == symbol) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Adds the pattern variables in pattern to vars. */
+object *pattern_variables(object *pattern, object *literals, object *vars) {
+  if (is_symbol(pattern)) {
+    if (pattern == car(literals) || pattern == S(underscore_symbol) ||
+        is_pattern_literal(pattern, literals)) {
+      return vars;
+    }
+
+    return cons(pattern, vars);
+  }
+
+  if (is_pair(pattern)) {
+    return pattern_variables(cdr(pattern), literals,
+                             pattern_variables(car(pattern), literals, vars));
+  }
+
+  if (is_vector(pattern)) {
+    return pattern_variables(vector_to_list(pattern), literals, vars);
+  }
+
+  return vars;
+}
+
+char match_pattern(object *pattern, object *form, object *literals,
+                   object **bindings);
+
+/* Matches (p <ellipsis> . tail): p against as many elements as tail
+ * leaves over.  Each variable of p is bound to the list of its
+ * matches, tagged with ellipsis_match. */
+char match_ellipsis(object *pattern, object *form, object *literals,
+                    object **bindings) {
+  object *head;
+  object *tail;
+  object *item;
+  object *vars;
+  object *values;
+  object *rest;
+  long count;
+
+  count = 0;
+
+  for (rest = form; is_pair(rest); rest = cdr(rest)) {
+    count++;
+  }
+
+  for (rest = cddr(pattern); is_pair(rest); rest = cdr(rest)) {
+    count--;
+  }
+
+  head = tail = the_empty_list;
+
+  for (; count > 0; count--, form = cdr(form)) {
+    item = the_empty_list;
+
+    if (!match_pattern(car(pattern), car(form), literals, &item)) {
+      return 0;
+    }
+
+    list_append_cell(&head, &tail, item);
+  }
+
+  for (vars = pattern_variables(car(pattern), literals, the_empty_list);
+       !is_the_empty_list(vars);
+       vars = cdr(vars)) {
+    values = tail = the_empty_list;
+
+    for (rest = head; !is_the_empty_list(rest); rest = cdr(rest)) {
+      list_append_cell(&values, &tail,
+                       cdr(match_binding(car(vars), car(rest))));
+    }
+
+    *bindings = cons(cons(car(vars), cons(S(ellipsis_match), values)),
+                     *bindings);
+  }
+
+  return count == 0 &&
+    match_pattern(cddr(pattern), form, literals, bindings);
+}
+
+char match_pattern(object *pattern, object *form, object *literals,
+                   object **bindings) {
+  if (is_symbol(pattern)) {
+    if (is_pattern_literal(pattern, literals)) {
+      return is_symbol(form) &&
+        alias_original(form) == alias_original(pattern);
+    }
+
+    if (pattern != S(underscore_symbol)) {
+      *bindings = cons(cons(pattern, form), *bindings);
+    }
+
+    return 1;
+  }
+
+  if (is_pair(pattern)) {
+    if (is_pair(cdr(pattern)) && cadr(pattern) == car(literals)) {
+      return match_ellipsis(pattern, form, literals, bindings);
+    }
+
+    return is_pair(form) &&
+      match_pattern(car(pattern), car(form), literals, bindings) &&
+      match_pattern(cdr(pattern), cdr(form), literals, bindings);
+  }
+
+  if (is_vector(pattern)) {
+    return is_vector(form) &&
+      match_pattern(vector_to_list(pattern), vector_to_list(form),
+                    literals, bindings);
+  }
+
+  return is_equal(pattern, form);
+}
+
+char is_ellipsis_match(object *value) {
+  return is_pair(value) && car(value) == S(ellipsis_match);
+}
+
+/* Adds the variables in template that matched under an ellipsis to
+ * vars, as (variable . matches). */
+object *ellipsis_variables(object *template, object *bindings,
+                           object *vars) {
+  object *binding;
+
+  if (is_symbol(template)) {
+    binding = match_binding(template, bindings);
+
+    if (binding != NULL && is_ellipsis_match(cdr(binding)) &&
+        match_binding(template, vars) == NULL) {
+      return cons(cons(template, cddr(binding)), vars);
+    }
+
+    return vars;
+  }
+
+  if (is_pair(template)) {
+    return ellipsis_variables(cdr(template), bindings,
+                              ellipsis_variables(car(template), bindings,
+                                                 vars));
+  }
+
+  if (is_vector(template)) {
+    return ellipsis_variables(vector_to_list(template), bindings, vars);
+  }
+
+  return vars;
+}
+
+object *expand_template(object *template, object *bindings,
+                        object *ellipsis);
+
+/* Expands t in (t <ellipsis> ...) once per match of its variables. */
+object *expand_ellipsis(object *template, object *bindings,
+                        object *ellipsis) {
+  object *head;
+  object *tail;
+  object *vars;
+  object *var;
+  object *iteration;
+
+  vars = ellipsis_variables(template, bindings, the_empty_list);
+
+  if (is_the_empty_list(vars)) {
+    throw_error("no pattern variable before ellipsis", template);
+  }
+
+  head = tail = the_empty_list;
+
+  for (;;) {
+    iteration = bindings;
+
+    for (var = vars; !is_the_empty_list(var); var = cdr(var)) {
+      if (is_the_empty_list(cdar(var))) {
+        return head;
+      }
+
+      iteration = cons(cons(caar(var), cadar(var)), iteration);
+      set_cdr(car(var), cddar(var));
+    }
+
+    list_append_cell(&head, &tail,
+                     expand_template(template, iteration, ellipsis));
+  }
+}
+
+object *expand_template(object *template, object *bindings,
+                        object *ellipsis) {
+  object *binding;
+  object *items;
+  object *last;
+
+  if (is_symbol(template)) {
+    binding = match_binding(template, bindings);
+
+    if (binding == NULL) {
+      return rename_symbol(template);
+    }
+
+    if (is_ellipsis_match(cdr(binding))) {
+      throw_error("pattern variable used without ellipsis", template);
+    }
+
+    return cdr(binding);
+  }
+
+  if (is_pair(template)) {
+    /* (<ellipsis> template) escapes the ellipsis */
+    if (car(template) == ellipsis && is_pair(cdr(template))) {
+      return expand_template(cadr(template), bindings, NULL);
+    }
+
+    if (is_pair(cdr(template)) && cadr(template) == ellipsis) {
+      items = expand_ellipsis(car(template), bindings, ellipsis);
+
+      if (is_the_empty_list(items)) {
+        return expand_template(cddr(template), bindings, ellipsis);
+      }
+
+      for (last = items; is_pair(cdr(last)); last = cdr(last)) {
+      }
+
+      set_cdr(last, expand_template(cddr(template), bindings, ellipsis));
+
+      return items;
+    }
+
+    return cons(expand_template(car(template), bindings, ellipsis),
+                expand_template(cdr(template), bindings, ellipsis));
+  }
+
+  if (is_vector(template)) {
+    return list_to_vector(expand_template(vector_to_list(template),
+                                          bindings, ellipsis), NULL);
+  }
+
+  return template;
+}
+
+object *apply_syntax_rules(object *macro, object *form) {
+  object *rules;
+  object *rule;
+  object *bindings;
+
+  for (rules = macro->data.macro.rules;
+       is_pair(rules);
+       rules = cdr(rules)) {
+    rule = car(rules);
+    bindings = the_empty_list;
+
+    /* the keyword position of a pattern is ignored */
+    if (is_pair(rule) && is_pair(car(rule)) && is_pair(cdr(rule)) &&
+        match_pattern(cdar(rule), cdr(form),
+                      macro->data.macro.literals, &bindings)) {
+      return expand_template(cadr(rule), bindings,
+                             car(macro->data.macro.literals));
+    }
+  }
+
+  throw_error("no syntax rule matches", strip_syntax(form));
+}
+
+/* Expands a macro use, going through the expansion cache.  The macro
+ * was defined in scope definition. */
+object *expand_macro(object *macro, object *form, object *definition) {
+  object *cached;
+  object *renames;
+  object *expansion;
+  object *alias;
+
+  cached = (object *)object_table_get(S(expansions), form, 0);
+
+  if (cached != NULL && car(cached) == macro) {
+    return cdr(cached);
+  }
+
+  renames = S(macro_renames);
+  S(macro_renames) = the_empty_list;
+
+  if (is_false(macro->data.macro.transformer)) {
+    expansion = apply_syntax_rules(macro, form);
+  } else {
+    if (S(rename_procedure) == NULL) {
+      S(rename_procedure) = make_primitive_proc(proc_rename);
+      S(compare_procedure) = make_primitive_proc(proc_compare);
+    }
+
+    expansion = apply_procedure(macro->data.macro.transformer,
+                                cons(form,
+                                     cons(S(rename_procedure),
+                                          cons(S(compare_procedure),
+                                               the_empty_list))));
+  }
+
+  for (alias = S(macro_renames);
+       !is_the_empty_list(alias);
+       alias = cdr(alias)) {
+    object_table_put(S(alias_scopes), cdar(alias), (long)definition);
+  }
+
+  S(macro_renames) = renames;
+  object_table_put(S(expansions), form, (long)cons(macro, expansion));
+
+  return expansion;
+}
+
+/* Defining a macro invalidates every cached expansion. */
+void define_macro(object *name, object *macro, object *env) {
+  define_variable(name, macro, env);
+  free_object_table(S(expansions));
+  S(expansions) = make_object_table();
+}
+
+/* Returns what a variable reference means where it occurs.  A free
+ * alias whose original is bound here, but was not where its macro was
+ * defined, means the global of that name rather than the binding. */
+object *analyze_variable(object *symbol, object *scope) {
+  object *original;
+  object *definition;
+
+  while (is_alias(symbol) && !is_in_scope(symbol, scope)) {
+    original = symbol->data.symbol.original;
+    definition = (object *)object_table_get(S(alias_scopes), symbol, 0);
+
+    if (definition != NULL && !is_alias(original) &&
+        is_in_scope(original, scope) &&
+        !is_in_scope(original, definition)) {
+      return cons(make_inline_proc(INLINE_GLOBAL, original,
+                                   the_empty_list),
+                  the_empty_list);
+    }
+
+    symbol = original;
+  }
+
+  return symbol;
+}
+
+/* ANALYZE */
+
+/* Every form is rewritten once before it is evaluated.  A call to one of
+ * the primitives below through a global that no enclosing binding
+ * shadows becomes (inline-proc . operands); eval open-codes it for as
+ * long as the global's binding cell still holds the primitive.
+ *
+ * The same pass folds constants: pure primitive calls on literals, if
+ * and cond on constant predicates, nested begins and unused let
+ * bindings.  Folds that depend on a primitive keep the unfolded form
+ * in a fold node, see fold_value.
+ *
+ * Named let and case are compiled here too: a named let whose
+ * variables cannot outlive an iteration loops in one frame, see
+ * loop_body, and case dispatches through a table, see case_key. */
+
+typedef struct {
+  object *(*fn)(struct object *arguments);
+  inline_opcode opcode;
+  int arity;
+} inline_primitive;
+
+inline_primitive inline_primitives[] = {
+  {proc_add, INLINE_ADD, 2},
+  {proc_car, INLINE_CAR, 1},
+  {proc_cdr, INLINE_CDR, 1},
+  {proc_cons, INLINE_CONS, 2},
+  {proc_is_eq, INLINE_IS_EQ, 2},
+  {proc_is_less_than, INLINE_IS_LESS_THAN, 2},
+  {proc_is_null, INLINE_IS_NULL, 1},
+  {proc_is_number_equal, INLINE_IS_NUMBER_EQUAL, 2},
+  {proc_is_pair, INLINE_IS_PAIR, 1},
+  {proc_sub, INLINE_SUB, 2},
+  {NULL, 0, 0}
+};
+
+#define FOLD_ANY 0
+#define FOLD_FIXNUMS 1
+#define FOLD_DIVIDE 2
+#define FOLD_PAIR 3
+
+/* primitives without side effects, and the operands they can be folded
+ * on without raising an error */
+typedef struct {
+  object *(*fn)(struct object *arguments);
+  int operands;
+  int min_arity;
+  int max_arity;
+} pure_primitive;
+
+pure_primitive pure_primitives[] = {
+  {proc_add, FOLD_FIXNUMS, 0, -1},
+  {proc_car, FOLD_PAIR, 1, 1},
+  {proc_cdr, FOLD_PAIR, 1, 1},
+  {proc_is_boolean, FOLD_ANY, 1, 1},
+  {proc_is_char, FOLD_ANY, 1, 1},
+  {proc_is_eq, FOLD_ANY, 2, 2},
+  {proc_is_greater_than, FOLD_FIXNUMS, 1, -1},
+  {proc_is_integer, FOLD_ANY, 1, 1},
+  {proc_is_less_than, FOLD_FIXNUMS, 1, -1},
+  {proc_is_null, FOLD_ANY, 1, 1},
+  {proc_is_number_equal, FOLD_FIXNUMS, 1, -1},
+  {proc_is_pair, FOLD_ANY, 1, 1},
+  {proc_is_string, FOLD_ANY, 1, 1},
+  {proc_is_symbol, FOLD_ANY, 1, 1},
+  {proc_mul, FOLD_FIXNUMS, 0, -1},
+  {proc_quotient, FOLD_DIVIDE, 2, 2},
+  {proc_remainder, FOLD_DIVIDE, 2, 2},
+  {proc_sub, FOLD_FIXNUMS, 1, -1},
+  {NULL, 0, 0, 0}
+};
+
+object *analyze_exp(object *exp, object *scope, object *env);
+object *analyze_inline_call(object *exp, object *scope, object *env);
+object *flatten_sequence(object *exps);
+
+object *analyze(object *exp, object *env) {
+  return analyze_exp(exp, the_empty_list, env);
+}
+
+char is_proper_list(object *obj) {
+  while (is_pair(obj)) {
+    obj = cdr(obj);
+  }
+
+  return is_the_empty_list(obj);
+}
+
+/* Analyzes each element of a proper list; anything else is left for
+ * eval to reject. */
+object *analyze_list(object *exps, object *scope, object *env) {
+  object *head;
+  object *tail;
+
+  if (!is_proper_list(exps)) {
+    return exps;
+  }
+
+  head = tail = the_empty_list;
+
+  for (; !is_the_empty_list(exps); exps = cdr(exps)) {
+    list_append_cell(&head, &tail, analyze_exp(car(exps), scope, env));
+  }
+
+  return head;
+}
+
+/* Adds the variables of a parameter list, proper or not, to scope. */
+object *extend_scope(object *parameters, object *scope) {
+  while (is_pair(parameters)) {
+    scope = cons(car(parameters), scope);
+    parameters = cdr(parameters);
+  }
+
+  return is_symbol(parameters) ? cons(parameters, scope) : scope;
+}
+
+/* Resolves a form's keyword if it is a free alias.  An operator that
+ * means a global variable, see analyze_variable, becomes a reference to
+ * it; special forms and macros stay keywords. */
+object *resolve_head(object *exp, object *scope) {
+  object *head;
+  object *cell;
+
+  if (is_pair(exp) && is_alias(car(exp)) && !is_in_scope(car(exp), scope)) {
+    head = analyze_variable(car(exp), scope);
+    cell = is_pair(head) ?
+      lookup_binding_cell(operator(head)->data.inline_proc.cell,
+                          S(the_global_environment)) :
+      NULL;
+
+    if (cell == NULL || is_macro(car(cell))) {
+      head = resolve_symbol(car(exp), scope);
+    }
+
+    return cons(head, cdr(exp));
+  }
+
+  return exp;
+}
+
+/* let with a tag is compiled by analyze_named_let, not the let macro. */
+char is_named_let(object *exp, object *scope) {
+  return is_tagged_list(exp, S(let_symbol)) &&
+    !is_in_scope(S(let_symbol), scope) &&
+    is_pair(cdr(exp)) && is_symbol(cadr(exp)) &&
+    is_pair(cddr(exp)) && is_pair(cdddr(exp));
+}
+
+/* Expands macro uses until the form is not one. */
+object *expand_head(object *exp, object *scope, object *env) {
+  object *macro;
+  object *definition;
+
+  for (;;) {
+    exp = resolve_head(exp, scope);
+
+    if (!is_pair(exp) || !is_symbol(car(exp)) || is_named_let(exp, scope)) {
+      return exp;
+    }
+
+    macro = lookup_macro(car(exp), scope, env, &definition);
+
+    if (macro == NULL) {
+      return exp;
+    }
+
+    exp = expand_macro(macro, exp, definition);
+  }
+}
+
+char is_define_syntax(object *exp) {
+  return is_tagged_list(exp, S(define_syntax_symbol)) &&
+    is_pair(cdr(exp)) && is_pair(cddr(exp));
+}
+
+/* Adds the names a body defines internally to scope, and the macros it
+ * defines as (name . macro). */
+object *scope_definitions(object *body, object *scope, object *env) {
+  object *exp;
+
+  for (; is_pair(body); body = cdr(body)) {
+    exp = expand_head(car(body), scope, env);
+
+    if (is_define_syntax(exp)) {
+      scope = cons(cons(cadr(exp), make_transformer(caddr(exp), scope, env)),
+                   scope);
+    } else if (is_definition(exp) && is_pair(cdr(exp)) &&
+               (is_symbol(cadr(exp)) || is_pair(cadr(exp)))) {
+      scope = extend_scope(cons(definition_variable(exp), the_empty_list),
+                           scope);
+    } else if (is_begin(exp)) {
+      scope = scope_definitions(begin_actions(exp), scope, env);
+    }
+  }
+
+  return scope;
+}
+
+object *analyze_body(object *parameters, object *body,
+                     object *scope, object *env) {
+  scope = extend_scope(parameters, scope);
+  scope = scope_definitions(body, scope, env);
+
+  return flatten_sequence(analyze_list(body, scope, env));
+}
+
+/* Returns the binding cell of a call's operator if it is a global
+ * holding a primitive, or NULL. */
+object *primitive_operator_cell(object *exp, object *scope, object *env) {
+  object *cell;
+
+  if (!is_symbol(operator(exp)) || is_in_scope(operator(exp), scope) ||
+      !is_proper_list(operands(exp))) {
+    return NULL;
+  }
+
+  cell = lookup_binding_cell(operator(exp), env);
+
+  if (cell == NULL || !is_primitive_proc(car(cell))) {
+    return NULL;
+  }
+
+  return cell;
+}
+
+/* Returns the inline operator for a call, or NULL if it must go through
+ * the generic application path. */
+object *analyze_inline_operator(object *exp, object *scope, object *env) {
+  object *cell;
+  object *procedure;
+  inline_primitive *entry;
+  long count;
+
+  cell = primitive_operator_cell(exp, scope, env);
+
+  if (cell == NULL) {
+    return NULL;
+  }
+
+  procedure = car(cell);
+  count = list_length(operands(exp));
+
+  for (entry = inline_primitives; entry->fn != NULL; entry++) {
+    if (entry->fn == procedure->data.primitive_proc.fn &&
+        entry->arity == count) {
+      return make_inline_proc(entry->opcode, cell, procedure);
+    }
+  }
+
+  return NULL;
+}
+
+/* Returns the value of a literal expression, or NULL.  The value of a
+ * fold node counts as a literal; the bindings it depends on are added
+ * to *deps. */
+object *constant_value(object *exp, object **deps) {
+  object *dep;
+  object *value;
+
+  if (is_self_evaluating(exp)) {
+    return exp;
+  }
+
+  if (is_quoted(exp) && is_pair(cdr(exp))) {
+    return text_of_quotation(exp);
+  }
+
+  if (is_inline_call(exp) &&
+      operator(exp)->data.inline_proc.opcode == INLINE_FOLD) {
+    value = constant_value(fold_value(exp), deps);
+
+    if (value == NULL) {
+      return NULL;
+    }
+
+    for (dep = operator(exp)->data.inline_proc.cell;
+         !is_the_empty_list(dep);
+         dep = cdr(dep)) {
+      *deps = cons(car(dep), *deps);
+    }
+
+    return value;
+  }
+
+  return NULL;
+}
+
+/* A literal that does not depend on any primitive's binding. */
+char is_literal(object *exp) {
+  object *deps;
+
+  deps = the_empty_list;
+
+  return constant_value(exp, &deps) != NULL && is_the_empty_list(deps);
+}
+
+object *make_quotation(object *datum) {
+  if (is_self_evaluating(datum)) {
+    return datum;
+  }
+
+  return cons(S(quote_symbol), cons(datum, the_empty_list));
+}
+
+object *make_fold(object *deps, object *value, object *original) {
+  if (is_the_empty_list(deps)) {
+    return value;
+  }
+
+  return cons(make_inline_proc(INLINE_FOLD, deps, the_empty_list),
+              cons(value, original));
+}
+
+char is_foldable(pure_primitive *entry, object *values) {
+  long count;
+  object *rest;
+
+  count = list_length(values);
+
+  if (count < entry->min_arity ||
+      (entry->max_arity != -1 && count > entry->max_arity)) {
+    return 0;
+  }
+
+  for (rest = values; !is_the_empty_list(rest); rest = cdr(rest)) {
+    switch (entry->operands) {
+    case FOLD_FIXNUMS:
+    case FOLD_DIVIDE:
+      if (!is_fixnum(car(rest))) {
+        return 0;
+      }
+      break;
+    case FOLD_PAIR:
+      if (!is_pair(car(rest))) {
+        return 0;
+      }
+      break;
+    }
+  }
+
+  return entry->operands != FOLD_DIVIDE ||
+    cadr(values)->data.fixnum.value != 0;
+}
+
+/* (+ 1 x 2) => (+ 3 x), and likewise for *. */
+object *fold_partial(object *exp, pure_primitive *entry, object *deps,
+                     object *scope, object *env) {
+  object *head;
+  object *tail;
+  object *operand;
+  object *value;
+  long result;
+  int literals;
+
+  head = tail = the_empty_list;
+  result = entry->fn == proc_add ? 0 : 1;
+  literals = 0;
+
+  for (operand = operands(exp);
+       !is_the_empty_list(operand);
+       operand = cdr(operand)) {
+    value = constant_value(car(operand), &deps);
+
+    if (value != NULL && is_fixnum(value)) {
+      result = entry->fn == proc_add ?
+        result + value->data.fixnum.value :
+        result * value->data.fixnum.value;
+      literals++;
+    } else {
+      list_append_cell(&head, &tail, car(operand));
+    }
+  }
+
+  if (literals < 2) {
+    return NULL;
+  }
+
+  return make_fold(deps,
+                   analyze_inline_call(cons(operator(exp),
+                                            cons(make_fixnum(result), head)),
+                                       scope, env),
+                   exp);
+}
+
+/* Folds a call to a pure primitive; returns NULL if it cannot. */
+object *fold_call(object *exp, object *scope, object *env) {
+  object *cell;
+  object *deps;
+  object *head;
+  object *tail;
+  object *operand;
+  object *value;
+  pure_primitive *entry;
+
+  cell = primitive_operator_cell(exp, scope, env);
+
+  if (cell == NULL) {
+    return NULL;
+  }
+
+  for (entry = pure_primitives; entry->fn != NULL; entry++) {
+    if (entry->fn == car(cell)->data.primitive_proc.fn) {
+      break;
+    }
+  }
+
+  if (entry->fn == NULL) {
+    return NULL;
+  }
+
+  deps = cons(cons(cell, car(cell)), the_empty_list);
+  head = tail = the_empty_list;
+
+  for (operand = operands(exp);
+       !is_the_empty_list(operand);
+       operand = cdr(operand)) {
+    value = constant_value(car(operand), &deps);
+
+    if (value == NULL) {
+      if (entry->fn == proc_add || entry->fn == proc_mul) {
+        return fold_partial(exp, entry,
+                            cons(cons(cell, car(cell)), the_empty_list),
+                            scope, env);
+      }
+
+      return NULL;
+    }
+
+    list_append_cell(&head, &tail, value);
+  }
+
+  if (!is_foldable(entry, head)) {
+    return NULL;
+  }
+
+  return make_fold(deps, make_quotation(entry->fn(head)), exp);
+}
+
+/* (if #t a b) => a */
+object *fold_if(object *exp) {
+  object *deps;
+  object *value;
+  long count;
+
+  if (!is_proper_list(exp)) {
+    return exp;
+  }
+
+  count = list_length(exp);
+
+  if (count != 3 && count != 4) {
+    return exp;
+  }
+
+  deps = the_empty_list;
+  value = constant_value(if_predicate(exp), &deps);
+
+  if (value == NULL) {
+    return exp;
+  }
+
+  return make_fold(deps,
+                   is_true(value) ? if_consequent(exp) : if_alternative(exp),
+                   exp);
+}
+
+/* Splices nested begins into a sequence and drops literals whose value
+ * is not used. */
+object *flatten_sequence(object *exps) {
+  object *head;
+  object *tail;
+  object *exp;
+  object *nested;
+
+  if (!is_proper_list(exps)) {
+    return exps;
+  }
+
+  head = tail = the_empty_list;
+
+  for (; !is_the_empty_list(exps); exps = cdr(exps)) {
+    exp = car(exps);
+
+    if (is_begin(exp) && is_proper_list(exp)) {
+      for (nested = begin_actions(exp);
+           !is_the_empty_list(nested);
+           nested = cdr(nested)) {
+        if (!is_the_empty_list(cdr(exps)) && is_literal(car(nested))) {
+          continue;
+        }
+
+        list_append_cell(&head, &tail, car(nested));
+      }
+    } else if (is_the_empty_list(cdr(exps)) || !is_literal(exp)) {
+      list_append_cell(&head, &tail, exp);
+    }
+  }
+
+  return head;
+}
+
+char occurs_in(object *var, object *exp) {
+  for (; is_pair(exp); exp = cdr(exp)) {
+    if (occurs_in(var, car(exp))) {
+      return 1;
+    }
+  }
+
+  return exp == var;
+}
+
+/* Makes a body a single expression, so calls need not wrap it. */
+object *wrap_body(object *body) {
+  if (!is_proper_list(body) || is_the_empty_list(body) ||
+      is_last_exp(body)) {
+    return body;
+  }
+
+  return cons(make_begin(body), the_empty_list);
+}
+
+/* ((lambda (x y) body) a b): drops each parameter that body never
+ * mentions whose operand is a literal, a lambda or a local variable,
+ * and the call itself once none are left. */
+object *fold_lambda_call(object *exp, object *scope, object *env) {
+  object *parameters;
+  object *arguments;
+  object *body;
+  object *head;
+  object *tail;
+  object *kept;
+  object *kept_tail;
+  object *value;
+
+  parameters = lambda_parameters(operator(exp));
+  body = lambda_body(operator(exp));
+  head = tail = the_empty_list;
+  kept = kept_tail = the_empty_list;
+
+  if (!is_proper_list(parameters) ||
+      list_length(parameters) != list_length(operands(exp))) {
+    return exp;
+  }
+
+  for (arguments = operands(exp);
+       !is_the_empty_list(parameters);
+       parameters = cdr(parameters), arguments = cdr(arguments)) {
+    value = car(arguments);
+
+    if (occurs_in(car(parameters), body) ||
+        !(is_literal(value) || is_lambda(value) ||
+          (is_symbol(value) && is_in_scope(value, scope)))) {
+      list_append_cell(&head, &tail, car(parameters));
+      list_append_cell(&kept, &kept_tail, value);
+    }
+  }
+
+  if (is_the_empty_list(head) &&
+      is_the_empty_list(scope_definitions(body, the_empty_list, env))) {
+    return sequence_to_exp(body);
+  }
+
+  return make_application(make_lambda(head, body), kept);
+}
+
+/* cond and guard clauses: else and => are symbols, which analyze to
+ * themselves */
+object *analyze_clauses(object *clauses, object *scope, object *env) {
+  object *head;
+  object *tail;
+
+  if (!is_proper_list(clauses)) {
+    return clauses;
+  }
+
+  head = tail = the_empty_list;
+
+  for (; !is_the_empty_list(clauses); clauses = cdr(clauses)) {
+    list_append_cell(&head, &tail, analyze_list(car(clauses), scope, env));
+  }
+
+  return head;
+}
+
+/* Opens code a call whose operands have been analyzed. */
+object *analyze_inline_call(object *exp, object *scope, object *env) {
+  object *inline_proc;
+
+  inline_proc = analyze_inline_operator(exp, scope, env);
+
+  if (inline_proc == NULL) {
+    return exp;
+  }
+
+  return cons(inline_proc, operands(exp));
+}
+
+/* Builds the dispatch table of a case node from (datum . tail) entries
+ * in clause order; sets *low as case_branch expects. */
+object *make_case_table(object *entries, object *else_tail, object **low) {
+  object *table;
+  object *entry;
+  object **items;
+  object_type type;
+  unsigned long size;
+  unsigned long i;
+  long count;
+  long min;
+  long max;
+
+  type = is_the_empty_list(entries) ? FIXNUM : caar(entries)->type;
+  count = 0;
+  min = max = 0;
+
+  for (entry = entries; !is_the_empty_list(entry); entry = cdr(entry)) {
+    if (caar(entry)->type != type || (type != FIXNUM && type != CHARACTER)) {
+      break;
+    }
+
+    if (count == 0 || case_ordinal(caar(entry)) < min) {
+      min = case_ordinal(caar(entry));
+    }
+
+    if (count == 0 || case_ordinal(caar(entry)) > max) {
+      max = case_ordinal(caar(entry));
+    }
+
+    count++;
+  }
+
+  /* keys of one type that are dense enough index the table directly */
+  if (is_the_empty_list(entry) && count > 0 &&
+      (unsigned long)max - (unsigned long)min < 2 * (unsigned long)count + 8) {
+    table = make_vector(max - min + 2, else_tail);
+    items = table->data.vector.items;
+
+    for (entry = entries; !is_the_empty_list(entry); entry = cdr(entry)) {
+      i = case_ordinal(caar(entry)) - min;
+
+      if (items[i] == else_tail) {
+        items[i] = cdar(entry);
+      }
+    }
+
+    *low = type == FIXNUM ?
+      make_fixnum(min) :
+      make_character((char)min);
+
+    return table;
+  }
+
+  size = 2 * list_length(entries) + 4;
+
+  while ((size & (size - 1)) != 0) {
+    size &= size - 1;
+  }
+
+  table = make_vector(2 * size, else_tail);
+  items = table->data.vector.items;
+
+  for (i = 0; i < size; i++) {
+    items[2 * i] = table;
+  }
+
+  for (entry = entries; !is_the_empty_list(entry); entry = cdr(entry)) {
+    for (i = case_hash(caar(entry)) & (size - 1);
+         items[2 * i] != table && !is_eqv(items[2 * i], caar(entry));
+         i = (i + 1) & (size - 1)) {
+    }
+
+    if (items[2 * i] == table) {
+      items[2 * i] = caar(entry);
+      items[2 * i + 1] = cdar(entry);
+    }
+  }
+
+  *low = the_empty_list;
+
+  return table;
+}
+
+char is_case_arrow_clause(object *clause, object *scope) {
+  return is_pair(cdr(clause)) &&
+    resolve_symbol(cadr(clause), scope) == S(arrow_symbol) &&
+    is_pair(cddr(clause)) && is_the_empty_list(cdddr(clause));
+}
+
+/* case becomes a case node; see case_key. */
+object *analyze_case(object *exp, object *scope, object *env) {
+  object *clauses;
+  object *clause;
+  object *body;
+  object *bodies;
+  object *tail;
+  object *entries;
+  object *entries_tail;
+  object *datums;
+  object *variable;
+  object *table;
+  object *low;
+
+  if (!is_proper_list(exp)) {
+    throw_error("bad case syntax", strip_syntax(exp));
+  }
+
+  /* => passes the key on, so it must be a variable */
+  for (clauses = cddr(exp);
+       !is_the_empty_list(clauses);
+       clauses = cdr(clauses)) {
+    if (is_pair(car(clauses)) && is_case_arrow_clause(car(clauses), scope) &&
+        !is_symbol(case_key(exp))) {
+      variable = make_alias(make_symbol("key"));
+
+      return analyze_exp(make_application(
+                           make_lambda(cons(variable, the_empty_list),
+                                       cons(cons(S(case_symbol),
+                                                 cons(variable, cddr(exp))),
+                                            the_empty_list)),
+                           cons(case_key(exp), the_empty_list)),
+                         scope, env);
+    }
+  }
+
+  bodies = tail = the_empty_list;
+  entries = entries_tail = the_empty_list;
+
+  for (clauses = cddr(exp);
+       !is_the_empty_list(clauses);
+       clauses = cdr(clauses)) {
+    clause = car(clauses);
+
+    if (!is_pair(clause) || !is_pair(cdr(clause)) ||
+        !is_proper_list(clause)) {
+      throw_error("bad case clause", strip_syntax(clause));
+    }
+
+    body = is_case_arrow_clause(clause, scope) ?
+      cons(make_application(caddr(clause),
+                            cons(case_key(exp), the_empty_list)),
+           the_empty_list) :
+      cdr(clause);
+    list_append_cell(&bodies, &tail,
+                     sequence_to_exp(flatten_sequence(
+                                       analyze_list(body, scope, env))));
+
+    if (resolve_symbol(car(clause), scope) == S(else_symbol)) {
+      if (!is_the_empty_list(cdr(clauses))) {
+        throw_error("else clause is not last", strip_syntax(exp));
+      }
+
+      break;
+    }
+
+    if (!is_proper_list(car(clause))) {
+      throw_error("bad case clause", strip_syntax(clause));
+    }
+
+    for (datums = strip_syntax(car(clause));
+         !is_the_empty_list(datums);
+         datums = cdr(datums)) {
+      list_append_cell(&entries, &entries_tail, cons(car(datums), tail));
+    }
+  }
+
+  if (is_the_empty_list(clauses)) {
+    list_append_cell(&bodies, &tail, false);
+  }
+
+  table = make_case_table(entries, tail, &low);
+
+  return cons(make_inline_proc(INLINE_CASE, table, low),
+              cons(analyze_exp(case_key(exp), scope, env), bodies));
+}
+
+char occurs_any(object *vars, object *exp) {
+  for (; !is_the_empty_list(vars); vars = cdr(vars)) {
+    if (occurs_in(car(vars), exp)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+char scan_loop(object *exp, object *tag, object *variables, object *recur,
+               char tail);
+
+/* scan_loop for each expression of a list: the last one is in tail
+ * position if tail is, and all of them are if each is. */
+char scan_loop_list(object *exps, object *tag, object *variables,
+                    object *recur, char tail, char each) {
+  for (; is_pair(exps); exps = cdr(exps)) {
+    if (!scan_loop(car(exps), tag, variables, recur,
+                   each || (tail && is_the_empty_list(cdr(exps))))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Checks that a named let's tag occurs in exp only as the operator of
+ * tail calls with one operand per variable, and that no closure in exp
+ * refers to the tag or the variables.  Given a recur node, it also
+ * turns those calls into jumps, in place. */
+char scan_loop(object *exp, object *tag, object *variables, object *recur,
+               char tail) {
+  object *node;
+
+  if (exp == tag) {
+    return 0;
+  }
+
+  if (!is_pair(exp) || is_quoted(exp)) {
+    return 1;
+  }
+
+  if (!is_proper_list(exp)) {
+    return !occurs_in(tag, exp);
+  }
+
+  if (is_lambda(exp)) {
+    return !occurs_in(tag, exp) && !occurs_any(variables, exp);
+  }
+
+  if (operator(exp) == tag) {
+    if (!tail || list_length(operands(exp)) != list_length(variables) ||
+        !scan_loop_list(operands(exp), tag, variables, recur, 0, 0)) {
+      return 0;
+    }
+
+    if (recur != NULL) {
+      set_car(exp, recur);
+    }
+
+    return 1;
+  }
+
+  if (is_inline_call(exp)) {
+    node = operator(exp);
+
+    switch (node->data.inline_proc.opcode) {
+    case INLINE_CASE:
+      return scan_loop(case_key(exp), tag, variables, recur, 0) &&
+        scan_loop_list(case_bodies(exp), tag, variables, recur, tail, 1);
+    case INLINE_FOLD:
+      return scan_loop(fold_value(exp), tag, variables, recur, tail) &&
+        scan_loop(fold_original(exp), tag, variables, recur, tail);
+    case INLINE_LOOP:
+      return !occurs_in(tag, node->data.inline_proc.cell) &&
+        scan_loop(loop_body(exp), tag, variables, recur, tail) &&
+        scan_loop_list(loop_inits(exp), tag, variables, recur, 0, 0);
+    default:
+      return scan_loop_list(operands(exp), tag, variables, recur, 0, 0);
+    }
+  }
+
+  if (is_if(exp)) {
+    return scan_loop(if_predicate(exp), tag, variables, recur, 0) &&
+      scan_loop_list(cddr(exp), tag, variables, recur, tail, 1);
+  }
+
+  if (is_begin(exp) || is_and(exp) || is_or(exp)) {
+    return scan_loop_list(cdr(exp), tag, variables, recur, tail, 0);
+  }
+
+  /* the body of ((lambda ...) ...) runs in place of the call */
+  if (is_lambda(operator(exp))) {
+    return !occurs_in(tag, lambda_parameters(operator(exp))) &&
+      scan_loop_list(lambda_body(operator(exp)), tag, variables, recur,
+                     tail, 0) &&
+      scan_loop_list(operands(exp), tag, variables, recur, 0, 0);
+  }
+
+  return scan_loop_list(exp, tag, variables, recur, 0, 0);
+}
+
+/* A named let becomes a loop node when scan_loop allows, and otherwise
+ * (((lambda (tag) (set! tag (lambda ...)) tag) #f) init ...). */
+object *analyze_named_let(object *exp, object *scope, object *env) {
+  object *tag;
+  object *bindings;
+  object *parameters;
+  object *parameters_tail;
+  object *inits;
+  object *inits_tail;
+  object *body;
+  object *loop;
+  object *procedure;
+  long count;
+
+  tag = cadr(exp);
+  parameters = parameters_tail = the_empty_list;
+  inits = inits_tail = the_empty_list;
+  count = 0;
+
+  for (bindings = caddr(exp); is_pair(bindings); bindings = cdr(bindings)) {
+    if (!is_pair(car(bindings)) || !is_symbol(caar(bindings)) ||
+        !is_pair(cdar(bindings)) || !is_the_empty_list(cddar(bindings))) {
+      throw_error("bad let binding", strip_syntax(car(bindings)));
+    }
+
+    list_append_cell(&parameters, &parameters_tail, caar(bindings));
+    list_append_cell(&inits, &inits_tail, cadar(bindings));
+    count++;
+  }
+
+  inits = analyze_list(inits, scope, env);
+  body = analyze_body(parameters, cdddr(exp), cons(tag, scope), env);
+
+  if (count <= LOOP_MAX_VARIABLES && !occurs_in(tag, parameters) &&
+      is_the_empty_list(scope_definitions(body, the_empty_list, env)) &&
+      scan_loop_list(body, tag, parameters, NULL, 1, 0)) {
+    loop = make_inline_proc(INLINE_LOOP, parameters, the_empty_list);
+    scan_loop_list(body, tag, parameters,
+                   make_inline_proc(INLINE_RECUR, loop, the_empty_list),
+                   1, 0);
+    loop->data.inline_proc.primitive = sequence_to_exp(body);
+
+    return cons(loop, cons(loop->data.inline_proc.primitive, inits));
+  }
+
+  procedure = make_lambda(parameters, wrap_body(body));
+
+  return make_application(
+           make_application(
+             make_lambda(cons(tag, the_empty_list),
+                         cons(cons(S(set_symbol),
+                                   cons(tag,
+                                        cons(procedure, the_empty_list))),
+                              cons(tag, the_empty_list))),
+             cons(false, the_empty_list)),
+           inits);
+}
+
+object *analyze_exp(object *exp, object *scope, object *env) {
+  object *clauses;
+  object *folded;
+  object *value;
+  object *name;
+
+  if (is_symbol(exp)) {
+    return analyze_variable(exp, scope);
+  }
+
+  value = expand_head(exp, scope, env);
+  note_source_origin(value, exp);
+  exp = value;
+
+  if (is_symbol(exp)) {
+    return analyze_variable(exp, scope);
+  }
+
+  if (is_named_let(exp, scope)) {
+    return analyze_named_let(exp, scope, env);
+  }
+
+  if (is_quoted(exp)) {
+    return strip_syntax(exp);
+  }
+
+  if (!is_pair(exp)) {
+    return exp;
+  }
+
+  if (!is_pair(cdr(exp))) { /* a call without operands */
+    exp = analyze_list(exp, scope, env);
+
+    return is_lambda(operator(exp)) ? fold_lambda_call(exp, scope, env) : exp;
+  }
+
+  if (is_define_syntax(exp)) {
+    name = resolve_symbol(cadr(exp), scope);
+
+    /* internal macros were bound by scope_definitions */
+    if (!is_in_scope(name, scope)) {
+      define_macro(name, make_transformer(caddr(exp), scope, env), env);
+    }
+
+    return make_quotation(S(ok_symbol));
+  }
+
+  if (is_definition(exp) && is_pair(cadr(exp))) {
+    value = definition_value(exp);
+    note_source_origin(value, exp);
+
+    return analyze_exp(cons(car(exp),
+                            cons(definition_variable(exp),
+                                 cons(value, the_empty_list))),
+                       scope, env);
+  }
+
+  if ((is_assignment(exp) || is_definition(exp)) && is_symbol(cadr(exp))) {
+    return cons(car(exp),
+                cons(resolve_symbol(cadr(exp), scope),
+                     analyze_list(cddr(exp), scope, env)));
+  }
+
+  if (is_lambda(exp)) {
+    /* a procedure keeps only its body */
+    value = wrap_body(analyze_body(lambda_parameters(exp),
+                                   lambda_body(exp),
+                                   scope, env));
+    note_source_origin(value, exp);
+
+    return make_lambda(lambda_parameters(exp), value);
+  }
+
+  if (is_guard(exp) && is_pair(cadr(exp))) {
+    clauses = analyze_clauses(guard_clauses(exp),
+                              extend_scope(guard_variable(exp), scope),
+                              env);
+
+    return cons(car(exp),
+                cons(cons(guard_variable(exp), clauses),
+                     analyze_list(guard_body(exp), scope, env)));
+  }
+
+  if (is_if(exp)) {
+    return fold_if(cons(car(exp), analyze_list(cdr(exp), scope, env)));
+  }
+
+  if (is_tagged_list(exp, S(case_symbol)) &&
+      !is_in_scope(S(case_symbol), scope)) {
+    return analyze_case(exp, scope, env);
+  }
+
+  if (is_begin(exp) && is_proper_list(exp)) {
+    return sequence_to_exp(flatten_sequence(analyze_list(begin_actions(exp),
+                                                         scope, env)));
+  }
+
+  if (is_and(exp) || is_or(exp)) {
+    return cons(car(exp), analyze_list(cdr(exp), scope, env));
+  }
+
+  value = analyze_list(exp, scope, env);
+  note_source_origin(value, exp);
+  exp = value;
+
+  if (is_lambda(operator(exp))) {
+    return fold_lambda_call(exp, scope, env);
+  }
+
+  folded = fold_call(exp, scope, env);
+
+  if (folded != NULL) {
+    return folded;
+  }
+
+  value = analyze_inline_call(exp, scope, env);
+  note_source_origin(value, exp);
+
+  return value;
+}
+
+/* CONTINUATIONS */
+
+char *stack_mark(void) {
+  return __builtin_frame_address(0);
+}
+
+/* Makes k, which may be one popped before, the innermost live
+ * continuation. */
+void link_continuation(continuation *k, char escape_only) {
+  char *mark;
+
+  mark = stack_mark();
+
+  if (mark < S(stack_base)) {
+    k->stack_low = mark;
+    k->stack_size = S(stack_base) - mark;
+  } else {
+    k->stack_low = S(stack_base);
+    k->stack_size = mark - S(stack_base);
+  }
+
+  k->stack_copy = NULL;
+  k->live = 1;
+  k->escape_only = escape_only;
+  k->saved_winders = S(winders);
+  k->saved_handlers = S(handlers);
+  k->saved_running_call = S(running_call);
+  k->saved_profile_stack = S(profile_stack);
+  k->saved_mutations = S(mutation_count);
+  k->next = S(live_continuations);
+  S(live_continuations) = k;
+}
+
+continuation *push_continuation(char escape_only) {
+  continuation *k;
+
+  k = malloc(sizeof(continuation));
+
+  if (k == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  k->kept = 0;
+  k->object = NULL;
+  link_continuation(k, escape_only);
+
+  return k;
+}
+
+void pop_continuation(continuation *k) {
+  k->live = 0;
+  S(live_continuations) = k->next;
+}
+
+/* Frees k, which is dead, unless it is kept.  Its object, should one
+ * still be reachable, then refers to expired, which cannot be
+ * invoked. */
+void free_continuation(continuation *k) {
+  if (k->kept) {
+    return;
+  }
+
+  if (k->object != NULL) {
+    k->object->data.continuation.k = &S(expired);
+  }
+
+  free(k);
+}
+
+void release_continuation(continuation *k) {
+  pop_continuation(k);
+  free_continuation(k);
+}
+
+/* Whether the continuation object of k, whose extent is ending with
+ * value, may be invoked later.  Only a mutation since the capture, or
+ * a value that can hold references, could have kept it; a stricter
+ * test would have to search the heap. */
+char may_be_kept(continuation *k, object *value) {
+  if (S(mutation_count) != k->saved_mutations) {
+    return 1;
+  }
+
+  switch (value->type) {
+  case BOOLEAN:
+  case CHARACTER:
+  case EOF_OBJECT:
+  case FIXNUM:
+  case STRING:
+  case SYMBOL:
+  case THE_EMPTY_LIST:
+  case THE_EMPTY_STRING:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+/* Copies the stack of k, whose extent is ending.  Re-entering the copy
+ * relinks the continuations outside k, so those are kept too. */
+void save_continuation_stack(continuation *k) {
+  continuation *c;
+
+  if (k->stack_copy != NULL || k->escape_only) {
+    return;
+  }
+
+  k->stack_copy = malloc(k->stack_size);
+
+  if (k->stack_copy == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  memcpy(k->stack_copy, k->stack_low, k->stack_size);
+
+  for (c = k; c != NULL; c = c->next) {
+    c->kept = 1;
+  }
+}
+
+/* Ends the extent of k, which has left the live list, as value leaves
+ * it: the stack is copied if k may be re-entered, and otherwise k is
+ * freed. */
+void end_continuation(continuation *k, object *value) {
+  k->live = 0;
+
+  if (k->escape_only ||
+      (k->stack_copy == NULL && !may_be_kept(k, value))) {
+    free_continuation(k);
+  } else {
+    save_continuation_stack(k);
+  }
+}
+
+#define STACK_PAD 1024
+
+void restore_continuation_stack(continuation *k);
+
+void grow_stack(continuation *k) {
+  char pad[STACK_PAD];
+
+  memset(pad, 0, STACK_PAD);
+  restore_continuation_stack(k);
+}
+
+void restore_continuation_stack(continuation *k) {
+  char *here;
+
+  here = __builtin_frame_address(0);
+
+  /* keep pushing frames until this one lies clear of the region */
+  if (here >= k->stack_low - STACK_PAD &&
+      here <= k->stack_low + k->stack_size + STACK_PAD) {
+    grow_stack(k);
+  }
+
+  memcpy(k->stack_low, k->stack_copy, k->stack_size);
+  longjmp(k->jmp, 1);
+}
+
+char is_winders_prefix(object *common, object *list) {
+  while (!is_the_empty_list(list)) {
+    if (list == common) {
+      return 1;
+    }
+
+    list = cdr(list);
+  }
+
+  return is_the_empty_list(common);
+}
+
+void rewind_winders(object *to, object *common) {
+  if (to == common) {
+    return;
+  }
+
+  rewind_winders(cdr(to), common);
+  apply_procedure(caar(to), the_empty_list);
+  S(winders) = to;
+}
+
+void do_winds(object *to) {
+  object *common;
+  object *after;
+
+  common = S(winders);
+
+  while (!is_winders_prefix(common, to)) {
+    common = cdr(common);
+  }
+
+  while (S(winders) != common) {
+    after = cdar(S(winders));
+    S(winders) = cdr(S(winders));
+    apply_procedure(after, the_empty_list);
+  }
+
+  rewind_winders(to, common);
+}
+
+object *continuation_argument(object *arguments) {
+  return is_the_empty_list(arguments) ? S(ok_symbol) : car(arguments);
+}
+
+void trace_unwind(profile_frame *to);
+
+void throw_to_continuation(continuation *k, object *value) {
+  continuation *c;
+  continuation *next;
+
+  if (!k->live && k->escape_only) {
+    throw_error("continuation invoked outside its extent", value);
+  }
+
+  /* each green thread's continuations lie on its own stack */
+  if (k->stack_low != S(stack_base) &&
+      k->stack_low + k->stack_size != S(stack_base)) {
+    throw_error("continuation invoked from another thread", value);
+  }
+
+  do_winds(k->saved_winders);
+  S(handlers) = k->saved_handlers;
+  S(running_call) = k->saved_running_call;
+  S(continuation_value) = value;
+
+  if (k->live) {
+    /* an escape: only continuations captured deeper than k die */
+    for (c = S(live_continuations); c != k; c = next) {
+      next = c->next;
+      end_continuation(c, value);
+    }
+
+    S(live_continuations) = k;
+
+    if (tracing) {
+      trace_unwind(k->saved_profile_stack);
+    }
+
+    S(profile_stack) = k->saved_profile_stack;
+    longjmp(k->jmp, 1);
+  }
+
+  /* a re-entry: the whole current stack is about to be replaced, and
+   * the profiler must not walk it meanwhile */
+  if (tracing) {
+    trace_unwind(NULL);
+  }
+
+  S(profile_stack) = NULL;
+
+  for (c = S(live_continuations); c != NULL; c = c->next) {
+    save_continuation_stack(c);
+    c->live = 0;
+  }
+
+  for (c = k; c != NULL; c = c->next) {
+    c->live = 1;
+  }
+
+  S(live_continuations) = k;
+  restore_continuation_stack(k);
+}
+
+object *call_with_current_continuation(object *receiver) {
+  continuation *volatile k;
+  object *volatile result;
+
+  k = push_continuation(0);
+
+  if (setjmp(k->jmp) == 0) {
+    result = apply_procedure(receiver,
+                             cons(make_continuation(k), the_empty_list));
+  } else {
+    S(profile_stack) = k->saved_profile_stack;
+    result = S(continuation_value);
+  }
+
+  /* the extent is ending, so a later invocation has to re-enter */
+  pop_continuation(k);
+  end_continuation(k, result);
+
+  return result;
+}
+
+/* ERRORS */
+
+void throw_error(char *message, object *irritant) {
+  raise_object(make_error_object(make_string(message),
+                                 irritant == NULL ?
+                                 the_empty_list :
+                                 cons(irritant, the_empty_list)),
+               0);
+  exit(1); /* not reached */
+}
+
+#define BACKTRACE_MAX 20
+
+void write_profile_name(FILE *out, object *procedure, object_table *names);
+object_table *profile_names(void);
+
+/* Writes the procedures running, which eval only keeps while
+ * profiling (as --backtrace does), then where the call that failed
+ * was read, or else the top-level form being evaluated. */
+void write_backtrace(FILE *out) {
+  object_table *names;
+  profile_frame *frame;
+  object *form;
+  long depth;
+
+  if (S(profile_stack) != NULL) {
+    names = profile_names();
+
+    for (frame = S(profile_stack), depth = 0;
+         frame != NULL && depth < BACKTRACE_MAX;
+         frame = frame->caller, depth++) {
+      fprintf(out, "  in ");
+      write_profile_name(out, frame->procedure, names);
+      fprintf(out, "\n");
+    }
+
+    for (depth = 0; frame != NULL; frame = frame->caller, depth++) {
+    }
+
+    if (depth > 0) {
+      fprintf(out, "  ... %ld more\n", depth);
+    }
+
+    free_object_table(names);
+  }
+
+  form = S(running_call) != NULL && source_location(S(running_call)) != -1 ?
+    S(running_call) :
+    S(toplevel_form);
+
+  if (form != NULL && source_location(form) != -1) {
+    fprintf(out, "  at ");
+    write_source_location(out, form);
+    fprintf(out, "\n");
+  }
+}
+
+/* Writes obj, which was raised, as an error is reported. */
+void write_raised(FILE *out, object *obj) {
+  object *irritants;
+
+  fprintf(out, "error: ");
+
+  if (is_error_object(obj) && is_string(obj->data.error_object.message)) {
+    fprintf(out, "%s", is_the_empty_string(obj->data.error_object.message) ?
+            "" : obj->data.error_object.message->data.string.value);
+    irritants = obj->data.error_object.irritants;
+
+    while (is_pair(irritants)) {
+      fprintf(out, " ");
+      write_object(out, car(irritants));
+      irritants = cdr(irritants);
+    }
+  } else {
+    write_object(out, obj);
+  }
+
+  fprintf(out, "\n");
+}
+
+void report_uncaught(object *obj) {
+  fflush(stdout);
+  write_raised(stderr, obj);
+  write_backtrace(stderr);
+}
+
+object *raise_object(object *obj, char continuable) {
+  object *handler;
+  object *outer;
+  object *result;
+
+  if (is_the_empty_list(S(handlers))) {
+    report_uncaught(obj);
+
+    if (S(top_level) == NULL) {
+      exit(1);
+    }
+
+    throw_to_continuation(S(top_level), S(ok_symbol));
+  }
+
+  handler = car(S(handlers));
+  outer = S(handlers);
+  S(handlers) = cdr(S(handlers));
+
+  result = apply_procedure(handler, cons(obj, the_empty_list));
+
+  if (!continuable) {
+    throw_error("exception handler returned", obj);
+  }
+
+  S(handlers) = outer;
+
+  return result;
+}
+
+object *eval_guard(object *exp, object *env) {
+  continuation *volatile k;
+  object *volatile result;
+  object *condition;
+  object *clauses;
+  object *clause;
+
+  k = push_continuation(1);
+
+  if (setjmp(k->jmp) == 0) {
+    S(handlers) = cons(make_continuation(k), S(handlers));
+    result = eval(make_begin(guard_body(exp)), env);
+    S(handlers) = cdr(S(handlers));
+    release_continuation(k);
+
+    return result;
+  }
+
+  release_continuation(k);
+
+  condition = S(continuation_value);
+  env = extend_environment(cons(guard_variable(exp), the_empty_list),
+                           cons(condition, the_empty_list),
+                           env);
+
+  for (clauses = guard_clauses(exp);
+       !is_the_empty_list(clauses);
+       clauses = cdr(clauses)) {
+    clause = car(clauses);
+
+    if (is_cond_else_clause(clause)) {
+      return eval(sequence_to_exp(cond_actions(clause)), env);
+    }
+
+    result = eval(cond_predicate(clause), env);
+
+    if (is_true(result)) {
+      return is_the_empty_list(cond_actions(clause)) ?
+        result :
+        eval(sequence_to_exp(cond_actions(clause)), env);
+    }
+  }
+
+  /* no clause matched: pass the condition on to the outer handler */
+  return raise_object(condition, 1);
+}
+
+/* PRINT */
+
+void write_pair(FILE *out, object *pair) {
+  object *car_obj;
+  object *cdr_obj;
+
+  car_obj = car(pair);
+  cdr_obj = cdr(pair);
+
+  write_object(out, car_obj);
+
+  if (cdr_obj->type == PAIR) {
+    fprintf(out, " ");
+    write_pair(out, cdr_obj);
+  } else if (cdr_obj->type == THE_EMPTY_LIST) {
+    return;
+  } else {
+    fprintf(out, " . ");
+    write_object(out, cdr_obj);
+  }
+}
+
+void write_object(FILE *out, object *obj) {
+  char c;
+  char *str;
+  object *body;
+  long i;
+
+  switch (obj->type) {
+  case BOOLEAN:
+    fprintf(out, "#%c", is_false(obj) ? 'f' : 't');
+
+    break;
+
+  case CHARACTER:
+    c = obj->data.character.value;
+    fprintf(out, "#\\");
+
+    switch (c) {
+    case '\n':
+      fprintf(out, "newline");
+      break;
+    case ' ':
+      fprintf(out, "space");
+      break;
+    default:
+      putc(c, out);
+    }
+
+    break;
+
+  case COMPOUND_PROC:
+    body = obj->data.compound_proc.body;
+
+    fprintf(out, "(lambda ");
+    write_object(out, obj->data.compound_proc.parameters);
+    fprintf(out, " ");
+
+    if (is_pair(body)) {
+      write_pair(out, body);
+    } else {
+      write_object(out, body);
+    }
+
+    fprintf(out, ")");
+
+    break;
+
+  case CHANNEL:
+    fprintf(out, "#<channel>");
+
+    break;
+
+  case CONDITION_VARIABLE:
+    fprintf(out, "#<condition-variable>");
+
+    break;
+
+  case CONTINUATION:
+    fprintf(out, "#<continuation>");
+
+    break;
+
+  case ISOLATE:
+    fprintf(out, "#<isolate>");
+
+    break;
+
+  case MUTEX:
+    fprintf(out, "#<mutex>");
+
+    break;
+
+  case THREAD:
+    fprintf(out, "#<thread>");
+
+    break;
+
+  case ERROR_OBJECT:
+    fprintf(out, "#<error ");
+    write_object(out, obj->data.error_object.message);
+
+    if (!is_the_empty_list(obj->data.error_object.irritants)) {
+      fprintf(out, " ");
+      write_pair(out, obj->data.error_object.irritants);
+    }
+
+    fprintf(out, ">");
+
+    break;
+
+  case FIXNUM:
+    fprintf(out, "%ld", obj->data.fixnum.value);
+
+    break;
+
+  case FRAME:
+    fprintf(out, "#<environment>");
+
+    break;
+
+  case INLINE_PROC:
+    switch (obj->data.inline_proc.opcode) {
+    case INLINE_CASE:
+      fprintf(out, "#<case>");
+      break;
+    case INLINE_FOLD:
+      fprintf(out, "#<folded>");
+      break;
+    case INLINE_LOOP:
+      fprintf(out, "#<loop>");
+      break;
+    case INLINE_RECUR:
+      fprintf(out, "#<recur>");
+      break;
+    case INLINE_GLOBAL:
+      fprintf(out, "#<global %s>",
+              obj->data.inline_proc.cell->data.symbol.value);
+      break;
+    default:
+      fprintf(out, "%s",
+              primitive_name(obj->data.inline_proc.primitive->
+                             data.primitive_proc.fn));
+    }
+
+    break;
+
+  case PAIR:
+    fprintf(out, "(");
+    write_pair(out, obj);
+    fprintf(out, ")");
+
+    break;
+
+  case MACRO:
+    fprintf(out, "#<macro>");
+
+    break;
+
+  case PRIMITIVE_PROC:
+    fprintf(out, "#<procedure>");
+
+    break;
+
+  case STRING:
+    str = obj->data.string.value;
+
+    putc('"', out);
+
+    while (*str != '\0') {
+      switch (*str) {
+      case '\n':
+	fprintf(out, "\\n");
+
+	break;
+
+      case '\\':
+	fprintf(out, "\\\\");
+
+	break;
+
+      case '"':
+	fprintf(out, "\\\"");
+	break;
+
+      default:
+	putc(*str, out);
+      }
+
+      str++;
+    }
+
+    putc('"', out);
+
+    break;
+
+  case SYMBOL:
+    fprintf(out, "%s", obj->data.symbol.value);
+
+    break;
+
+  case THE_EMPTY_LIST:
+    fprintf(out, "()");
+    break;
+
+  case THE_EMPTY_STRING:
+    fprintf(out, "\"\"");
+    break;
+
+  case VECTOR:
+    fprintf(out, "#(");
+
+    for (i = 0; i < obj->data.vector.length; i++) {
+      if (i > 0) {
+        fprintf(out, " ");
+      }
+
+      write_object(out, obj->data.vector.items[i]);
+    }
+
+    fprintf(out, ")");
+    break;
+
+  default:
+    throw_error("cannot write unknown type", NULL);
+  }
+}
+
+/* PROFILER */
+
+/* A SIGPROF timer samples profile_stack.  The handler only copies the
+ * procedures it finds, innermost first and then NULL, into
+ * profile_samples; write_profile works out the reports afterwards.
+ * A stack deeper than PROFILE_DEPTH_MAX is cut off, and the sample
+ * ends in &profile_truncated before the NULL.
+ * With profiling off, eval tests one flag per procedure call and
+ * pushes nothing. */
+
+#define PROFILE_DEFAULT_HZ 1000
+#define PROFILE_DEPTH_MAX 64
+#define PROFILE_SAMPLES_MAX (1L << 20)
+
+object **profile_samples;
+object profile_truncated; /* marks a sample cut off, never used */
+volatile long profile_used;
+volatile long profile_count;
+volatile long profile_dropped;
+long profile_interval;
+char sampling;
+
+typedef struct profile_entry {
+  object *procedure;
+  long self;
+  long total;
+  long seen;
+} profile_entry;
+
+typedef struct profile_edge {
+  long caller;
+  long callee;
+  long sample;
+} profile_edge;
+
+/* Marks record as running procedure; a tail call reuses the record. */
+void enter_profile_frame(profile_frame *record, object *procedure) {
+  if (record->procedure != NULL) {
+    if (tracing) {
+      record_trace_event('E', record->procedure, NULL);
+      record_trace_event('B', procedure, NULL);
+    }
+
+    record->procedure = procedure;
+
+    return;
+  }
+
+  if (tracing) {
+    record_trace_event('B', procedure, NULL);
+  }
+
+  record->procedure = procedure;
+  record->caller = S(profile_stack);
+  S(profile_stack) = record;
+}
+
+void leave_profile_frame(profile_frame *record) {
+  if (tracing) {
+    record_trace_event('E', record->procedure, NULL);
+  }
+
+  S(profile_stack) = record->caller;
+}
+
+object *apply_profiled(object *procedure, object *arguments) {
+  profile_frame record;
+  object *env;
+  object *result;
+
+  record.procedure = NULL;
+
+  if (is_primitive_proc(procedure)) {
+    enter_profile_frame(&record, procedure);
+    result = (procedure->data.primitive_proc.fn)(arguments);
+    leave_profile_frame(&record);
+
+    return result;
+  }
+
+  env = bind_arguments(procedure->data.compound_proc.parameters,
+                       arguments,
+                       procedure->data.compound_proc.env);
+  enter_profile_frame(&record, procedure);
+  result = eval(body_expression(procedure->data.compound_proc.body), env);
+  leave_profile_frame(&record);
+
+  return result;
+}
+
+void profile_tick(int signal_number) {
+  profile_frame *frame;
+  long depth;
+
+  if (profile_used + PROFILE_DEPTH_MAX + 2 > PROFILE_SAMPLES_MAX) {
+    profile_dropped++;
+
+    return;
+  }
+
+  for (frame = S(profile_stack), depth = 0;
+       frame != NULL && depth < PROFILE_DEPTH_MAX;
+       frame = frame->caller, depth++) {
+    profile_samples[profile_used++] = frame->procedure;
+  }
+
+  if (frame != NULL) {
+    profile_samples[profile_used++] = &profile_truncated;
+  }
+
+  profile_samples[profile_used++] = NULL;
+  profile_count++;
+}
+
+/* eval keeps profile_stack while anything wants it */
+void update_profiling(void) {
+  profiling = sampling || tracking_allocations || tracing || backtraces;
+}
+
+void set_profile_timer(long interval) {
+  struct itimerval timer;
+
+  timer.it_interval.tv_sec = interval / 1000000;
+  timer.it_interval.tv_usec = interval % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void resume_profiler(void) {
+  sampling = 1;
+  update_profiling();
+  set_profile_timer(profile_interval);
+}
+
+void suspend_profiler(void) {
+  set_profile_timer(0);
+  sampling = 0;
+  update_profiling();
+}
+
+void start_profiler(long hz) {
+  struct sigaction action;
+
+  if (profile_samples == NULL) {
+    profile_samples = malloc(PROFILE_SAMPLES_MAX * sizeof(object *));
+
+    if (profile_samples == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  profile_used = 0;
+  profile_count = 0;
+  profile_dropped = 0;
+  profile_interval = hz >= 1000000 ? 1 : 1000000 / hz;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = profile_tick;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &action, NULL);
+
+  resume_profiler();
+}
+
+long profile_entry_index(object *procedure, object_table *index,
+                         profile_entry **entries, long *count) {
+  long i;
+
+  i = object_table_get(index, procedure, -1);
+
+  if (i != -1) {
+    return i;
+  }
+
+  if ((*count & (*count - 1)) == 0) {
+    *entries = realloc(*entries, 2 * *count * sizeof(profile_entry));
+
+    if (*entries == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  i = (*count)++;
+  (*entries)[i].procedure = procedure;
+  (*entries)[i].self = 0;
+  (*entries)[i].total = 0;
+  (*entries)[i].seen = -1;
+  object_table_put(index, procedure, i);
+
+  return i;
+}
+
+int compare_profile_edges(const void *a, const void *b) {
+  const profile_edge *x;
+  const profile_edge *y;
+
+  x = a;
+  y = b;
+
+  if (x->caller != y->caller) {
+    return x->caller < y->caller ? -1 : 1;
+  }
+
+  if (x->callee != y->callee) {
+    return x->callee < y->callee ? -1 : 1;
+  }
+
+  return x->sample < y->sample ? -1 : x->sample > y->sample;
+}
+
+int compare_profile_self(const void *a, const void *b) {
+  const profile_entry *x;
+  const profile_entry *y;
+
+  x = *(profile_entry *const *)a;
+  y = *(profile_entry *const *)b;
+
+  if (x->self != y->self) {
+    return x->self > y->self ? -1 : 1;
+  }
+
+  return x->total > y->total ? -1 : x->total < y->total;
+}
+
+int compare_profile_total(const void *a, const void *b) {
+  const profile_entry *x;
+  const profile_entry *y;
+
+  x = *(profile_entry *const *)a;
+  y = *(profile_entry *const *)b;
+
+  if (x->total != y->total) {
+    return x->total > y->total ? -1 : 1;
+  }
+
+  return x->self > y->self ? -1 : x->self < y->self;
+}
+
+/* Names procedures by the globals bound to them. */
+object_table *profile_names(void) {
+  object_table *names;
+  object *vars;
+  object *vals;
+
+  names = make_object_table();
+
+  for (vars = frame_variables(first_frame(S(the_global_environment))),
+         vals = frame_values(first_frame(S(the_global_environment)));
+       !is_the_empty_list(vars);
+       vars = cdr(vars), vals = cdr(vals)) {
+    if ((is_compound_proc(car(vals)) || is_primitive_proc(car(vals))) &&
+        object_table_get(names, car(vals), 0) == 0) {
+      object_table_put(names, car(vals), (long)car(vars));
+    }
+  }
+
+  return names;
+}
+
+/* Where a compound procedure's lambda was, else its first body
+ * expression. */
+object *procedure_source(object *procedure) {
+  object *obj;
+
+  obj = procedure->data.compound_proc.body;
+
+  while (is_pair(obj) && source_location(obj) == -1) {
+    obj = is_begin(obj) ? begin_actions(obj) : car(obj);
+  }
+
+  return obj;
+}
+
+void write_profile_name(FILE *out, object *procedure, object_table *names) {
+  object *name;
+
+  if (procedure == NULL) {
+    fprintf(out, "<top level>");
+
+    return;
+  }
+
+  name = (object *)object_table_get(names, procedure, 0);
+
+  if (name != NULL) {
+    write_object(out, name);
+  } else if (is_primitive_proc(procedure)) {
+    write_object(out, procedure);
+  } else {
+    fprintf(out, "(lambda ");
+    write_object(out, procedure->data.compound_proc.parameters);
+    fprintf(out, " ...)");
+  }
+
+  if (is_compound_proc(procedure) &&
+      source_location(procedure_source(procedure)) != -1) {
+    fprintf(out, " (");
+    write_source_location(out, procedure_source(procedure));
+    fprintf(out, ")");
+  }
+}
+
+double profile_percent(long samples, long count) {
+  return count == 0 ? 0.0 : 100.0 * samples / count;
+}
+
+/* Writes a flat profile by time spent in each procedure itself, then
+ * a call graph with each procedure's callers (<-) and callees (->).
+ * A truncated sample counts for the procedure it caught running, but
+ * not for totals or the call graph, which cannot see all its callers;
+ * those are percentages of the complete samples. */
+void write_profile(FILE *out) {
+  object_table *index;
+  object_table *names;
+  profile_entry *entries;
+  profile_entry **order;
+  profile_edge *edges;
+  profile_edge *edge;
+  long chain[PROFILE_DEPTH_MAX + 1];
+  long entry_count;
+  long edge_count;
+  long complete;
+  long sample;
+  long depth;
+  long count;
+  long i;
+  long j;
+
+  fprintf(out, "profile: %ld samples, one every %ld us",
+          profile_count, profile_interval);
+
+  if (profile_dropped > 0) {
+    fprintf(out, ", %ld dropped", profile_dropped);
+  }
+
+  complete = 0;
+
+  for (i = 0; i < profile_used; i++) {
+    if (profile_samples[i] == NULL) {
+      complete++;
+    } else if (profile_samples[i] == &profile_truncated) {
+      complete--;
+    }
+  }
+
+  if (complete < profile_count) {
+    fprintf(out, ", %ld over %d calls deep left out of totals",
+            profile_count - complete, PROFILE_DEPTH_MAX);
+  }
+
+  fprintf(out, "\n");
+
+  if (profile_count == 0) {
+    return;
+  }
+
+  index = make_object_table();
+  edges = malloc(profile_used * sizeof(profile_edge));
+
+  if (edges == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  edge_count = 0;
+  entry_count = 1;
+  entries = malloc(sizeof(profile_entry));
+
+  if (entries == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  /* entry 0 is the top level, which every sample ends in */
+  entries[0].procedure = NULL;
+  entries[0].self = 0;
+  entries[0].total = 0;
+  entries[0].seen = -1;
+
+  for (i = 0, sample = 0; i < profile_used; i++, sample++) {
+    for (depth = 0;
+         profile_samples[i] != NULL &&
+           profile_samples[i] != &profile_truncated;
+         i++) {
+      chain[depth++] = profile_entry_index(profile_samples[i], index,
+                                           &entries, &entry_count);
+    }
+
+    if (profile_samples[i] == &profile_truncated) {
+      i++;
+      entries[chain[0]].self++;
+
+      continue;
+    }
+
+    chain[depth++] = 0;
+    entries[chain[0]].self++;
+
+    for (j = 0; j < depth; j++) {
+      if (entries[chain[j]].seen != sample) {
+        entries[chain[j]].seen = sample;
+        entries[chain[j]].total++;
+      }
+
+      if (j + 1 < depth) {
+        edges[edge_count].caller = chain[j + 1];
+        edges[edge_count].callee = chain[j];
+        edges[edge_count].sample = sample;
+        edge_count++;
+      }
+    }
+  }
+
+  /* one edge per caller and callee, counting the samples it was in */
+  qsort(edges, edge_count, sizeof(profile_edge), compare_profile_edges);
+
+  for (i = 0, j = 0; i < edge_count; j++) {
+    edges[j] = edges[i];
+    count = 0;
+
+    for (sample = -1;
+         i < edge_count && edges[i].caller == edges[j].caller &&
+           edges[i].callee == edges[j].callee;
+         i++) {
+      if (edges[i].sample != sample) {
+        sample = edges[i].sample;
+        count++;
+      }
+    }
+
+    edges[j].sample = count;
+  }
+
+  edge_count = j;
+  names = profile_names();
+  order = malloc(entry_count * sizeof(profile_entry *));
+
+  if (order == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  for (i = 0; i < entry_count; i++) {
+    order[i] = &entries[i];
+  }
+
+  fprintf(out, "\n  self  total  procedure\n");
+  qsort(order, entry_count, sizeof(profile_entry *), compare_profile_self);
+
+  for (i = 0; i < entry_count && order[i]->self > 0; i++) {
+    fprintf(out, "%5.1f%% %5.1f%%  ",
+            profile_percent(order[i]->self, profile_count),
+            profile_percent(order[i]->total, complete));
+    write_profile_name(out, order[i]->procedure, names);
+    fprintf(out, "\n");
+  }
+
+  fprintf(out, "\n total  call graph\n");
+  qsort(order, entry_count, sizeof(profile_entry *), compare_profile_total);
+
+  for (i = 0; i < entry_count; i++) {
+    fprintf(out, "%5.1f%%  ", profile_percent(order[i]->total, complete));
+    write_profile_name(out, order[i]->procedure, names);
+    fprintf(out, "\n");
+
+    for (edge = edges; edge < edges + edge_count; edge++) {
+      if (&entries[edge->callee] == order[i]) {
+        fprintf(out, "%5.1f%%      <- ",
+                profile_percent(edge->sample, complete));
+        write_profile_name(out, entries[edge->caller].procedure, names);
+        fprintf(out, "\n");
+      }
+    }
+
+    for (edge = edges; edge < edges + edge_count; edge++) {
+      if (&entries[edge->caller] == order[i]) {
+        fprintf(out, "%5.1f%%      -> ",
+                profile_percent(edge->sample, complete));
+        write_profile_name(out, entries[edge->callee].procedure, names);
+        fprintf(out, "\n");
+      }
+    }
+  }
+
+  free(order);
+  free(edges);
+  free(entries);
+  free_object_table(names);
+  free_object_table(index);
+}
+
+object *proc_profile_resume(object *arguments) {
+  resume_profiler();
+
+  return S(ok_symbol);
+}
+
+object *proc_profile_suspend(object *arguments) {
+  suspend_profiler();
+
+  return S(ok_symbol);
+}
+
+/* (profile thunk [hz [port]]) calls thunk, sampling it hz times a
+ * second of CPU time, and writes the report to port. */
+object *proc_profile(object *arguments) {
+  object *thunk;
+  object *result;
+  FILE *out;
+  long hz;
+
+  if (sampling) {
+    throw_error("profile: already profiling", NULL);
+  }
+
+  thunk = car(arguments);
+  arguments = cdr(arguments);
+  hz = PROFILE_DEFAULT_HZ;
+
+  if (!is_the_empty_list(arguments)) {
+    if (!is_fixnum(car(arguments)) || car(arguments)->data.fixnum.value <= 0) {
+      throw_error("profile: bad rate", car(arguments));
+    }
+
+    hz = car(arguments)->data.fixnum.value;
+    arguments = cdr(arguments);
+  }
+
+  out = is_the_empty_list(arguments) ?
+    stdout :
+    car(arguments)->data.output_port.stream;
+
+  /* leaving the thunk by a continuation suspends sampling */
+  start_profiler(hz);
+  S(winders) = cons(cons(make_primitive_proc(proc_profile_resume),
+                         make_primitive_proc(proc_profile_suspend)),
+                    S(winders));
+
+  result = apply_procedure(thunk, the_empty_list);
+
+  S(winders) = cdr(S(winders));
+  suspend_profiler();
+  write_profile(out);
+  flush_output(out, arguments);
+
+  return result;
+}
+
+/* (call-with-timing thunk) calls thunk and writes what the call cost;
+ * time expands into it. */
+object *proc_call_with_timing(object *arguments) {
+  object *result;
+  long elapsed;
+  long cpu;
+  long objects;
+  long bytes;
+
+  elapsed = clock_jiffies(CLOCK_MONOTONIC);
+  cpu = clock_jiffies(CLOCK_PROCESS_CPUTIME_ID);
+  objects = S(heap_objects);
+  bytes = S(heap_bytes);
+
+  result = apply_procedure(car(arguments), the_empty_list);
+
+  elapsed = clock_jiffies(CLOCK_MONOTONIC) - elapsed;
+  cpu = clock_jiffies(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+  printf("time: %.3f ms elapsed, %.3f ms cpu, "
+         "%ld objects (%ld bytes) allocated, 0 ms in 0 collections\n",
+         elapsed * 1000.0 / JIFFIES_PER_SECOND,
+         cpu * 1000.0 / JIFFIES_PER_SECOND,
+         S(heap_objects) - objects, S(heap_bytes) - bytes);
+  fflush(stdout);
+
+  return result;
+}
+
+void write_profile_at_exit(void) {
+  suspend_profiler();
+  fflush(stdout);
+  write_profile(stderr);
+}
+
+/* ALLOCATIONS */
+
+/* While tracking, alloc_object and the constructors that malloc more
+ * than one object count every allocation and its bytes by type and by
+ * site: the innermost procedure on profile_stack and the primitive it
+ * is running, if any.  Open-coded cons and arithmetic count against
+ * the procedure doing them.  There is no collector, so the census
+ * marks what the roots still reach instead; everything else is garbage
+ * that stays allocated. */
+
+#define ALLOCATION_TYPES (VECTOR + 1)
+#define ALLOCATION_SITES_SHOWN 30
+
+typedef struct allocation_site {
+  object *procedure; /* NULL at top level */
+  object *primitive; /* NULL in the procedure's own body */
+  long count;
+  long bytes;
+  char used;
+} allocation_site;
+
+char *allocation_type_names[ALLOCATION_TYPES] = {
+  "boolean", "channel", "character", "compound-procedure",
+  "condition-variable", "continuation", "eof-object", "error-object",
+  "fixnum", "frame", "inline-node", "input-port", "isolate", "macro",
+  "mutex", "output-port", "pair", "primitive-procedure", "string",
+  "symbol", "empty-list", "empty-string", "thread", "vector"};
+
+long allocation_counts[ALLOCATION_TYPES];
+long allocation_bytes[ALLOCATION_TYPES];
+allocation_site *allocation_sites;
+allocation_site *last_allocation_site;
+long allocation_site_count;
+long allocation_site_size;
+
+allocation_site *probe_allocation_site(allocation_site *sites, long size,
+                                       object *procedure,
+                                       object *primitive) {
+  unsigned long i;
+
+  i = ((unsigned long)procedure >> 4) * 31 + ((unsigned long)primitive >> 4);
+
+  for (i &= size - 1;
+       sites[i].used &&
+         (sites[i].procedure != procedure ||
+          sites[i].primitive != primitive);
+       i = (i + 1) & (size - 1)) {
+  }
+
+  return &sites[i];
+}
+
+allocation_site *find_allocation_site(object *procedure, object *primitive) {
+  allocation_site *old;
+  allocation_site *site;
+  long old_size;
+  long i;
+
+  if (2 * (allocation_site_count + 1) > allocation_site_size) {
+    old = allocation_sites;
+    old_size = allocation_site_size;
+    allocation_site_size = old_size == 0 ? 64 : 2 * old_size;
+    allocation_sites = calloc(allocation_site_size, sizeof(allocation_site));
+
+    if (allocation_sites == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+
+    for (i = 0; i < old_size; i++) {
+      if (old[i].used) {
+        *probe_allocation_site(allocation_sites, allocation_site_size,
+                               old[i].procedure, old[i].primitive) = old[i];
+      }
+    }
+
+    free(old);
+  }
+
+  site = probe_allocation_site(allocation_sites, allocation_site_size,
+                               procedure, primitive);
+
+  if (!site->used) {
+    site->procedure = procedure;
+    site->primitive = primitive;
+    site->used = 1;
+    allocation_site_count++;
+  }
+
+  return site;
+}
+
+void track_allocation(object_type type, long count, long bytes) {
+  profile_frame *frame;
+  allocation_site *site;
+  object *primitive;
+  object *procedure;
+
+  if (S(spawned)) {
+    return;
+  }
+
+  allocation_counts[type] += count;
+  allocation_bytes[type] += bytes;
+
+  frame = S(profile_stack);
+  primitive = NULL;
+
+  if (frame != NULL && is_primitive_proc(frame->procedure)) {
+    primitive = frame->procedure;
+    frame = frame->caller;
+  }
+
+  procedure = frame == NULL ? NULL : frame->procedure;
+  site = last_allocation_site;
+
+  if (site == NULL || site->procedure != procedure ||
+      site->primitive != primitive) {
+    site = find_allocation_site(procedure, primitive);
+    last_allocation_site = site;
+  }
+
+  site->count += count;
+  site->bytes += bytes;
+}
+
+void start_allocation_tracking(void) {
+  free(allocation_sites);
+  allocation_sites = NULL;
+  last_allocation_site = NULL;
+  allocation_site_count = 0;
+  allocation_site_size = 0;
+  memset(allocation_counts, 0, sizeof(allocation_counts));
+  memset(allocation_bytes, 0, sizeof(allocation_bytes));
+  tracking_allocations = 1;
+  update_profiling();
+}
+
+void stop_allocation_tracking(void) {
+  tracking_allocations = 0;
+  update_profiling();
+}
+
+long *census_bytes; /* what compare_allocation_types sorts by */
+
+int compare_allocation_types(const void *a, const void *b) {
+  long x;
+  long y;
+
+  x = census_bytes[*(const int *)a];
+  y = census_bytes[*(const int *)b];
+
+  return x > y ? -1 : x < y;
+}
+
+int compare_allocation_sites(const void *a, const void *b) {
+  const allocation_site *x;
+  const allocation_site *y;
+
+  x = *(allocation_site *const *)a;
+  y = *(allocation_site *const *)b;
+
+  if (x->bytes != y->bytes) {
+    return x->bytes > y->bytes ? -1 : 1;
+  }
+
+  return x->count > y->count ? -1 : x->count < y->count;
+}
+
+/* Writes the types with any objects, most bytes first. */
+void write_allocation_types(FILE *out, long *counts, long *bytes) {
+  int order[ALLOCATION_TYPES];
+  int i;
+
+  for (i = 0; i < ALLOCATION_TYPES; i++) {
+    order[i] = i;
+  }
+
+  census_bytes = bytes;
+  qsort(order, ALLOCATION_TYPES, sizeof(int), compare_allocation_types);
+  fprintf(out, "\n   objects       bytes  type\n");
+
+  for (i = 0; i < ALLOCATION_TYPES; i++) {
+    if (counts[order[i]] > 0 || bytes[order[i]] > 0) {
+      fprintf(out, "%10ld  %10ld  %s\n",
+              counts[order[i]], bytes[order[i]],
+              allocation_type_names[order[i]]);
+    }
+  }
+}
+
+void census_visit(object_table *seen, object ***objects, long *count,
+                  long *capacity, object *obj) {
+  if (object_table_get(seen, obj, 0) != 0) {
+    return;
+  }
+
+  if (*count == *capacity) {
+    *capacity *= 2;
+    *objects = realloc(*objects, *capacity * sizeof(object *));
+
+    if (*objects == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  object_table_put(seen, obj, 1);
+  (*objects)[(*count)++] = obj;
+}
+
+/* Counts what the global environment, the symbol table and the
+ * dynamic state reach: what a collection would keep. */
+void write_heap_census(FILE *out) {
+  object_table *seen;
+  object **objects;
+  object *obj;
+  long counts[ALLOCATION_TYPES];
+  long bytes[ALLOCATION_TYPES];
+  long capacity;
+  long count;
+  long total;
+  long size;
+  long i;
+  long j;
+
+  memset(counts, 0, sizeof(counts));
+  memset(bytes, 0, sizeof(bytes));
+  seen = make_object_table();
+  count = 0;
+  capacity = 1024;
+  objects = malloc(capacity * sizeof(object *));
+
+  if (objects == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  census_visit(seen, &objects, &count, &capacity, S(the_global_environment));
+  census_visit(seen, &objects, &count, &capacity, S(symbol_table));
+  census_visit(seen, &objects, &count, &capacity, S(winders));
+  census_visit(seen, &objects, &count, &capacity, S(handlers));
+  census_visit(seen, &objects, &count, &capacity, S(command_line));
+
+  for (i = 0; i < count; i++) {
+    obj = objects[i];
+    size = sizeof(object);
+
+    switch (obj->type) {
+    case COMPOUND_PROC:
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.compound_proc.parameters);
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.compound_proc.body);
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.compound_proc.env);
+      break;
+    case CONTINUATION:
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.continuation.k->saved_winders);
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.continuation.k->saved_handlers);
+      break;
+    case ERROR_OBJECT:
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.error_object.message);
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.error_object.irritants);
+      break;
+    case FRAME:
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.frame.variables);
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.frame.enclosing);
+
+      for (j = 0; j < list_length(obj->data.frame.variables); j++) {
+        census_visit(seen, &objects, &count, &capacity,
+                     obj->data.frame.values[j]);
+      }
+
+      size += j * sizeof(object *);
+      break;
+    case INLINE_PROC:
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.inline_proc.cell);
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.inline_proc.primitive);
+      break;
+    case MACRO:
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.macro.literals);
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.macro.rules);
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.macro.transformer);
+      break;
+    case PAIR:
+      census_visit(seen, &objects, &count, &capacity, car(obj));
+      census_visit(seen, &objects, &count, &capacity, cdr(obj));
+      break;
+    case STRING:
+      size += strlen(obj->data.string.value) + 1;
+      break;
+    case SYMBOL:
+      census_visit(seen, &objects, &count, &capacity,
+                   obj->data.symbol.original);
+      size += strlen(obj->data.symbol.value) + 1;
+      break;
+    case VECTOR:
+      for (j = 0; j < obj->data.vector.length; j++) {
+        census_visit(seen, &objects, &count, &capacity,
+                     obj->data.vector.items[j]);
+      }
+
+      size += j * sizeof(object *);
+      break;
+    default:
+      break;
+    }
+
+    counts[obj->type]++;
+    bytes[obj->type] += size;
+  }
+
+  for (i = 0, total = 0; i < ALLOCATION_TYPES; i++) {
+    total += bytes[i];
+  }
+
+  fprintf(out, "\nlive: %ld objects, %ld bytes\n", count, total);
+  write_allocation_types(out, counts, bytes);
+  free(objects);
+  free_object_table(seen);
+}
+
+/* Writes what was allocated while tracking, by type and by site, then
+ * the census. */
+void write_allocation_report(FILE *out) {
+  object_table *names;
+  allocation_site **order;
+  long count;
+  long bytes;
+  long i;
+  long j;
+
+  for (i = 0, count = 0, bytes = 0; i < ALLOCATION_TYPES; i++) {
+    count += allocation_counts[i];
+    bytes += allocation_bytes[i];
+  }
+
+  fprintf(out, "allocated: %ld objects, %ld bytes\n", count, bytes);
+
+  if (count > 0) {
+    write_allocation_types(out, allocation_counts, allocation_bytes);
+    order = malloc(allocation_site_count * sizeof(allocation_site *));
+
+    if (order == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+
+    for (i = 0, j = 0; i < allocation_site_size; i++) {
+      if (allocation_sites[i].used) {
+        order[j++] = &allocation_sites[i];
+      }
+    }
+
+    qsort(order, j, sizeof(allocation_site *), compare_allocation_sites);
+    names = profile_names();
+    fprintf(out, "\n   objects       bytes  site\n");
+
+    for (i = 0; i < j && i < ALLOCATION_SITES_SHOWN; i++) {
+      fprintf(out, "%10ld  %10ld  ", order[i]->count, order[i]->bytes);
+      write_profile_name(out, order[i]->procedure, names);
+
+      if (order[i]->primitive != NULL) {
+        fprintf(out, " -> ");
+        write_profile_name(out, order[i]->primitive, names);
+      }
+
+      fprintf(out, "\n");
+    }
+
+    if (j > ALLOCATION_SITES_SHOWN) {
+      fprintf(out, "  (%ld more sites)\n", j - ALLOCATION_SITES_SHOWN);
+    }
+
+    free(order);
+    free_object_table(names);
+  }
+
+  write_heap_census(out);
+}
+
+/* (track-allocations flag) starts counting afresh, or stops. */
+object *proc_track_allocations(object *arguments) {
+  if (is_false(car(arguments))) {
+    stop_allocation_tracking();
+  } else {
+    start_allocation_tracking();
+  }
+
+  return S(ok_symbol);
+}
+
+/* (allocation-report [port]) */
+object *proc_allocation_report(object *arguments) {
+  FILE *out;
+
+  out = is_the_empty_list(arguments) ?
+    stdout :
+    car(arguments)->data.output_port.stream;
+
+  write_allocation_report(out);
+  flush_output(out, arguments);
+
+  return S(ok_symbol);
+}
+
+void write_allocation_report_at_exit(void) {
+  stop_allocation_tracking();
+  fflush(stdout);
+  write_allocation_report(stderr);
+}
+
+/* TRACING */
+
+/* While tracing, every profile frame eval pushes or pops, and every
+ * file loaded, leaves an event with a CLOCK_MONOTONIC time in a ring
+ * buffer.  Escapes end the frames they unwind, and a winder ends the
+ * loads they leave.  write_trace turns the
+ * buffer into Chrome trace-event JSON, naming procedures as the
+ * profiler does and dropping ends whose begins were overwritten.
+ * There is no collector, so there are no GC events. */
+
+#define TRACE_EVENTS_MAX (1L << 20)
+#define TRACE_DEFAULT_FILE "trace.json"
+
+typedef struct trace_event {
+  long time;
+  object *procedure;
+  char *label; /* the file, or "", for loads */
+  char phase;  /* B or E */
+} trace_event;
+
+trace_event *trace_events;
+long trace_next;
+long trace_total;
+long trace_start;
+char *trace_file;
+
+void record_trace_event(char phase, object *procedure, char *label) {
+  trace_event *event;
+
+  /* the trace, like the profiles, follows the main interpreter */
+  if (S(spawned)) {
+    return;
+  }
+
+  event = &trace_events[trace_next];
+  event->time = clock_jiffies(CLOCK_MONOTONIC);
+  event->procedure = procedure;
+  event->label = label;
+  event->phase = phase;
+  trace_next = (trace_next + 1) & (TRACE_EVENTS_MAX - 1);
+  trace_total++;
+}
+
+object *proc_trace_load_resume(object *arguments) {
+  if (tracing) {
+    record_trace_event('B', NULL, "");
+  }
+
+  return S(ok_symbol);
+}
+
+object *proc_trace_load_end(object *arguments) {
+  if (tracing) {
+    record_trace_event('E', NULL, "");
+  }
+
+  return S(ok_symbol);
+}
+
+/* Starts the span of a load, which a winder ends if the load is left
+ * by an escape or an error. */
+void begin_traced_load(char *filename) {
+  record_trace_event('B', NULL, filename);
+  S(winders) = cons(cons(make_primitive_proc(proc_trace_load_resume),
+                         make_primitive_proc(proc_trace_load_end)),
+                    S(winders));
+}
+
+void end_traced_load(void) {
+  S(winders) = cdr(S(winders));
+  proc_trace_load_end(the_empty_list);
+}
+
+void trace_unwind(profile_frame *to) {
+  profile_frame *frame;
+
+  for (frame = S(profile_stack); frame != NULL && frame != to;
+       frame = frame->caller) {
+    record_trace_event('E', frame->procedure, NULL);
+  }
+}
+
+void start_tracing(void) {
+  if (trace_events == NULL) {
+    trace_events = malloc(TRACE_EVENTS_MAX * sizeof(trace_event));
+
+    if (trace_events == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  trace_next = 0;
+  trace_total = 0;
+  trace_start = clock_jiffies(CLOCK_MONOTONIC);
+  tracing = 1;
+  update_profiling();
+}
+
+void stop_tracing(void) {
+  tracing = 0;
+  update_profiling();
+}
+
+void write_json_string(FILE *out, char *text) {
+  putc('"', out);
+
+  for (; *text != '\0'; text++) {
+    if (*text == '"' || *text == '\\') {
+      fprintf(out, "\\%c", *text);
+    } else if ((unsigned char)*text < ' ') {
+      fprintf(out, "\\u%04x", *text);
+    } else {
+      putc(*text, out);
+    }
+  }
+
+  putc('"', out);
+}
+
+/* The name write_profile_name gives procedure, as a JSON string. */
+void write_trace_name(FILE *out, object *procedure, object_table *names,
+                      object_table *cache) {
+  FILE *name_out;
+  char *name;
+  size_t size;
+
+  name = (char *)object_table_get(cache, procedure, 0);
+
+  if (name == NULL) {
+    name_out = open_memstream(&name, &size);
+
+    if (name_out == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+
+    write_profile_name(name_out, procedure, names);
+    fclose(name_out);
+    object_table_put(cache, procedure, (long)name);
+  }
+
+  write_json_string(out, name);
+}
+
+void write_trace(FILE *out) {
+  object_table *names;
+  object_table *cache;
+  trace_event *event;
+  long count;
+  long depth;
+  long time;
+  long i;
+  char *separator;
+
+  names = profile_names();
+  cache = make_object_table();
+  count = trace_total < TRACE_EVENTS_MAX ? trace_total : TRACE_EVENTS_MAX;
+  depth = 0;
+  separator = "";
+  fprintf(out, "{\"traceEvents\":[");
+
+  for (i = trace_total - count; i < trace_total; i++) {
+    event = &trace_events[i & (TRACE_EVENTS_MAX - 1)];
+
+    if (event->phase == 'E' && depth == 0) {
+      continue;
+    }
+
+    depth += event->phase == 'B' ? 1 : event->phase == 'E' ? -1 : 0;
+    time = event->time - trace_start;
+    fprintf(out, "%s\n{\"ph\":\"%c\",\"pid\":1,\"tid\":1,\"ts\":%ld.%03ld,"
+            "\"name\":",
+            separator, event->phase, time / 1000, time % 1000);
+
+    if (event->label != NULL && *event->label == '\0') {
+      fprintf(out, "\"load\"");
+    } else if (event->label != NULL) {
+      fprintf(out, "\"load\",\"args\":{\"file\":");
+      write_json_string(out, event->label);
+      fprintf(out, "}");
+    } else {
+      write_trace_name(out, event->procedure, names, cache);
+    }
+
+    fprintf(out, "}");
+    separator = ",";
+  }
+
+  /* end what is still running now */
+  time = clock_jiffies(CLOCK_MONOTONIC) - trace_start;
+
+  for (; depth > 0; depth--) {
+    fprintf(out, "%s\n{\"ph\":\"E\",\"pid\":1,\"tid\":1,"
+            "\"ts\":%ld.%03ld}",
+            separator, time / 1000, time % 1000);
+    separator = ",";
+  }
+
+  fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+  for (i = 0; i < cache->size; i++) {
+    if (cache->keys[i] != NULL) {
+      free((char *)cache->values[i]);
+    }
+  }
+
+  free_object_table(cache);
+  free_object_table(names);
+}
+
+char dump_trace(char *filename) {
+  FILE *out;
+
+  out = fopen(filename, "w");
+
+  if (out == NULL) {
+    return 0;
+  }
+
+  write_trace(out);
+  fclose(out);
+
+  return 1;
+}
+
+/* (trace-events flag) starts tracing into an empty buffer, or stops. */
+object *proc_trace_events(object *arguments) {
+  if (is_false(car(arguments))) {
+    stop_tracing();
+  } else {
+    start_tracing();
+  }
+
+  return S(ok_symbol);
+}
+
+/* (trace-dump [file]) */
+object *proc_trace_dump(object *arguments) {
+  if (trace_events == NULL) {
+    throw_error("trace-dump: nothing traced", NULL);
+  }
+
+  if (!dump_trace(is_the_empty_list(arguments) ?
+                  TRACE_DEFAULT_FILE :
+                  car(arguments)->data.string.value)) {
+    throw_error("could not open file", car(arguments));
+  }
+
+  return S(ok_symbol);
+}
+
+void write_trace_at_exit(void) {
+  stop_tracing();
+
+  if (!dump_trace(trace_file)) {
+    fprintf(stderr, "could not write trace \"%s\"\n", trace_file);
+  }
+}
+
+/* HEAP FILES */
+
+/* Heap images and compiled (fasl) files share one format: an array of
+ * objects whose pointer fields hold indices into that array, followed
+ * by the text of strings, symbols and primitive names. Singletons get
+ * negative indices so they resolve to the running interpreter's own.
+ * Reading maps the file privately and fixes the fields up in place, so
+ * no object is copied or allocated. An image holds the symbol table
+ * and the global environment; a fasl file holds the forms read from a
+ * source file, whose symbols are interned as the file is mapped. */
+
+#define IMAGE_MAGIC "BSIMAGE8"
+#define FASL_MAGIC "BSFASL08"
+
+typedef struct heap_header {
+  char magic[8];
+  long object_size;
+  long object_count;
+  long text_size;
+  long roots[2];
+  long source_size;
+  long source_mtime;
+  long source_mtime_nsec;
+  unsigned long source_hash;
+} heap_header;
+
+long heap_singleton(object *obj) {
+  if (obj == the_empty_list) {
+    return -1;
+  } else if (obj == the_empty_string) {
+    return -2;
+  } else if (obj == false) {
+    return -3;
+  } else if (obj == true) {
+    return -4;
+  } else if (obj == eof_object) {
+    return -5;
+  }
+
+  return 0;
+}
+
+object *heap_object(object **objects, long index) {
+  switch (index) {
+  case -1:
+    return the_empty_list;
+  case -2:
+    return the_empty_string;
+  case -3:
+    return false;
+  case -4:
+    return true;
+  case -5:
+    return eof_object;
+  }
+
+  return objects[index];
+}
+
+/* pointer fields are stored as longs of the same width */
+void set_heap_field(void *field, long value) {
+  memcpy(field, &value, sizeof(long));
+}
+
+long heap_field(void *field) {
+  long value;
+
+  memcpy(&value, field, sizeof(long));
+
+  return value;
+}
+
+typedef struct heap_writer {
+  char transfer; /* to another interpreter in this process */
+  object_table *shared; /* what the receiver has already, or NULL */
+  object_table *index;
+  object **objects;
+  long count;
+  long capacity;
+} heap_writer;
+
+void heap_visit(heap_writer *w, object *obj) {
+  if (heap_singleton(obj) != 0 ||
+      object_table_get(w->index, obj, -1) != -1 ||
+      (w->shared != NULL && object_table_get(w->shared, obj, -1) != -1)) {
+    return;
+  }
+
+  /* threads, mutexes and condition variables belong to one interpreter */
+  if (is_continuation(obj) || is_input_port(obj) || is_output_port(obj) ||
+      is_thread(obj) || is_mutex(obj) || is_condition_variable(obj) ||
+      (!w->transfer && (is_channel(obj) || is_isolate(obj)))) {
+    throw_error(w->transfer ? "cannot send object" : "cannot save object",
+                obj);
+  }
+
+  if (w->count == w->capacity) {
+    w->capacity *= 2;
+    w->objects = realloc(w->objects, w->capacity * sizeof(object *));
+
+    if (w->objects == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  object_table_put(w->index, obj, w->count);
+  w->objects[w->count++] = obj;
+}
+
+/* Objects the receiver has already are numbered after the written
+ * ones, by their index in the heap it has them in. */
+long heap_index(heap_writer *w, object *obj) {
+  long index;
+
+  index = heap_singleton(obj);
+
+  if (index != 0) {
+    return index;
+  }
+
+  index = object_table_get(w->index, obj, -1);
+
+  if (index == -1 && w->shared != NULL) {
+    index = w->count + object_table_get(w->shared, obj, -1);
+  }
+
+  return index;
+}
+
+long write_heap_text(FILE *out, char *text) {
+  fwrite(text, 1, strlen(text) + 1, out);
+
+  return strlen(text) + 1;
+}
+
+long heap_text_align(long offset) {
+  return (offset + sizeof(long) - 1) & ~(long)(sizeof(long) - 1);
+}
+
+/* Writes the objects reachable from header->roots, which hold object
+ * pointers on entry and are rewritten as indices.  A heap written for
+ * transfer may hold channels and isolates, which are shared by pointer
+ * and so only mean anything within this process.  Objects in shared,
+ * if it is not NULL, are referred to by their index there rather than
+ * written; unless written is NULL, it is given the written objects'
+ * indices, for later heaps to refer to. */
+void write_heap(FILE *out, heap_header *header, char transfer,
+                object_table *shared, object_table **written) {
+  heap_writer w;
+  object record;
+  object *obj;
+  long text_size;
+  long index;
+  long i;
+  long j;
+
+  w.transfer = transfer;
+  w.shared = shared;
+  w.index = make_object_table();
+  w.count = 0;
+  w.capacity = 1024;
+  w.objects = malloc(w.capacity * sizeof(object *));
+
+  if (w.objects == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  heap_visit(&w, (object *)header->roots[0]);
+  heap_visit(&w, (object *)header->roots[1]);
+
+  for (i = 0; i < w.count; i++) {
+    obj = w.objects[i];
+
+    switch (obj->type) {
+    case COMPOUND_PROC:
+      heap_visit(&w, obj->data.compound_proc.parameters);
+      heap_visit(&w, obj->data.compound_proc.body);
+      heap_visit(&w, obj->data.compound_proc.env);
+      break;
+    case ERROR_OBJECT:
+      heap_visit(&w, obj->data.error_object.message);
+      heap_visit(&w, obj->data.error_object.irritants);
+      break;
+    case FRAME:
+      heap_visit(&w, obj->data.frame.variables);
+      heap_visit(&w, obj->data.frame.enclosing);
+
+      for (j = 0; j < list_length(obj->data.frame.variables); j++) {
+        heap_visit(&w, obj->data.frame.values[j]);
+      }
+      break;
+    case INLINE_PROC:
+      heap_visit(&w, obj->data.inline_proc.cell);
+      heap_visit(&w, obj->data.inline_proc.primitive);
+      break;
+    case MACRO:
+      heap_visit(&w, obj->data.macro.literals);
+      heap_visit(&w, obj->data.macro.rules);
+      heap_visit(&w, obj->data.macro.transformer);
+      break;
+    case PAIR:
+      heap_visit(&w, car(obj));
+      heap_visit(&w, cdr(obj));
+      break;
+    case SYMBOL:
+      heap_visit(&w, obj->data.symbol.original);
+      break;
+    case VECTOR:
+      for (j = 0; j < obj->data.vector.length; j++) {
+        heap_visit(&w, obj->data.vector.items[j]);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  header->object_size = sizeof(object);
+  header->object_count = w.count;
+  header->roots[0] = heap_index(&w, (object *)header->roots[0]);
+  header->roots[1] = heap_index(&w, (object *)header->roots[1]);
+  fwrite(header, sizeof(heap_header), 1, out);
+
+  text_size = 0;
+
+  for (i = 0; i < w.count; i++) {
+    obj = w.objects[i];
+    memset(&record, 0, sizeof(record));
+    record.type = obj->type;
+
+    switch (obj->type) {
+    case COMPOUND_PROC:
+      set_heap_field(&record.data.compound_proc.parameters,
+                     heap_index(&w, obj->data.compound_proc.parameters));
+      set_heap_field(&record.data.compound_proc.body,
+                     heap_index(&w, obj->data.compound_proc.body));
+      set_heap_field(&record.data.compound_proc.env,
+                     heap_index(&w, obj->data.compound_proc.env));
+      break;
+    case ERROR_OBJECT:
+      set_heap_field(&record.data.error_object.message,
+                     heap_index(&w, obj->data.error_object.message));
+      set_heap_field(&record.data.error_object.irritants,
+                     heap_index(&w, obj->data.error_object.irritants));
+      break;
+    case FRAME:
+      text_size = heap_text_align(text_size);
+      set_heap_field(&record.data.frame.variables,
+                     heap_index(&w, obj->data.frame.variables));
+      set_heap_field(&record.data.frame.values, text_size);
+      set_heap_field(&record.data.frame.enclosing,
+                     heap_index(&w, obj->data.frame.enclosing));
+      text_size += (list_length(obj->data.frame.variables) + 1) *
+        sizeof(long);
+      break;
+    case INLINE_PROC:
+      record.data.inline_proc.opcode = obj->data.inline_proc.opcode;
+      set_heap_field(&record.data.inline_proc.cell,
+                     heap_index(&w, obj->data.inline_proc.cell));
+      set_heap_field(&record.data.inline_proc.primitive,
+                     heap_index(&w, obj->data.inline_proc.primitive));
+      break;
+    case PAIR:
+      set_heap_field(&record.data.pair.car, heap_index(&w, car(obj)));
+      set_heap_field(&record.data.pair.cdr, heap_index(&w, cdr(obj)));
+      break;
+    case PRIMITIVE_PROC:
+      set_heap_field(&record.data.primitive_proc.fn, text_size);
+      text_size += strlen(primitive_name(obj->data.primitive_proc.fn)) + 1;
+      break;
+    case STRING:
+      set_heap_field(&record.data.string.value, text_size);
+      text_size += strlen(obj->data.string.value) + 1;
+      break;
+    case MACRO:
+      set_heap_field(&record.data.macro.literals,
+                     heap_index(&w, obj->data.macro.literals));
+      set_heap_field(&record.data.macro.rules,
+                     heap_index(&w, obj->data.macro.rules));
+      set_heap_field(&record.data.macro.transformer,
+                     heap_index(&w, obj->data.macro.transformer));
+      break;
+    case SYMBOL:
+      set_heap_field(&record.data.symbol.value, text_size);
+      set_heap_field(&record.data.symbol.original,
+                     heap_index(&w, obj->data.symbol.original));
+      text_size += strlen(obj->data.symbol.value) + 1;
+      break;
+    case VECTOR:
+      text_size = heap_text_align(text_size);
+      record.data.vector.length = obj->data.vector.length;
+      set_heap_field(&record.data.vector.items, text_size);
+      text_size += obj->data.vector.length * sizeof(long);
+      break;
+    default:
+      record.data = obj->data;
+    }
+
+    fwrite(&record, sizeof(record), 1, out);
+  }
+
+  header->text_size = text_size;
+  text_size = 0;
+
+  for (i = 0; i < w.count; i++) {
+    obj = w.objects[i];
+
+    switch (obj->type) {
+    case FRAME:
+      /* the value count, then the value indices */
+      while (text_size != heap_text_align(text_size)) {
+        putc(0, out);
+        text_size++;
+      }
+
+      index = list_length(obj->data.frame.variables);
+      fwrite(&index, sizeof(long), 1, out);
+      text_size += sizeof(long);
+
+      for (j = 0; j < list_length(obj->data.frame.variables); j++) {
+        index = heap_index(&w, obj->data.frame.values[j]);
+        fwrite(&index, sizeof(long), 1, out);
+        text_size += sizeof(long);
+      }
+      break;
+    case PRIMITIVE_PROC:
+      text_size += write_heap_text(out,
+                                   primitive_name(obj->data.primitive_proc.fn));
+      break;
+    case STRING:
+      text_size += write_heap_text(out, obj->data.string.value);
+      break;
+    case SYMBOL:
+      text_size += write_heap_text(out, obj->data.symbol.value);
+      break;
+    case VECTOR:
+      /* item indices, aligned so they can be fixed up in place */
+      while (text_size != heap_text_align(text_size)) {
+        putc(0, out);
+        text_size++;
+      }
+
+      for (j = 0; j < obj->data.vector.length; j++) {
+        index = heap_index(&w, obj->data.vector.items[j]);
+        fwrite(&index, sizeof(long), 1, out);
+      }
+
+      text_size += obj->data.vector.length * sizeof(long);
+      break;
+    default:
+      break;
+    }
+  }
+
+  /* the text size is known now; a transfer's memory stream would be
+   * truncated by seeking back, so transfer_heap patches it instead */
+  if (!transfer) {
+    rewind(out);
+    fwrite(header, sizeof(heap_header), 1, out);
+  }
+
+  free(w.objects);
+
+  if (written != NULL) {
+    *written = w.index;
+  } else {
+    free_object_table(w.index);
+  }
+}
+
+/* Fixes up in place the objects of a heap laid out from base as
+ * write_heap wrote it, rewriting the roots in header as object
+ * pointers.  With intern set, symbols resolve to the interned ones.
+ * Unless shared is NULL, it is the heap, fixed up already, that the
+ * written objects may refer into. */
+void fix_heap(char *base, heap_header *header, char intern, char *shared) {
+  heap_header shared_header;
+  object **resolved;
+  object *objects;
+  object *obj;
+  char *text;
+  char *values;
+  long i;
+  long j;
+
+  objects = (object *)(base + sizeof(heap_header));
+  text = (char *)(objects + header->object_count);
+  shared_header.object_count = 0;
+
+  if (shared != NULL) {
+    memcpy(&shared_header, shared, sizeof(heap_header));
+  }
+
+  resolved = malloc((header->object_count + shared_header.object_count +
+                     1) * sizeof(object *));
+
+  if (resolved == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  for (i = 0; i < shared_header.object_count; i++) {
+    resolved[header->object_count + i] =
+      (object *)(shared + sizeof(heap_header)) + i;
+  }
+
+  for (i = 0; i < header->object_count; i++) {
+    obj = objects + i;
+
+    if (obj->type == SYMBOL) {
+      obj->data.symbol.value = text + heap_field(&obj->data.symbol.value);
+      resolved[i] = intern ? make_symbol(obj->data.symbol.value) : obj;
+    } else {
+      resolved[i] = obj;
+    }
+  }
+
+  for (i = 0; i < header->object_count; i++) {
+    obj = objects + i;
+
+    switch (obj->type) {
+    case COMPOUND_PROC:
+      obj->data.compound_proc.parameters =
+        heap_object(resolved, heap_field(&obj->data.compound_proc.parameters));
+      obj->data.compound_proc.body =
+        heap_object(resolved, heap_field(&obj->data.compound_proc.body));
+      obj->data.compound_proc.env =
+        heap_object(resolved, heap_field(&obj->data.compound_proc.env));
+      break;
+    case ERROR_OBJECT:
+      obj->data.error_object.message =
+        heap_object(resolved, heap_field(&obj->data.error_object.message));
+      obj->data.error_object.irritants =
+        heap_object(resolved, heap_field(&obj->data.error_object.irritants));
+      break;
+    case FRAME:
+      obj->data.frame.variables =
+        heap_object(resolved, heap_field(&obj->data.frame.variables));
+      obj->data.frame.enclosing =
+        heap_object(resolved, heap_field(&obj->data.frame.enclosing));
+      values = text + heap_field(&obj->data.frame.values);
+      obj->data.frame.values = (object **)(values + sizeof(long));
+
+      for (j = 0; j < heap_field(values); j++) {
+        obj->data.frame.values[j] =
+          heap_object(resolved, heap_field(&obj->data.frame.values[j]));
+      }
+
+      break;
+    case INLINE_PROC:
+      obj->data.inline_proc.cell =
+        heap_object(resolved, heap_field(&obj->data.inline_proc.cell));
+      obj->data.inline_proc.primitive =
+        heap_object(resolved, heap_field(&obj->data.inline_proc.primitive));
+      break;
+    case MACRO:
+      obj->data.macro.literals =
+        heap_object(resolved, heap_field(&obj->data.macro.literals));
+      obj->data.macro.rules =
+        heap_object(resolved, heap_field(&obj->data.macro.rules));
+      obj->data.macro.transformer =
+        heap_object(resolved, heap_field(&obj->data.macro.transformer));
+      break;
+    case PAIR:
+      obj->data.pair.car =
+        heap_object(resolved, heap_field(&obj->data.pair.car));
+      obj->data.pair.cdr =
+        heap_object(resolved, heap_field(&obj->data.pair.cdr));
+      break;
+    case PRIMITIVE_PROC:
+      obj->data.primitive_proc.fn =
+        primitive_named(text + heap_field(&obj->data.primitive_proc.fn));
+
+      if (obj->data.primitive_proc.fn == NULL) {
+        fprintf(stderr, "heap file uses an unknown primitive \"%s\"\n",
+                text + heap_field(&obj->data.primitive_proc.fn));
+        exit(1);
+      }
+
+      break;
+    case STRING:
+      obj->data.string.value = text + heap_field(&obj->data.string.value);
+      break;
+    case SYMBOL:
+      obj->data.symbol.original =
+        heap_object(resolved, heap_field(&obj->data.symbol.original));
+      break;
+    case VECTOR:
+      obj->data.vector.items =
+        (object **)(text + heap_field(&obj->data.vector.items));
+
+      for (j = 0; j < obj->data.vector.length; j++) {
+        obj->data.vector.items[j] =
+          heap_object(resolved, heap_field(&obj->data.vector.items[j]));
+      }
+
+      break;
+    default:
+      break;
+    }
+  }
+
+  header->roots[0] = (long)heap_object(resolved, header->roots[0]);
+  header->roots[1] = (long)heap_object(resolved, header->roots[1]);
+
+  free(resolved);
+}
+
+
+/* Maps a heap file whose header has already been read and checked
+ * against the file size, and fixes it up. Returns 0 if the file could
+ * not be used. */
+int map_heap(FILE *in, heap_header *header, char intern) {
+  char *base;
+  long size;
+
+  size = sizeof(heap_header) +
+    header->object_count * sizeof(object) + header->text_size;
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+              fileno(in), 0);
+
+  if (base == MAP_FAILED) {
+    return 0;
+  }
+
+  fix_heap(base, header, intern, NULL);
+
+  return 1;
+}
+
+/* Reads and checks a header, leaving the file positioned after it. */
+int read_heap_header(FILE *in, char *magic, heap_header *header) {
+  struct stat st;
+
+  return fstat(fileno(in), &st) == 0 &&
+    fread(header, sizeof(heap_header), 1, in) == 1 &&
+    memcmp(header->magic, magic, sizeof(header->magic)) == 0 &&
+    header->object_size == sizeof(object) &&
+    st.st_size == sizeof(heap_header) +
+    header->object_count * sizeof(object) + header->text_size;
+}
+
+void save_image(char *filename) {
+  heap_header header;
+  FILE *out;
+
+  out = fopen(filename, "wb");
+
+  if (out == NULL) {
+    throw_error("could not open file", make_string(filename));
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.roots[0] = (long)S(symbol_table);
+  header.roots[1] = (long)S(the_global_environment);
+
+  write_heap(out, &header, 0, NULL, NULL);
+  fclose(out);
+}
+
+void load_image(char *filename) {
+  heap_header header;
+  FILE *in;
+
+  in = fopen(filename, "rb");
+
+  if (in == NULL) {
+    fprintf(stderr, "could not open image \"%s\"\n", filename);
+    exit(1);
+  }
+
+  if (!read_heap_header(in, IMAGE_MAGIC, &header) ||
+      !map_heap(in, &header, 0)) {
+    fprintf(stderr, "\"%s\" is not an image for this build\n", filename);
+    exit(1);
+  }
+
+  fclose(in);
+
+  S(symbol_table) = (object *)header.roots[0];
+  S(the_global_environment) = (object *)header.roots[1];
+
+  index_symbol_table();
+  init_symbols();
+}
+
+/* FNV-1a over the source text */
+unsigned long hash_stream(FILE *in) {
+  unsigned long hash;
+  int c;
+
+  hash = 14695981039346656037UL;
+
+  while ((c = getc(in)) != EOF) {
+    hash = (hash ^ (unsigned char)c) * 1099511628211UL;
+  }
+
+  rewind(in);
+
+  return hash;
+}
+
+char *fasl_filename(char *filename) {
+  char *fasl;
+  size_t length;
+
+  length = strlen(filename);
+
+  if (length > 4 && strcmp(filename + length - 4, ".scm") == 0) {
+    length -= 4;
+  }
+
+  fasl = malloc(length + 6);
+
+  if (fasl == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  memcpy(fasl, filename, length);
+  strcpy(fasl + length, ".fasl");
+
+  return fasl;
+}
+
+/* A source changed within a second of its cache being written could
+ * change again without its mtime moving, so such a cache stores no
+ * mtime and the next load hashes the source. */
+int is_racy_mtime(heap_header *stamp) {
+  return stamp->source_mtime >= (long)time(NULL) - 1;
+}
+
+/* Returns the forms cached for source in, or NULL if the cache is
+ * missing or stale. A matching size and mtime, to the nanosecond, are
+ * trusted; otherwise the source is hashed, so touching a file does not
+ * invalidate it. *refresh is set if the cache is good but should be
+ * rewritten with the source's new mtime. Where the forms start in the
+ * source is stored into starts. */
+object *read_fasl(char *fasl, FILE *in, heap_header *stamp,
+                  object **starts, char *refresh) {
+  heap_header header;
+  FILE *cache;
+  object *forms;
+  char fresh;
+
+  cache = fopen(fasl, "rb");
+
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  forms = NULL;
+
+  if (read_heap_header(cache, FASL_MAGIC, &header) &&
+      header.source_size == stamp->source_size) {
+    fresh = header.source_mtime == stamp->source_mtime &&
+      header.source_mtime_nsec == stamp->source_mtime_nsec;
+
+    if ((fresh ||
+         header.source_hash == (stamp->source_hash = hash_stream(in))) &&
+        map_heap(cache, &header, 1)) {
+      forms = (object *)header.roots[0];
+      *starts = (object *)header.roots[1];
+      *refresh = !fresh && !is_racy_mtime(stamp);
+    }
+  }
+
+  fclose(cache);
+
+  return forms;
+}
+
+/* Writes the cache beside it and renames it into place, so a process
+ * mapping the old cache never sees a half-written one. */
+void write_fasl(char *fasl, FILE *in, heap_header *stamp, object *forms,
+                object *starts) {
+  heap_header header;
+  FILE *out;
+  char *temporary;
+  int fd;
+
+  temporary = malloc(strlen(fasl) + 8);
+
+  if (temporary == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  strcpy(temporary, fasl);
+  strcat(temporary, ".XXXXXX");
+  fd = mkstemp(temporary);
+
+  /* a read-only directory just means no caching */
+  if (fd < 0 || (out = fdopen(fd, "wb")) == NULL) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(temporary);
+    }
+
+    free(temporary);
+
+    return;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FASL_MAGIC, sizeof(header.magic));
+  header.roots[0] = (long)forms;
+  header.roots[1] = (long)starts;
+  header.source_size = stamp->source_size;
+
+  if (is_racy_mtime(stamp)) {
+    header.source_mtime = -1;
+  } else {
+    header.source_mtime = stamp->source_mtime;
+    header.source_mtime_nsec = stamp->source_mtime_nsec;
+  }
+
+  header.source_hash = stamp->source_hash != 0 ?
+    stamp->source_hash :
+    hash_stream(in);
+
+  write_heap(out, &header, 0, NULL, NULL);
+
+  if (fclose(out) != 0 || rename(temporary, fasl) != 0) {
+    unlink(temporary);
+  }
+
+  free(temporary);
+}
+
+/* Reads every form in the source file, going through its fasl cache. */
+object *read_source_file(char *filename, FILE *in) {
+  heap_header stamp;
+  struct stat st;
+  object *forms;
+  object *starts;
+  object *tail;
+  object *start_tail;
+  object *exp;
+  char *fasl;
+  char refresh;
+  long start;
+  long file;
+
+  memset(&stamp, 0, sizeof(stamp));
+
+  if (fstat(fileno(in), &st) == 0) {
+    stamp.source_size = st.st_size;
+    stamp.source_mtime = st.st_mtim.tv_sec;
+    stamp.source_mtime_nsec = st.st_mtim.tv_nsec;
+  }
+
+  fasl = fasl_filename(filename);
+  starts = the_empty_list;
+  refresh = 0;
+  forms = read_fasl(fasl, in, &stamp, &starts, &refresh);
+
+  if (refresh) {
+    write_fasl(fasl, in, &stamp, forms, starts);
+  } else if (forms == NULL) {
+    forms = cons(the_empty_list, the_empty_list);
+    starts = cons(the_empty_list, the_empty_list);
+    tail = forms;
+    start_tail = starts;
+
+    while ((start = ftell(in), exp = read_object(in)) != NULL) {
+      set_cdr(tail, cons(exp, the_empty_list));
+      tail = cdr(tail);
+      set_cdr(start_tail, cons(make_fixnum(start), the_empty_list));
+      start_tail = cdr(start_tail);
+    }
+
+    forms = cdr(forms);
+    starts = cdr(starts);
+    rewind(in);
+    write_fasl(fasl, in, &stamp, forms, starts);
+  }
+
+  free(fasl);
+  file = source_file_number(filename);
+
+  for (tail = forms; is_pair(tail) && is_pair(starts);
+       tail = cdr(tail), starts = cdr(starts)) {
+    note_source_form(car(tail), file, car(starts)->data.fixnum.value);
+  }
+
+  return forms;
+}
+
+/* EMBEDDING */
+
+/* The API in scheme.h.  Each call makes its context the running one
+ * for as long as it runs, so an interpreter may call into another.
+ * exit within scheme_eval_string returns from it, as an error does,
+ * rather than ending the host. */
+
+scheme_context *make_context(void) {
+  scheme_context *context;
+
+  context = calloc(1, sizeof(scheme_context));
+
+  if (context == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  return context;
+}
+
+scheme_context *scheme_new(void) {
+  scheme_context *previous;
+  scheme_context *context;
+  char stack_bottom;
+
+  previous = scheme;
+  context = make_context();
+  scheme = context;
+  S(stack_base) = &stack_bottom;
+  init();
+  scheme = previous;
+
+  return context;
+}
+
+char *scheme_eval_string(scheme_context *context, char *str) {
+  scheme_context *previous;
+  continuation *outer;
+  object *result;
+  FILE *in;
+  FILE *out;
+  char *text;
+  size_t size;
+  char stack_bottom;
+
+  previous = scheme;
+  scheme = context;
+
+  /* continuations only reach as far up the stack as this call */
+  if (S(live_continuations) == NULL) {
+    S(stack_base) = &stack_bottom;
+  }
+
+  in = fmemopen(str, strlen(str), "r");
+  text = NULL;
+  S(exit_status) = -1;
+
+  if (in != NULL) {
+    outer = S(top_level);
+    S(top_level) = push_continuation(1);
+    S(exit_point) = S(top_level);
+
+    if (setjmp(S(top_level)->jmp) == 0) {
+      result = load_stream(in);
+      out = open_memstream(&text, &size);
+
+      if (out != NULL) {
+        write_object(out, result);
+        fclose(out);
+      }
+    }
+
+    release_continuation(S(top_level));
+    S(top_level) = outer;
+    S(exit_point) = NULL;
+    fclose(in);
+  }
+
+  scheme = previous;
+
+  return text;
+}
+
+int scheme_exit_status(scheme_context *context) {
+  return context->exit_status;
+}
+
+void scheme_destroy(scheme_context *context) {
+  scheme_context *previous;
+
+  previous = scheme == context ? NULL : scheme;
+  scheme = context;
+  free(S(symbol_index));
+  free_object_table(S(expansions));
+  free_object_table(S(alias_scopes));
+  free(S(pool_snapshot));
+
+  if (S(pool_shared) != NULL) {
+    free_object_table(S(pool_shared));
+  }
+
+  if (S(source_locations) != NULL) {
+    free_object_table(S(source_locations));
+  }
+
+  if (S(source_origins) != NULL) {
+    free_object_table(S(source_origins));
+  }
+
+  free(S(source_forms));
+  free_arena(S(arena));
+  free(context);
+  scheme = previous;
+}
+
+/* ISOLATES */
+
+/* An isolate is an interpreter of its own, with its own context, run
+ * by (spawn thunk) on a thread of its own.  Interpreters share no
+ * objects: the thunk, with the symbols and the global environment it
+ * sees, is copied into the new one, and channels copy every message.
+ * A copy is a heap written for transfer by write_heap into memory and
+ * fixed up in place by its receiver, which then owns it.  Channels
+ * and isolates themselves are shared by pointer, so they can be sent.
+ *
+ * A channel is a lock-free queue of messages with many senders (after
+ * Vyukov's intrusive MPSC queue).  Receivers take turns through a
+ * mutex, which is also what one waits on while the queue is empty. */
+
+typedef struct message {
+  struct message *next;
+  char *heap;
+} message;
+
+typedef struct channel {
+  message *head; /* the newest message, where senders push */
+  message *tail; /* the oldest, where receivers pop */
+  message stub;
+  int waiting; /* receivers asleep on ready */
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+} channel;
+
+typedef struct isolate {
+  char *heap; /* the symbols, environment and thunk to start from */
+  char *result; /* the thunk's value, or NULL if it failed */
+  int done;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+} isolate;
+
+/* Copies the objects reachable from first and second into a heap in
+ * memory for another interpreter in this process to take.  Those in
+ * shared, the written indices of a heap it has taken already, are
+ * referred to instead; see write_heap. */
+char *transfer_heap_sharing(object *first, object *second,
+                            object_table *shared, object_table **written) {
+  heap_header header;
+  FILE *out;
+  char *heap;
+  size_t size;
+
+  out = open_memstream(&heap, &size);
+
+  if (out == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.roots[0] = (long)first;
+  header.roots[1] = (long)second;
+  write_heap(out, &header, 1, shared, written);
+  fclose(out);
+  memcpy(heap, &header, sizeof(header));
+
+  return heap;
+}
+
+char *transfer_heap(object *first, object *second) {
+  return transfer_heap_sharing(first, second, NULL, NULL);
+}
+
+/* Fixes up a heap from transfer_heap in the running interpreter and
+ * returns its header, whose roots are now objects. */
+heap_header take_heap(char *heap, char intern) {
+  heap_header header;
+
+  memcpy(&header, heap, sizeof(header));
+  fix_heap(heap, &header, intern, NULL);
+
+  return header;
+}
+
+/* Takes a heap from transfer_heap_sharing, whose shared objects are
+ * in shared, a heap taken already. */
+heap_header take_heap_sharing(char *heap, char *shared) {
+  heap_header header;
+
+  memcpy(&header, heap, sizeof(header));
+  fix_heap(heap, &header, 1, shared);
+
+  return header;
+}
+
+/* Returns a copy of a heap from transfer_heap, to take it again. */
+char *copy_heap(char *heap) {
+  heap_header header;
+  char *copy;
+  long size;
+
+  memcpy(&header, heap, sizeof(header));
+  size = sizeof(heap_header) +
+    header.object_count * sizeof(object) + header.text_size;
+  copy = malloc(size);
+
+  if (copy == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  memcpy(copy, heap, size);
+
+  return copy;
+}
+
+/* A snapshot is obj with the symbol table and global environment it
+ * runs in, copied for a new interpreter to start from. */
+char *snapshot_heap(object *obj) {
+  return transfer_heap(S(symbol_table), cons(S(the_global_environment), obj));
+}
+
+/* Makes a snapshot's symbols and environment the running
+ * interpreter's, and returns its object. */
+object *take_snapshot(char *heap) {
+  heap_header header;
+
+  header = take_heap(heap, 0);
+  S(symbol_table) = (object *)header.roots[0];
+  index_symbol_table();
+  init_symbols();
+  S(the_global_environment) = car((object *)header.roots[1]);
+
+  return cdr((object *)header.roots[1]);
+}
+
+void push_message(channel *ch, message *m) {
+  message *previous;
+
+  m->next = NULL;
+  previous = __atomic_exchange_n(&ch->head, m, __ATOMIC_SEQ_CST);
+  /* until this store m is unreachable from the tail */
+  __atomic_store_n(&previous->next, m, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the oldest message, or NULL if there is none yet (or one is
+ * still being pushed, which its sender will signal). */
+message *pop_message(channel *ch) {
+  message *tail;
+  message *next;
+
+  tail = ch->tail;
+  next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+
+  if (tail == &ch->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+
+    ch->tail = next;
+    tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+  }
+
+  if (next != NULL) {
+    ch->tail = next;
+
+    return tail;
+  }
+
+  if (tail != __atomic_load_n(&ch->head, __ATOMIC_SEQ_CST)) {
+    return NULL;
+  }
+
+  /* tail is the only message: put the stub behind it to take it */
+  push_message(ch, &ch->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+
+  if (next != NULL) {
+    ch->tail = next;
+
+    return tail;
+  }
+
+  return NULL;
+}
+
+object *make_channel(channel *ch) {
+  object *obj;
+
+  obj = alloc_object(CHANNEL);
+  obj->data.channel.channel = ch;
+
+  return obj;
+}
+
+object *proc_make_channel(object *arguments) {
+  channel *ch;
+
+  ch = malloc(sizeof(channel));
+
+  if (ch == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  ch->stub.next = NULL;
+  ch->head = &ch->stub;
+  ch->tail = &ch->stub;
+  ch->waiting = 0;
+  pthread_mutex_init(&ch->lock, NULL);
+  pthread_cond_init(&ch->ready, NULL);
+
+  return make_channel(ch);
+}
+
+channel *channel_argument(object *arguments, char *error) {
+  if (!is_channel(car(arguments))) {
+    throw_error(error, car(arguments));
+  }
+
+  return car(arguments)->data.channel.channel;
+}
+
+object *proc_channel_send(object *arguments) {
+  message *m;
+  channel *ch;
+
+  ch = channel_argument(arguments, "channel-send: not a channel");
+  m = malloc(sizeof(message));
+
+  if (m == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  m->heap = transfer_heap(cadr(arguments), the_empty_list);
+  push_message(ch, m);
+
+  if (__atomic_load_n(&ch->waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&ch->lock);
+    pthread_cond_broadcast(&ch->ready);
+    pthread_mutex_unlock(&ch->lock);
+  }
+
+  return S(ok_symbol);
+}
+
+object *proc_channel_receive(object *arguments) {
+  message *m;
+  channel *ch;
+  char *heap;
+
+  ch = channel_argument(arguments, "channel-receive: not a channel");
+  pthread_mutex_lock(&ch->lock);
+
+  /* a sender looks at waiting after pushing, so either it wakes this
+   * receiver or the pop finds its message */
+  __atomic_add_fetch(&ch->waiting, 1, __ATOMIC_SEQ_CST);
+
+  while ((m = pop_message(ch)) == NULL) {
+    pthread_cond_wait(&ch->ready, &ch->lock);
+  }
+
+  __atomic_sub_fetch(&ch->waiting, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&ch->lock);
+  heap = m->heap;
+  free(m);
+
+  return (object *)take_heap(heap, 1).roots[0];
+}
+
+void *run_isolate(void *argument) {
+  isolate *child;
+  object *thunk;
+  object *result;
+  char stack_bottom;
+
+  child = argument;
+  scheme = make_context();
+  S(stack_base) = &stack_bottom;
+  S(spawned) = 1;
+  init_model();
+  thunk = take_snapshot(child->heap);
+
+  /* an error nothing handles is reported, and ends the isolate */
+  S(top_level) = push_continuation(1);
+
+  if (setjmp(S(top_level)->jmp) == 0) {
+    result = apply_procedure(thunk, the_empty_list);
+    child->result = transfer_heap(result, the_empty_list);
+  }
+
+  pthread_mutex_lock(&child->lock);
+  child->done = 1;
+  pthread_cond_broadcast(&child->finished);
+  pthread_mutex_unlock(&child->lock);
+
+  return NULL;
+}
+
+object *make_isolate(isolate *child) {
+  object *obj;
+
+  obj = alloc_object(ISOLATE);
+  obj->data.isolate.isolate = child;
+
+  return obj;
+}
+
+/* Starts a detached thread running run(argument), with the
+ * profiler's signal, which is for the main interpreter only, blocked.
+ * Returns 0 if it could not. */
+int start_thread(void *(*run)(void *), void *argument) {
+  pthread_t thread;
+  sigset_t blocked;
+  sigset_t mask;
+  int started;
+
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &blocked, &mask);
+  started = pthread_create(&thread, NULL, run, argument) == 0;
+  pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+  if (started) {
+    pthread_detach(thread);
+  }
+
+  return started;
+}
+
+object *proc_spawn(object *arguments) {
+  isolate *child;
+
+  child = malloc(sizeof(isolate));
+
+  if (child == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  child->heap = snapshot_heap(car(arguments));
+  child->result = NULL;
+  child->done = 0;
+  pthread_mutex_init(&child->lock, NULL);
+  pthread_cond_init(&child->finished, NULL);
+
+  if (!start_thread(run_isolate, child)) {
+    throw_error("spawn: could not start a thread", NULL);
+  }
+
+  return make_isolate(child);
+}
+
+object *proc_isolate_join(object *arguments) {
+  isolate *child;
+
+  if (!is_isolate(car(arguments))) {
+    throw_error("isolate-join: not an isolate", car(arguments));
+  }
+
+  child = car(arguments)->data.isolate.isolate;
+  pthread_mutex_lock(&child->lock);
+
+  while (!child->done) {
+    pthread_cond_wait(&child->finished, &child->lock);
+  }
+
+  pthread_mutex_unlock(&child->lock);
+
+  if (child->result == NULL) {
+    throw_error("isolate-join: the isolate failed", car(arguments));
+  }
+
+  /* the result can be joined more than once, so take a copy of it */
+  return (object *)take_heap(copy_heap(child->result), 1).roots[0];
+}
+
+/* PARALLEL */
+
+/* parallel-map and parallel-for-each deal chunks of their input out
+ * to a pool of worker threads, one per core, started on first use.
+ * A worker is an interpreter like an isolate's, started from a
+ * snapshot of the caller's symbols and global environment.  The
+ * caller keeps its snapshot until a definition or mutation may have
+ * changed what it holds, and a worker keeps its copy until then too,
+ * so a call copies in only its procedure, referring into the
+ * snapshot for what is there.  Each chunk's items and results are
+ * copied in and out, so workers never share objects.  A worker frees
+ * a chunk's items when done with it, and its copy of the procedure
+ * with the next call, and takes a fresh copy of the snapshot if it
+ * has changed its own.  Each worker has a deque of chunks; it takes
+ * from the back of its own and, when that is empty, steals from the
+ * front of another's. */
+
+#define CHUNKS_PER_WORKER 4
+
+typedef struct parallel_job {
+  long id;
+  long snapshot_id;
+  char *snapshot; /* the symbols and environment */
+  char *procedure; /* referring into the snapshot */
+  char **items; /* each chunk's items, as a heap */
+  char **results; /* each chunk's results, or what it raised */
+  char *failed; /* 1 if the chunk raised, 2 if that was not sendable */
+  char keep; /* whether the results are wanted */
+  long remaining;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} parallel_job;
+
+typedef struct parallel_task {
+  parallel_job *job;
+  long chunk;
+} parallel_task;
+
+typedef struct work_deque {
+  parallel_task *tasks; /* a ring from front to back */
+  long capacity;
+  long front;
+  long count;
+  pthread_mutex_t lock;
+} work_deque;
+
+work_deque *work_deques;
+long worker_count;
+long queued_tasks; /* not yet claimed by a worker */
+long job_count;
+long snapshot_count;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+
+void push_task(work_deque *deque, parallel_task task) {
+  parallel_task *tasks;
+  long i;
+
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->count == deque->capacity) {
+    tasks = malloc(2 * deque->capacity * sizeof(parallel_task));
+
+    if (tasks == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+
+    for (i = 0; i < deque->count; i++) {
+      tasks[i] = deque->tasks[(deque->front + i) % deque->capacity];
+    }
+
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->front = 0;
+    deque->capacity *= 2;
+  }
+
+  deque->tasks[(deque->front + deque->count) % deque->capacity] = task;
+  deque->count++;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+/* Takes a task from the back of the deque, or with steal set from its
+ * front.  Returns 0 if the deque is empty. */
+int take_task(work_deque *deque, char steal, parallel_task *task) {
+  int found;
+
+  pthread_mutex_lock(&deque->lock);
+  found = deque->count > 0;
+
+  if (found && steal) {
+    *task = deque->tasks[deque->front];
+    deque->front = (deque->front + 1) % deque->capacity;
+    deque->count--;
+  } else if (found) {
+    deque->count--;
+    *task = deque->tasks[(deque->front + deque->count) % deque->capacity];
+  }
+
+  pthread_mutex_unlock(&deque->lock);
+
+  return found;
+}
+
+/* Applies the job's procedure to each item of the task's chunk, and
+ * leaves the results, or whatever was raised, in the job. */
+void run_task(parallel_task *task, object *procedure) {
+  parallel_job *job;
+  continuation *k;
+  object *items;
+  object *results;
+  long i;
+
+  job = task->job;
+  job->results[task->chunk] = NULL;
+  job->failed[task->chunk] = 1;
+
+  /* an error that cannot be sent back is reported, and lands here too */
+  k = push_continuation(1);
+  S(top_level) = k;
+
+  if (setjmp(k->jmp) == 0) {
+    S(handlers) = cons(make_continuation(k), the_empty_list);
+    items = (object *)take_heap(job->items[task->chunk], 1).roots[0];
+    results = make_vector(items->data.vector.length, false);
+
+    for (i = 0; i < items->data.vector.length; i++) {
+      results->data.vector.items[i] =
+        apply_procedure(procedure,
+                        cons(items->data.vector.items[i], the_empty_list));
+    }
+
+    S(handlers) = the_empty_list;
+    job->results[task->chunk] =
+      transfer_heap(job->keep ? results : the_empty_list, the_empty_list);
+    job->failed[task->chunk] = 0;
+  } else if (job->failed[task->chunk] == 1) {
+    job->failed[task->chunk] = 2;
+    job->results[task->chunk] =
+      transfer_heap(S(continuation_value), the_empty_list);
+    job->failed[task->chunk] = 1;
+  }
+
+  release_continuation(k);
+  S(top_level) = NULL;
+  free(job->items[task->chunk]);
+
+  pthread_mutex_lock(&job->lock);
+
+  if (--job->remaining == 0) {
+    pthread_cond_signal(&job->done);
+  }
+
+  pthread_mutex_unlock(&job->lock);
+}
+
+/* Drops what analysis has noted about objects, which may be in a
+ * heap about to be freed. */
+void forget_job_objects(void) {
+  free_object_table(S(expansions));
+  S(expansions) = make_object_table();
+  free_object_table(S(alias_scopes));
+  S(alias_scopes) = make_object_table();
+
+  if (S(source_origins) != NULL) {
+    free_object_table(S(source_origins));
+    S(source_origins) = NULL;
+  }
+
+  if (S(source_locations) != NULL) {
+    free_object_table(S(source_locations));
+    S(source_locations) = NULL;
+    S(source_forms_located) = 0;
+  }
+}
+
+void *run_worker(void *argument) {
+  parallel_task task;
+  object *procedure;
+  char *snapshot;
+  char *procedure_heap;
+  long self;
+  long loaded; /* the snapshot taken, or -1 */
+  long loaded_job;
+  long unchanged; /* mutation_count while the snapshot is as taken */
+  long i;
+  char stack_bottom;
+
+  self = (long)argument;
+  scheme = make_context();
+  S(stack_base) = &stack_bottom;
+  S(spawned) = 1;
+  S(pool_worker) = 1;
+  init_model();
+  procedure = NULL;
+  snapshot = NULL;
+  procedure_heap = NULL;
+  loaded = -1;
+  loaded_job = -1;
+  unchanged = 0;
+
+  while (1) {
+    pthread_mutex_lock(&pool_lock);
+
+    while (queued_tasks == 0) {
+      pthread_cond_wait(&pool_work, &pool_lock);
+    }
+
+    /* claiming one means some deque is sure to have one */
+    queued_tasks--;
+    pthread_mutex_unlock(&pool_lock);
+
+    for (i = 0; !take_task(&work_deques[(self + i) % worker_count],
+                           i % worker_count != 0, &task);
+         i++) {
+    }
+
+    if (task.job->snapshot_id != loaded) {
+      free(procedure_heap);
+      procedure_heap = NULL;
+      free(snapshot);
+      snapshot = copy_heap(task.job->snapshot);
+      take_snapshot(snapshot);
+      loaded = task.job->snapshot_id;
+      loaded_job = -1;
+      unchanged = S(mutation_count);
+    }
+
+    if (task.job->id != loaded_job) {
+      free(procedure_heap);
+      procedure_heap = copy_heap(task.job->procedure);
+      procedure =
+        (object *)take_heap_sharing(procedure_heap, snapshot).roots[0];
+      loaded_job = task.job->id;
+    }
+
+    run_task(&task, procedure);
+    forget_job_objects();
+
+    /* what the task changed may refer to what is freed next */
+    if (S(mutation_count) != unchanged) {
+      loaded = -1;
+    }
+  }
+
+  return NULL;
+}
+
+void start_pool(void) {
+  long i;
+
+  worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (worker_count < 1) {
+    worker_count = 1;
+  }
+
+  work_deques = calloc(worker_count, sizeof(work_deque));
+
+  if (work_deques == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  for (i = 0; i < worker_count; i++) {
+    work_deques[i].capacity = 2 * CHUNKS_PER_WORKER;
+    work_deques[i].tasks =
+      malloc(work_deques[i].capacity * sizeof(parallel_task));
+
+    if (work_deques[i].tasks == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+
+    pthread_mutex_init(&work_deques[i].lock, NULL);
+
+    if (!start_thread(run_worker, (void *)i)) {
+      fprintf(stderr, "could not start a worker thread\n");
+      exit(1);
+    }
+  }
+}
+
+/* Takes a new snapshot for the pool unless nothing the last one holds
+ * can have changed since. */
+void refresh_pool_snapshot(void) {
+  if (S(pool_snapshot) != NULL &&
+      S(pool_snapshot_mutations) == S(mutation_count)) {
+    return;
+  }
+
+  free(S(pool_snapshot));
+  S(pool_snapshot) = NULL;
+
+  if (S(pool_shared) != NULL) {
+    free_object_table(S(pool_shared));
+    S(pool_shared) = NULL;
+  }
+
+  S(pool_snapshot_mutations) = S(mutation_count);
+  S(pool_snapshot) =
+    transfer_heap_sharing(S(symbol_table),
+                          cons(S(the_global_environment), the_empty_list),
+                          NULL, &S(pool_shared));
+  pthread_mutex_lock(&pool_lock);
+  S(pool_snapshot_id) = snapshot_count++;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/* Applies procedure to each item of a list or vector on the pool, and
+ * returns the results in order, or with keep unset just ok. */
+object *parallel_apply(object *procedure, object *sequence, char keep) {
+  parallel_job job;
+  parallel_task task;
+  object *items;
+  object *chunk;
+  object *results;
+  object *head;
+  object *tail;
+  char *raised;
+  long chunks;
+  long length;
+  long start;
+  long failed;
+  long i;
+  long j;
+
+  items = is_vector(sequence) ? sequence :
+    list_to_vector(sequence, keep ? "parallel-map" : "parallel-for-each");
+  length = items->data.vector.length;
+
+  pthread_mutex_lock(&pool_lock);
+
+  if (work_deques == NULL && !S(pool_worker)) {
+    start_pool();
+  }
+
+  job.id = job_count++;
+  pthread_mutex_unlock(&pool_lock);
+
+  /* a worker waiting for the pool could wait for itself */
+  if (S(pool_worker) || length == 0) {
+    head = the_empty_list;
+    tail = NULL;
+
+    for (i = 0; i < length; i++) {
+      results = apply_procedure(procedure,
+                                cons(items->data.vector.items[i],
+                                     the_empty_list));
+      list_append_cell(&head, &tail, results);
+    }
+
+    return keep ? head : S(ok_symbol);
+  }
+
+  chunks = length < worker_count * CHUNKS_PER_WORKER ?
+    length : worker_count * CHUNKS_PER_WORKER;
+  refresh_pool_snapshot();
+  job.snapshot_id = S(pool_snapshot_id);
+  job.snapshot = S(pool_snapshot);
+  job.procedure =
+    transfer_heap_sharing(procedure, the_empty_list, S(pool_shared), NULL);
+  job.items = malloc(chunks * sizeof(char *));
+  job.results = malloc(chunks * sizeof(char *));
+  job.failed = malloc(chunks);
+  job.keep = keep;
+  job.remaining = chunks;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.done, NULL);
+
+  if (job.items == NULL || job.results == NULL || job.failed == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  for (i = 0; i < chunks; i++) {
+    start = i * length / chunks;
+    chunk = make_vector((i + 1) * length / chunks - start, false);
+
+    for (j = 0; j < chunk->data.vector.length; j++) {
+      chunk->data.vector.items[j] = items->data.vector.items[start + j];
+    }
+
+    job.items[i] = transfer_heap(chunk, the_empty_list);
+    task.job = &job;
+    task.chunk = i;
+    push_task(&work_deques[i % worker_count], task);
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  queued_tasks += chunks;
+  pthread_cond_broadcast(&pool_work);
+  pthread_mutex_unlock(&pool_lock);
+
+  pthread_mutex_lock(&job.lock);
+
+  while (job.remaining > 0) {
+    pthread_cond_wait(&job.done, &job.lock);
+  }
+
+  pthread_mutex_unlock(&job.lock);
+
+  free(job.procedure);
+  free(job.items);
+
+  for (failed = 0; failed < chunks && job.failed[failed] == 0; failed++) {
+  }
+
+  /* the first chunk to fail is reported; the rest are dropped */
+  if (failed < chunks) {
+    raised = job.results[failed];
+
+    for (i = 0; i < chunks; i++) {
+      if (i != failed) {
+        free(job.results[i]);
+      }
+    }
+
+    i = job.failed[failed];
+    free(job.results);
+    free(job.failed);
+
+    if (i == 1) {
+      raise_object((object *)take_heap(raised, 1).roots[0], 0);
+    }
+
+    throw_error(keep ? "parallel-map: a worker failed" :
+                "parallel-for-each: a worker failed", NULL);
+  }
+
+  head = the_empty_list;
+  tail = NULL;
+
+  for (i = 0; i < chunks; i++) {
+    results = (object *)take_heap(job.results[i], 1).roots[0];
+
+    /* the results live in their heap, which is theirs from now on */
+    for (j = 0; keep && j < results->data.vector.length; j++) {
+      list_append_cell(&head, &tail, results->data.vector.items[j]);
+    }
+
+    if (!keep) {
+      free(job.results[i]);
+    }
+  }
+
+  free(job.results);
+  free(job.failed);
+
+  return keep ? head : S(ok_symbol);
+}
+
+object *proc_parallel_map(object *arguments) {
+  return parallel_apply(car(arguments), cadr(arguments), 1);
+}
+
+object *proc_parallel_for_each(object *arguments) {
+  return parallel_apply(car(arguments), cadr(arguments), 0);
+}
+
+/* THREADS */
+
+/* Green threads share one interpreter and take turns on the OS thread
+ * it runs on.  Each has a C stack of its own, which eval runs on as
+ * usual, and switching threads swaps stacks with swapcontext and swaps
+ * the few context fields that describe the running stack.  A thread
+ * runs until it yields, waits on a mutex, a condition variable, another
+ * thread or a port, finishes, or has made THREAD_QUANTUM procedure
+ * calls while others are runnable, when eval preempts it.  With
+ * nothing runnable, the scheduler waits for ports and timeouts; see
+ * EVENTS.  The thread the interpreter started on has no stack of its
+ * own and never finishes; if every thread is waiting for something
+ * that cannot happen, it is woken with an error. */
+
+#define THREAD_STACK_SIZE (1L << 23)
+#define THREAD_QUANTUM 1000
+
+typedef struct green_thread {
+  ucontext_t context;
+  char *stack; /* NULL for first_thread */
+  long guard_size; /* the inaccessible bottom of stack */
+  object *thunk;
+  object *arguments; /* what thunk is applied to */
+  object *result;
+  object *handle; /* the thread object, once there is one */
+  char started;
+  char finished;
+  char failed;
+  char *wake_error; /* what to raise once woken */
+  object *deadlines; /* with-timeout's, innermost first */
+  thread_queue *waiting_on; /* NULL while runnable */
+  thread_queue joiners;
+  struct green_thread *next; /* in run_queue or waiting_on */
+  struct green_thread *next_timed; /* in timed_threads */
+  /* the interpreter's state while the thread is switched out */
+  char *saved_stack_base;
+  continuation *saved_live_continuations;
+  continuation *saved_top_level;
+  object *saved_winders;
+  object *saved_handlers;
+  profile_frame *saved_profile_stack;
+  object *saved_toplevel_form;
+  object *saved_running_call;
+  object *saved_macro_renames;
+} green_thread;
+
+typedef struct mutex {
+  green_thread *owner; /* NULL while unlocked */
+  thread_queue waiting;
+} mutex;
+
+typedef struct condition_variable {
+  thread_queue waiting;
+} condition_variable;
+
+void enqueue_thread(thread_queue *queue, green_thread *thread) {
+  thread->next = NULL;
+
+  if (queue->last == NULL) {
+    queue->first = thread;
+  } else {
+    queue->last->next = thread;
+  }
+
+  queue->last = thread;
+}
+
+green_thread *dequeue_thread(thread_queue *queue) {
+  green_thread *thread;
+
+  thread = queue->first;
+
+  if (thread != NULL) {
+    queue->first = thread->next;
+
+    if (queue->first == NULL) {
+      queue->last = NULL;
+    }
+  }
+
+  return thread;
+}
+
+void remove_thread(thread_queue *queue, green_thread *thread) {
+  green_thread *previous;
+
+  if (queue->first == thread) {
+    dequeue_thread(queue);
+
+    return;
+  }
+
+  for (previous = queue->first; previous->next != thread;
+       previous = previous->next) {
+  }
+
+  previous->next = thread->next;
+
+  if (queue->last == thread) {
+    queue->last = previous;
+  }
+}
+
+green_thread *make_green_thread(void) {
+  green_thread *thread;
+
+  thread = calloc(1, sizeof(green_thread));
+
+  if (thread == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  thread->arguments = the_empty_list;
+  thread->deadlines = the_empty_list;
+
+  return thread;
+}
+
+/* The running thread, made on first use for the one the interpreter
+ * started on. */
+green_thread *thread_self(void) {
+  if (S(current_thread) == NULL) {
+    S(first_thread) = make_green_thread();
+    S(first_thread)->started = 1;
+    S(current_thread) = S(first_thread);
+  }
+
+  return S(current_thread);
+}
+
+/* Makes a waiting thread runnable. */
+void wake_thread(green_thread *thread) {
+  /* a thread woken by its deadline may have its port ready too */
+  if (thread->waiting_on == NULL) {
+    return;
+  }
+
+  remove_thread(thread->waiting_on, thread);
+  thread->waiting_on = NULL;
+  enqueue_thread(&S(run_queue), thread);
+}
+
+void free_finished_thread(void) {
+  if (S(finished_thread) != NULL) {
+    mprotect(S(finished_thread)->stack, S(finished_thread)->guard_size,
+             PROT_READ | PROT_WRITE);
+    free(S(finished_thread)->stack);
+    S(finished_thread)->stack = NULL;
+    free_continuation(S(finished_thread)->saved_top_level);
+    S(finished_thread)->saved_top_level = NULL;
+    S(finished_thread) = NULL;
+  }
+}
+
+void trace_resume(profile_frame *frame) {
+  if (frame != NULL) {
+    trace_resume(frame->caller);
+    record_trace_event('B', frame->procedure, NULL);
+  }
+}
+
+/* Switches from the running thread to thread, returning when something
+ * switches back. */
+void switch_thread(green_thread *thread) {
+  green_thread *self;
+
+  self = S(current_thread);
+  self->saved_stack_base = S(stack_base);
+  self->saved_live_continuations = S(live_continuations);
+  self->saved_top_level = S(top_level);
+  self->saved_winders = S(winders);
+  self->saved_handlers = S(handlers);
+  self->saved_profile_stack = S(profile_stack);
+  self->saved_toplevel_form = S(toplevel_form);
+  self->saved_running_call = S(running_call);
+  self->saved_macro_renames = S(macro_renames);
+
+  /* the trace shows the frames of the running thread only */
+  if (tracing) {
+    trace_unwind(NULL);
+  }
+
+  S(profile_stack) = NULL;
+  S(current_thread) = thread;
+  swapcontext(&self->context, &thread->context);
+
+  free_finished_thread();
+  S(stack_base) = self->saved_stack_base;
+  S(live_continuations) = self->saved_live_continuations;
+  S(top_level) = self->saved_top_level;
+  S(winders) = self->saved_winders;
+  S(handlers) = self->saved_handlers;
+  S(toplevel_form) = self->saved_toplevel_form;
+  S(running_call) = self->saved_running_call;
+  S(macro_renames) = self->saved_macro_renames;
+  S(profile_stack) = self->saved_profile_stack;
+
+  if (tracing) {
+    trace_resume(S(profile_stack));
+  }
+}
+
+int wait_for_events(long timeout);
+void check_deadline(void);
+
+/* Runs the next runnable thread, waiting for one if need be.  The
+ * running thread must be waiting or finished; if nothing else is
+ * runnable and nothing is left that could wake a thread, first_thread
+ * is woken to report it. */
+void run_next_thread(void) {
+  green_thread *thread;
+
+  while ((thread = dequeue_thread(&S(run_queue))) == NULL &&
+         wait_for_events(-1)) {
+  }
+
+  if (thread == NULL) {
+    thread = S(first_thread);
+    remove_thread(thread->waiting_on, thread);
+    thread->waiting_on = NULL;
+    thread->wake_error = "deadlock: every thread is waiting";
+  }
+
+  if (thread != S(current_thread)) {
+    switch_thread(thread);
+  }
+}
+
+/* Waits in queue until another thread wakes the running one.  Waking
+ * may instead leave an error, which raise_wake_error raises. */
+void block_thread(thread_queue *queue) {
+  green_thread *self;
+
+  self = thread_self();
+  enqueue_thread(queue, self);
+  self->waiting_on = queue;
+  run_next_thread();
+}
+
+void raise_wake_error(void) {
+  char *error;
+
+  error = S(current_thread)->wake_error;
+
+  if (error != NULL) {
+    S(current_thread)->wake_error = NULL;
+    throw_error(error, NULL);
+  }
+}
+
+void yield_thread(void) {
+  if (S(run_queue).first != NULL) {
+    enqueue_thread(&S(run_queue), S(current_thread));
+    run_next_thread();
+  }
+}
+
+/* Called by eval every THREAD_QUANTUM procedure calls. */
+void preempt_thread(void) {
+  S(preempt_countdown) = THREAD_QUANTUM;
+
+  if (S(current_thread) == NULL) {
+    return;
+  }
+
+  /* let threads whose ports are ready or time is up join the queue */
+  if (S(io_queue).first != NULL || S(timed_threads) != NULL) {
+    wait_for_events(0);
+  }
+
+  yield_thread();
+  check_deadline();
+}
+
+void run_green_thread(void) {
+  green_thread *self;
+  char stack_bottom;
+
+  self = S(current_thread);
+  free_finished_thread();
+  S(stack_base) = &stack_bottom;
+  S(live_continuations) = NULL;
+  S(winders) = the_empty_list;
+  S(handlers) = the_empty_list;
+  S(profile_stack) = NULL;
+  S(toplevel_form) = self->saved_toplevel_form;
+  S(running_call) = NULL;
+  S(macro_renames) = the_empty_list;
+
+  /* an error nothing handles is reported, and ends the thread */
+  S(top_level) = push_continuation(1);
+
+  if (setjmp(S(top_level)->jmp) == 0) {
+    self->result = apply_procedure(self->thunk, self->arguments);
+  } else {
+    self->failed = 1;
+  }
+
+  self->finished = 1;
+  self->thunk = NULL;
+  self->arguments = NULL;
+
+  while (self->joiners.first != NULL) {
+    wake_thread(self->joiners.first);
+  }
+
+  /* the next thread to run frees this one's stack */
+  S(finished_thread) = self;
+  run_next_thread();
+}
+
+/* Returns the thread object for thread, the same one every time so
+ * that eq? tells threads apart. */
+object *make_thread(green_thread *thread) {
+  if (thread->handle == NULL) {
+    thread->handle = alloc_object(THREAD);
+    thread->handle->data.thread.thread = thread;
+  }
+
+  return thread->handle;
+}
+
+green_thread *thread_argument(object *arguments, char *error) {
+  if (!is_thread(car(arguments))) {
+    throw_error(error, car(arguments));
+  }
+
+  return car(arguments)->data.thread.thread;
+}
+
+object *proc_make_thread(object *arguments) {
+  green_thread *thread;
+
+  thread_self();
+  thread = make_green_thread();
+  thread->thunk = car(arguments);
+  S(mutation_count)++; /* what it reaches outlives any extent */
+  thread->saved_toplevel_form = S(toplevel_form);
+
+  return make_thread(thread);
+}
+
+/* Gives thread a stack and makes it runnable. */
+void start_green_thread(green_thread *thread) {
+  void *stack;
+
+  /* the stack's pages are only used once touched, so most of it costs
+   * nothing; overflowing it hits the guard */
+  thread->guard_size = sysconf(_SC_PAGESIZE);
+
+  if (posix_memalign(&stack, thread->guard_size, THREAD_STACK_SIZE) != 0) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  thread->stack = stack;
+  mprotect(thread->stack, thread->guard_size, PROT_NONE);
+  getcontext(&thread->context);
+  thread->context.uc_stack.ss_sp = thread->stack;
+  thread->context.uc_stack.ss_size = THREAD_STACK_SIZE;
+  thread->context.uc_link = NULL;
+  makecontext(&thread->context, run_green_thread, 0);
+  thread->started = 1;
+  enqueue_thread(&S(run_queue), thread);
+}
+
+object *proc_thread_start(object *arguments) {
+  green_thread *thread;
+
+  thread = thread_argument(arguments, "thread-start!: not a thread");
+
+  if (thread->started) {
+    throw_error("thread-start!: already started", car(arguments));
+  }
+
+  start_green_thread(thread);
+
+  return car(arguments);
+}
+
+object *proc_thread_yield(object *arguments) {
+  thread_self();
+  preempt_thread();
+
+  return S(ok_symbol);
+}
+
+object *proc_thread_join(object *arguments) {
+  green_thread *thread;
+
+  thread = thread_argument(arguments, "thread-join!: not a thread");
+
+  if (thread == thread_self()) {
+    throw_error("thread-join!: a thread cannot join itself", car(arguments));
+  }
+
+  if (!thread->finished) {
+    block_thread(&thread->joiners);
+    raise_wake_error();
+  }
+
+  if (thread->failed) {
+    throw_error("thread-join!: the thread failed", car(arguments));
+  }
+
+  return thread->result;
+}
+
+object *proc_current_thread(object *arguments) {
+  return make_thread(thread_self());
+}
+
+object *proc_is_thread(object *arguments) {
+  return is_thread(car(arguments)) ? true : false;
+}
+
+object *proc_make_mutex(object *arguments) {
+  object *obj;
+
+  obj = alloc_object(MUTEX);
+  obj->data.mutex.mutex = calloc(1, sizeof(mutex));
+
+  if (obj->data.mutex.mutex == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  return obj;
+}
+
+mutex *mutex_argument(object *arguments, char *error) {
+  if (!is_mutex(car(arguments))) {
+    throw_error(error, car(arguments));
+  }
+
+  return car(arguments)->data.mutex.mutex;
+}
+
+object *proc_mutex_lock(object *arguments) {
+  mutex *m;
+
+  m = mutex_argument(arguments, "mutex-lock!: not a mutex");
+
+  if (m->owner == thread_self()) {
+    throw_error("mutex-lock!: already locked by this thread",
+                car(arguments));
+  }
+
+  /* a finished thread's mutexes are free for the taking */
+  if (m->owner == NULL || m->owner->finished) {
+    m->owner = S(current_thread);
+  } else {
+    /* unlocking hands the mutex straight to the first waiter */
+    block_thread(&m->waiting);
+    raise_wake_error();
+  }
+
+  return S(ok_symbol);
+}
+
+object *proc_mutex_unlock(object *arguments) {
+  condition_variable *cv;
+  mutex *m;
+
+  m = mutex_argument(arguments, "mutex-unlock!: not a mutex");
+  cv = NULL;
+
+  if (!is_the_empty_list(cdr(arguments))) {
+    if (!is_condition_variable(cadr(arguments))) {
+      throw_error("mutex-unlock!: not a condition variable",
+                  cadr(arguments));
+    }
+
+    cv = cadr(arguments)->data.condition_variable.condition_variable;
+  }
+
+  m->owner = m->waiting.first;
+
+  if (m->owner != NULL) {
+    wake_thread(m->owner);
+  }
+
+  /* as in SRFI 18, the caller locks the mutex again once woken */
+  if (cv != NULL) {
+    block_thread(&cv->waiting);
+    raise_wake_error();
+  }
+
+  return S(ok_symbol);
+}
+
+object *proc_is_mutex(object *arguments) {
+  return is_mutex(car(arguments)) ? true : false;
+}
+
+object *proc_make_condition_variable(object *arguments) {
+  object *obj;
+
+  obj = alloc_object(CONDITION_VARIABLE);
+  obj->data.condition_variable.condition_variable =
+    calloc(1, sizeof(condition_variable));
+
+  if (obj->data.condition_variable.condition_variable == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  return obj;
+}
+
+condition_variable *condition_variable_argument(object *arguments,
+                                                char *error) {
+  if (!is_condition_variable(car(arguments))) {
+    throw_error(error, car(arguments));
+  }
+
+  return car(arguments)->data.condition_variable.condition_variable;
+}
+
+object *proc_condition_variable_signal(object *arguments) {
+  condition_variable *cv;
+
+  cv = condition_variable_argument(arguments,
+         "condition-variable-signal!: not a condition variable");
+
+  if (cv->waiting.first != NULL) {
+    wake_thread(cv->waiting.first);
+  }
+
+  return S(ok_symbol);
+}
+
+object *proc_condition_variable_broadcast(object *arguments) {
+  condition_variable *cv;
+
+  cv = condition_variable_argument(arguments,
+         "condition-variable-broadcast!: not a condition variable");
+
+  while (cv->waiting.first != NULL) {
+    wake_thread(cv->waiting.first);
+  }
+
+  return S(ok_symbol);
+}
+
+object *proc_is_condition_variable(object *arguments) {
+  return is_condition_variable(car(arguments)) ? true : false;
+}
+
+/* EVENTS */
+
+/* Ports over file descriptors (pipes, sockets, files) do not block
+ * the interpreter.  Their descriptors are non-blocking.  A read or
+ * write that would block parks the running thread in io_queue, with
+ * its descriptor registered with the interpreter's epoll instance,
+ * until the descriptor is ready; meanwhile other threads run, and with
+ * none runnable the scheduler waits in epoll_wait.  Such a port keeps
+ * its own buffer.  An input port reads a datum by parsing what it has
+ * buffered, reading more and parsing again while the datum might go
+ * on past it; an output port is written through a memory stream,
+ * which is drained to the descriptor after every write.
+ *
+ * with-timeout gives the running thread a deadline.  A thread that is
+ * waiting when its deadline passes is woken with an error, and one
+ * that is running raises it at its next preemption point. */
+
+#define EVENTS_MAX 64
+#define FD_PORT_BUFFER 4096
+#define JIFFIES_PER_MILLISECOND (JIFFIES_PER_SECOND / 1000)
+
+typedef struct fd_port {
+  int fd;
+  char *data; /* input not yet taken, or output not yet written */
+  long start;
+  long end;
+  long capacity;
+  char at_eof;
+  size_t size; /* of an output port's data */
+  long written; /* how much of that is written */
+  continuation *reader; /* where reader errors land, made once */
+  object *reader_handler;
+} fd_port;
+
+int event_descriptor(void) {
+  if (!S(epoll_open)) {
+    S(epoll_fd) = epoll_create(EVENTS_MAX);
+
+    if (S(epoll_fd) < 0) {
+      fprintf(stderr, "could not create an epoll instance\n");
+      exit(1);
+    }
+
+    S(epoll_open) = 1;
+  }
+
+  return S(epoll_fd);
+}
+
+/* Parks the running thread until fd is ready for events. */
+void wait_fd(int fd, int events) {
+  struct epoll_event event;
+
+  event.events = events;
+  event.data.ptr = thread_self();
+
+  if (epoll_ctl(event_descriptor(), EPOLL_CTL_ADD, fd, &event) != 0) {
+    throw_error("could not wait for port", NULL);
+  }
+
+  block_thread(&S(io_queue));
+  epoll_ctl(S(epoll_fd), EPOLL_CTL_DEL, fd, &event);
+  raise_wake_error();
+}
+
+/* Wakes the waiting threads whose deadlines have passed, and returns
+ * how many it woke.  next is set to the jiffies left until the next
+ * deadline of a waiting thread, or -1. */
+long expire_deadlines(long *next) {
+  green_thread *thread;
+  long deadline;
+  long now;
+  long woken;
+
+  now = clock_jiffies(CLOCK_MONOTONIC);
+  woken = 0;
+  *next = -1;
+
+  for (thread = S(timed_threads); thread != NULL;
+       thread = thread->next_timed) {
+    if (thread->waiting_on == NULL) {
+      continue;
+    }
+
+    deadline = car(thread->deadlines)->data.fixnum.value;
+
+    if (deadline <= now) {
+      /* a deadline is only met once */
+      set_car(thread->deadlines, make_fixnum(LONG_MAX));
+      thread->wake_error = "with-timeout: timed out";
+      wake_thread(thread);
+      woken++;
+    } else if (*next < 0 || deadline - now < *next) {
+      *next = deadline - now;
+    }
+  }
+
+  return woken;
+}
+
+/* Makes runnable the threads whose ports are ready or whose deadlines
+ * have passed, waiting up to timeout milliseconds, or with -1 for as
+ * long as it takes, for there to be one.  Returns 0 without waiting if
+ * no thread waits for a port or a deadline. */
+int wait_for_events(long timeout) {
+  struct epoll_event events[EVENTS_MAX];
+  long next;
+  int count;
+  int i;
+
+  if (expire_deadlines(&next) > 0) {
+    timeout = 0;
+  } else if (next >= 0 && (timeout < 0 || next < timeout *
+                           JIFFIES_PER_MILLISECOND)) {
+    timeout = (next + JIFFIES_PER_MILLISECOND - 1) /
+      JIFFIES_PER_MILLISECOND;
+  } else if (S(io_queue).first == NULL && timeout != 0) {
+    return 0;
+  }
+
+  count = epoll_wait(event_descriptor(), events, EVENTS_MAX, timeout);
+
+  for (i = 0; i < count; i++) {
+    wake_thread(events[i].data.ptr);
+  }
+
+  return 1;
+}
+
+void check_deadline(void) {
+  object *deadlines;
+
+  deadlines = S(current_thread)->deadlines;
 
-object *apply_operands(object *arguments) {
-  return prepare_apply_operands(cdr(arguments));
+  if (!is_the_empty_list(deadlines) &&
+      car(deadlines)->data.fixnum.value <= clock_jiffies(CLOCK_MONOTONIC)) {
+    set_car(deadlines, make_fixnum(LONG_MAX));
+    throw_error("with-timeout: timed out", NULL);
+  }
 }
 
-object *assignment_value(object *exp) {
-  return caddr(exp);
-}
+void push_deadline(green_thread *thread, long deadline) {
+  if (is_the_empty_list(thread->deadlines)) {
+    thread->next_timed = S(timed_threads);
+    S(timed_threads) = thread;
+  }
 
-object *assignment_variable(object *exp) {
-  return cadr(exp);
+  thread->deadlines = cons(make_fixnum(deadline), thread->deadlines);
 }
 
-object *begin_actions(object *exp) {
-  return cdr(exp);
-}
+void pop_deadline(green_thread *thread) {
+  green_thread **link;
 
-object *binding_argument(object *binding) {
-  return cadr(binding);
-}
+  thread->deadlines = cdr(thread->deadlines);
 
-object *binding_arguments(object *bindings) {
-  return is_the_empty_list(bindings) ?
-    the_empty_list :
-    cons(binding_argument(car(bindings)),
-         binding_arguments(cdr(bindings)));
-}
+  if (is_the_empty_list(thread->deadlines)) {
+    for (link = &S(timed_threads); *link != thread;
+         link = &(*link)->next_timed) {
+    }
 
-object *binding_parameter(object *binding) {
-  return car(binding);
+    *link = thread->next_timed;
+  }
 }
 
-object *binding_parameters(object *bindings) {
-  return is_the_empty_list(bindings) ?
-    the_empty_list :
-    cons(binding_parameter(car(bindings)),
-         binding_parameters(cdr(bindings)));
-}
+/* with-timeout's winders: re-entering its thunk by a continuation
+ * keeps the deadline outside it */
+object *proc_deadline_enter(object *arguments) {
+  push_deadline(S(current_thread),
+                is_the_empty_list(S(current_thread)->deadlines) ? LONG_MAX :
+                car(S(current_thread)->deadlines)->data.fixnum.value);
 
-object *cond_actions(object *clause) {
-  return cdr(clause);
+  return S(ok_symbol);
 }
 
-object *cond_clauses(object *exp) {
-  return cdr(exp);
-}
+object *proc_deadline_leave(object *arguments) {
+  pop_deadline(S(current_thread));
 
-object *cond_predicate(object *clause) {
-  return car(clause);
+  return S(ok_symbol);
 }
 
-object *expand_clauses(object *clauses);
+/* (with-timeout milliseconds thunk) */
+object *proc_with_timeout(object *arguments) {
+  green_thread *self;
+  object *result;
+  long deadline;
 
-object *cond_to_if(object *exp) {
-  return expand_clauses(cond_clauses(exp));
-}
+  if (!is_fixnum(car(arguments)) || car(arguments)->data.fixnum.value < 0) {
+    throw_error("with-timeout: bad timeout", car(arguments));
+  }
 
-object *make_lambda(object *parameters, object *body);
+  self = thread_self();
+  deadline = clock_jiffies(CLOCK_MONOTONIC) +
+    car(arguments)->data.fixnum.value * JIFFIES_PER_MILLISECOND;
 
-object *definition_value(object *exp) {
-  if (is_symbol(cadr(exp))) {
-      return caddr(exp);
+  if (!is_the_empty_list(self->deadlines) &&
+      car(self->deadlines)->data.fixnum.value < deadline) {
+    deadline = car(self->deadlines)->data.fixnum.value;
   }
 
-  return make_lambda(cdadr(exp), cddr(exp));
+  push_deadline(self, deadline);
+  S(winders) = cons(cons(make_primitive_proc(proc_deadline_enter),
+                         make_primitive_proc(proc_deadline_leave)),
+                    S(winders));
+
+  result = apply_procedure(cadr(arguments), the_empty_list);
+
+  S(winders) = cdr(S(winders));
+  pop_deadline(self);
+
+  return result;
 }
 
-object *definition_variable(object *exp) {
-  if (is_symbol(cadr(exp))) {
-    return cadr(exp);
+fd_port *make_fd_port(int fd) {
+  fd_port *port;
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    throw_error("not a file descriptor", make_fixnum(fd));
   }
 
-  return caadr(exp);
-}
+  port = calloc(1, sizeof(fd_port));
 
-object *eval_environment(object *arguments) {
-  return cadr(arguments);
-}
+  if (port == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
 
-object *eval_expression(object *arguments) {
-  return car(arguments);
+  port->fd = fd;
+
+  return port;
 }
 
-char is_cond_else_clause(object *clause);
-object *make_if(object *predicate,
-                object *consequent,
-                object *alternative);
-object *sequence_to_exp(object *seq);
+object *make_fd_input_port(int fd) {
+  object *obj;
 
-object *expand_clauses(object *clauses) {
-  object *first;
-  object *rest;
+  obj = make_input_port(NULL);
+  obj->data.input_port.fd_port = make_fd_port(fd);
+  obj->data.input_port.fd_port->capacity = FD_PORT_BUFFER;
+  obj->data.input_port.fd_port->data = malloc(FD_PORT_BUFFER);
 
-  if (is_the_empty_list(clauses)) {
-    return false;
+  if (obj->data.input_port.fd_port->data == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
   }
 
-  first = car(clauses);
-  rest = cdr(clauses);
+  return obj;
+}
 
-  if (is_cond_else_clause(first)) {
-    if (is_the_empty_list(rest)) {
-      return sequence_to_exp(cond_actions(first));
-    }
+object *make_fd_output_port(int fd) {
+  object *obj;
+  fd_port *port;
+  FILE *out;
+
+  /* a reader going away is an error for the writer, not a signal */
+  signal(SIGPIPE, SIG_IGN);
+  port = make_fd_port(fd);
+  out = open_memstream(&port->data, &port->size);
 
-    fprintf(stderr, "else clause isn't the last cond->if'");
+  if (out == NULL) {
+    fprintf(stderr, "out of memory\n");
     exit(1);
   }
 
-  return make_if(cond_predicate(first),
-                 sequence_to_exp(cond_actions(first)),
-                 expand_clauses(rest));
-}
+  obj = make_output_port(out);
+  obj->data.output_port.fd_port = port;
 
-object *first_exp(object *seq) {
-  return car(seq);
+  return obj;
 }
 
-object *first_operand(object *ops) {
-  return car(ops);
-}
+/* Reads what the port's descriptor has, waiting until it has some.
+ * Returns how much it read, which is 0 at the end of the file. */
+long fill_fd_port(fd_port *port) {
+  long total;
+  long count;
 
-object *if_alternative(object *exp) {
-  if (is_the_empty_list(cdddr(exp))) {
-    return false;
+  if (port->start > 0) {
+    memmove(port->data, port->data + port->start, port->end - port->start);
+    port->end -= port->start;
+    port->start = 0;
   }
 
-  return cadddr(exp);
-}
+  total = 0;
 
-object *if_consequent(object *exp) {
-  return caddr(exp);
-}
+  while (1) {
+    if (port->end == port->capacity) {
+      port->capacity *= 2;
+      port->data = realloc(port->data, port->capacity);
 
-object *if_predicate(object *exp) {
-  return cadr(exp);
-}
+      if (port->data == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+      }
+    }
 
-char is_tagged_list(object *exp, object *tag);
+    count = read(port->fd, port->data + port->end,
+                 port->capacity - port->end);
+
+    if (count > 0) {
+      port->end += count;
+      total += count;
+    } else if (count == 0) {
+      port->at_eof = 1;
+
+      return total;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      /* take everything there is, so a datum is parsed again only
+       * once per wait */
+      if (total > 0) {
+        return total;
+      }
 
-char is_application(object *exp) {
-  return is_pair(exp);
+      wait_fd(port->fd, EPOLLIN);
+    } else if (errno != EINTR) {
+      throw_error("could not read from port", NULL);
+    }
+  }
 }
 
-char is_assignment(object *exp) {
-  return is_tagged_list(exp, set_symbol);
-}
+/* The next character, or EOF; taken from the port if take is set. */
+int fd_port_char(fd_port *port, char take) {
+  if (port->start == port->end && !port->at_eof) {
+    fill_fd_port(port);
+  }
 
-char is_and(object *exp) {
-  return is_tagged_list(exp, and_symbol);
-}
+  if (port->start == port->end) {
+    port->at_eof = 0;
 
-char is_begin(object *exp) {
-  return is_tagged_list(exp, begin_symbol);
-}
+    return EOF;
+  }
 
-char is_cond(object *exp) {
-  return is_tagged_list(exp, cond_symbol);
+  return (unsigned char)port->data[take ? port->start++ : port->start];
 }
 
-char is_cond_else_clause(object *clause) {
-  return cond_predicate(clause) == else_symbol;
-}
+object *read_fd_port(fd_port *port) {
+  continuation *volatile k;
+  object *volatile result;
+  FILE *volatile in;
+  char complete;
+  char failed;
 
-char is_definition(object *exp) {
-  return is_tagged_list(exp, define_symbol);
-}
+  while (1) {
+    if (port->start == port->end && !port->at_eof) {
+      fill_fd_port(port);
 
-char is_if(object *exp) {
-  return is_tagged_list(exp, if_symbol);
-}
+      continue;
+    }
 
-char is_lambda(object *exp) {
-  return is_tagged_list(exp, lambda_symbol);
-}
+    if (port->start == port->end) {
+      port->at_eof = 0;
 
-char is_let(object *exp) {
-  return is_tagged_list(exp, let_symbol);
-}
+      return eof_object;
+    }
 
-char is_last_exp(object *seq) {
-  return is_the_empty_list(cdr(seq));
-}
+    in = fmemopen(port->data + port->start, port->end - port->start, "r");
 
-char is_no_operands(object *ops) {
-  return is_the_empty_list(ops);
-}
+    if (in == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
 
-char is_or(object *exp) {
-  return is_tagged_list(exp, or_symbol);
-}
+    /* an error the reader raises lands here first */
+    if (port->reader == NULL) {
+      port->reader = push_continuation(1);
+      port->reader->kept = 1;
+      port->reader_handler = make_continuation(port->reader);
+    } else {
+      link_continuation(port->reader, 1);
+    }
 
-char is_quoted(object *exp) {
-  return is_tagged_list(exp, quote_symbol);
-}
+    k = port->reader;
+    result = NULL;
+    failed = setjmp(k->jmp) != 0;
 
-char is_self_evaluating(object *exp) {
-  return is_boolean(exp) ||
-    is_fixnum(exp) ||
-    is_character(exp) ||
-    is_the_empty_string(exp) ||
-    is_string(exp);
+    if (!failed) {
+      S(handlers) = cons(port->reader_handler, S(handlers));
+      result = read_object(in);
+      S(handlers) = cdr(S(handlers));
+    }
+
+    pop_continuation(k);
+
+    /* a datum that ran into the end of the buffer may go on */
+    complete = !feof(in) || port->at_eof;
+
+    if (complete) {
+      port->start += ftell(in);
+    }
+
+    fclose(in);
+
+    if (complete && failed) {
+      raise_object(S(continuation_value), 0);
+    }
+
+    if (complete) {
+      port->at_eof = 0;
+
+      return result == NULL ? eof_object : result;
+    }
+
+    fill_fd_port(port);
+  }
 }
 
-char is_tagged_list(object *exp, object *tag) {
-  object *the_car;
+/* Writes what was written to the port's stream to its descriptor,
+ * waiting for it to take it all. */
+void drain_fd_port(FILE *out, fd_port *port) {
+  long count;
 
-  if (is_pair(exp)) {
-    the_car = car(exp);
+  fflush(out);
 
-    return is_symbol(the_car) && (the_car == tag);
+  while (port->written < (long)port->size) {
+    count = write(port->fd, port->data + port->written,
+                  port->size - port->written);
+
+    if (count >= 0) {
+      port->written += count;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      wait_fd(port->fd, EPOLLOUT);
+    } else if (errno != EINTR) {
+      throw_error("could not write to port", NULL);
+    }
   }
 
-  return 0;
+  port->written = 0;
+  rewind(out);
 }
 
-char is_variable(object *exp) {
-  return is_symbol(exp);
+void close_fd_port(FILE *out, fd_port *port) {
+  if (out != NULL) {
+    drain_fd_port(out, port);
+    fclose(out);
+  }
+
+  free(port->data);
+  port->data = NULL;
+
+  if (close(port->fd) != 0) {
+    throw_error("could not close port", NULL);
+  }
 }
 
-object *lambda_body(object *exp) {
-  return cddr(exp);
+object *proc_open_fd_input_port(object *arguments) {
+  return make_fd_input_port(car(arguments)->data.fixnum.value);
 }
 
-object *lambda_parameters(object *exp) {
-  return cadr(exp);
+object *proc_open_fd_output_port(object *arguments) {
+  return make_fd_output_port(car(arguments)->data.fixnum.value);
 }
 
-object *let_bindings(object *exp);
+/* (open-pipe) is (input-port . output-port) */
+object *proc_open_pipe(object *arguments) {
+  int fds[2];
 
-object *let_arguments(object *exp) {
-  return binding_arguments(let_bindings(exp));
-}
+  if (pipe(fds) != 0) {
+    throw_error("could not open pipe", NULL);
+  }
 
-object *let_bindings(object *exp) {
-  return cadr(exp);
+  return cons(make_fd_input_port(fds[0]), make_fd_output_port(fds[1]));
 }
 
-object *let_body(object *exp) {
-  return cddr(exp);
-}
+/* (open-unix-socket path) connects to a stream socket, and is
+ * (input-port . output-port) */
+object *proc_open_unix_socket(object *arguments) {
+  struct sockaddr_un address;
+  char *path;
+  int fd;
+  int out;
 
-object *let_parameters(object *exp) {
-  return binding_parameters(let_bindings(exp));
-}
+  path = car(arguments)->data.string.value;
 
-object *make_application(object *operator, object *operands);
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    throw_error("open-unix-socket: path too long", car(arguments));
+  }
 
-object *let_to_application(object *exp) {
-  return make_application(make_lambda(let_parameters(exp),
-                                      let_body(exp)),
-                          let_arguments(exp));
-}
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
 
-object *make_application(object *operator, object *operands) {
-  return cons(operator, operands);
-}
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
 
-object *make_begin(object *exp) {
-  return cons(begin_symbol, exp);
-}
+    throw_error("could not connect to socket", car(arguments));
+  }
 
-object *make_if(object *predicate,
-                object *consequent,
-                object *alternative) {
-  return cons(if_symbol,
-              cons(predicate,
-                   cons(consequent,
-                        cons(alternative, the_empty_list))));
-}
+  /* each direction waits on its own descriptor */
+  out = dup(fd);
 
-object *make_lambda(object *parameters, object *body) {
-  return cons(lambda_symbol, cons(parameters, body));
-}
+  if (out < 0) {
+    close(fd);
+    throw_error("could not connect to socket", car(arguments));
+  }
 
-object *operands(object *exp) {
-  return cdr(exp);
+  return cons(make_fd_input_port(fd), make_fd_output_port(out));
 }
 
-object *operator(object *exp) {
-  return car(exp);
-}
+/* SERVER */
 
-object *or_tests(object *exp) {
-  return cdr(exp);
-}
+/* scheme --serve path, or (serve-repl path), accepts REPL sessions on
+ * a Unix domain socket.  Each session is a green thread reading and
+ * writing fd ports over its connection (see EVENTS), so a session
+ * waiting for its client holds up neither the others nor the program,
+ * and all of them share the global environment.  A session reads a
+ * datum, evaluates it and writes back the value and a newline, or the
+ * error as the REPL would report it, until its client hangs up.  The
+ * ports reuse their buffers and a session's errors all land on one
+ * continuation, so a request allocates little beyond what evaluating
+ * it does. */
 
-object *prepare_apply_operands(object *arguments) {
-  if (is_the_empty_list(cdr(arguments))) {
-    return car(arguments);
+#define SESSION_READING 0
+#define SESSION_WRITING 1
+
+/* (in out), the ports over a connection */
+object *proc_serve_session(object *arguments) {
+  continuation *volatile k;
+  volatile char state;
+  object *handler;
+  object *result;
+  object *in;
+  object *out;
+  FILE *stream;
+
+  in = car(arguments);
+  out = cadr(arguments);
+  stream = out->data.output_port.stream;
+  k = push_continuation(1);
+  handler = cons(make_continuation(k), the_empty_list);
+  state = SESSION_READING;
+
+  while (1) {
+    if (setjmp(k->jmp) != 0) {
+      /* the client went away */
+      if (state == SESSION_WRITING) {
+        break;
+      }
+
+      write_raised(stream, S(continuation_value));
+    } else {
+      state = SESSION_READING;
+      S(handlers) = handler;
+      result = read_fd_port(in->data.input_port.fd_port);
+
+      if (is_eof_object(result)) {
+        break;
+      }
+
+      S(toplevel_form) = result;
+      result = eval(analyze(result, S(the_global_environment)),
+                    S(the_global_environment));
+      write_object(stream, result);
+      putc('\n', stream);
+    }
+
+    state = SESSION_WRITING;
+    S(handlers) = handler;
+    drain_fd_port(stream, out->data.output_port.fd_port);
   }
 
-  return cons(car(arguments),
-              prepare_apply_operands(cdr(arguments)));
-}
+  /* whatever is left unwritten has nowhere to go */
+  S(handlers) = the_empty_list;
+  release_continuation(k);
+  fclose(stream);
+  close_fd_port(NULL, in->data.input_port.fd_port);
+  close_fd_port(NULL, out->data.output_port.fd_port);
 
-object *rest_operands(object *ops) {
-  return cdr(ops);
+  return S(ok_symbol);
 }
 
-object *rest_exps(object *seq) {
-  return cdr(seq);
-}
+/* Listens on a Unix domain socket at path, and returns its descriptor,
+ * non-blocking. */
+int open_unix_server(char *path) {
+  struct sockaddr_un address;
+  struct stat status;
+  int flags;
+  int fd;
 
-object *sequence_to_exp(object *seq) {
-  if (is_the_empty_list(seq)) {
-    return seq;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    throw_error("serve: socket path too long", make_string(path));
   }
 
-  if (is_last_exp(seq)) {
-    return first_exp(seq);
+  /* a socket left by an earlier server is in the way; anything else
+   * at path is not ours to remove */
+  if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode)) {
+    unlink(path);
   }
 
-  return make_begin(seq);
-}
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0 ||
+      bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0 ||
+      (flags = fcntl(fd, F_GETFL)) < 0 ||
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
 
-object *text_of_quotation(object *exp) {
-  return cadr(exp);
+    throw_error("serve: could not listen on socket", make_string(path));
+  }
+
+  return fd;
 }
 
-object *list_of_values(object *exps, object *env) {
-  if (is_no_operands(exps)) {
-    return the_empty_list;
-  }
+/* (fd), a listening socket: starts a session for every connection */
+object *proc_accept_sessions(object *arguments) {
+  green_thread *session;
+  int fd;
+  int client;
+  int out;
 
-  return cons(eval(first_operand(exps), env),
-	      list_of_values(rest_operands(exps), env));
+  fd = car(arguments)->data.fixnum.value;
+
+  while (1) {
+    client = accept(fd, NULL, NULL);
+
+    if (client < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        wait_fd(fd, EPOLLIN);
+      } else if (errno != EINTR && errno != ECONNABORTED) {
+        throw_error("serve: could not accept a connection", NULL);
+      }
+
+      continue;
+    }
+
+    out = dup(client);
+
+    if (out < 0) {
+      close(client);
+
+      continue;
+    }
+
+    session = make_green_thread();
+    session->thunk = make_primitive_proc(proc_serve_session);
+    session->arguments = cons(make_fd_input_port(client),
+                              cons(make_fd_output_port(out),
+                                   the_empty_list));
+    start_green_thread(session);
+  }
 }
 
-object *eval_assignment(object *exp, object *env) {
-  set_variable_value(assignment_variable(exp),
-		     eval(assignment_value(exp), env),
-		     env);
+/* Starts a thread serving sessions on a listening socket, and returns
+ * it. */
+object *start_server(int fd) {
+  green_thread *server;
 
-  return ok_symbol;
+  thread_self();
+  server = make_green_thread();
+  server->thunk = make_primitive_proc(proc_accept_sessions);
+  server->arguments = cons(make_fixnum(fd), the_empty_list);
+  start_green_thread(server);
+
+  return make_thread(server);
 }
 
-object *eval_definition(object *exp, object *env) {
-  define_variable(definition_variable(exp),
-		  eval(definition_value(exp), env),
-		  env);
+/* (serve-repl path) serves on the running thread, for good */
+object *proc_serve_repl(object *arguments) {
+  int fd;
+
+  thread_self();
+  fd = open_unix_server(car(arguments)->data.string.value);
 
-  return ok_symbol;
+  return proc_accept_sessions(cons(make_fixnum(fd), the_empty_list));
 }
 
-object *eval(object *exp, object *env) {
-  object *arguments;
-  object *procedure;
-  object *result;
+/* WORKERS */
 
- tailcall:
-  if (is_self_evaluating(exp)) {
-    return exp;
-  }
+/* With --workers the program loads its libraries, the -l files and -e
+ * expressions, once, and then forks workers that run the rest: the
+ * script and the sessions of --serve, all accepting on the one socket.
+ * A worker starts out sharing the parent's pages, and keeps sharing
+ * whatever it does not change itself, because nothing else writes to
+ * an object once it is made: there is no collector, and the census
+ * keeps what it has seen in an object_table of its own.  The parent
+ * only supervises.  It replaces a worker that dies of a signal, but
+ * not one that exits with an error, which would only fail again.  One
+ * that dies soon after starting is replaced after a delay, which
+ * doubles each time it does so again, and after WORKER_RESTART_LIMIT
+ * such deaths in a row it is given up on.  The parent passes SIGINT
+ * and SIGTERM on to the workers, and exits with status 1 if any of
+ * them failed. */
 
-  if (is_variable(exp)) {
-    return lookup_variable_value(exp, env);
-  }
+#define WORKER_RESTART_DELAY 1 /* seconds */
+#define WORKER_RESTART_LIMIT 5
 
-  if (is_quoted(exp)) {
-    return text_of_quotation(exp);
-  }
+pid_t *worker_processes;
+time_t *worker_process_starts;
+int *worker_process_crashes; /* quick deaths in a row */
+int worker_process_count;
+volatile sig_atomic_t workers_stopping;
 
-  if (is_assignment(exp)) {
-    return eval_assignment(exp, env);
-  }
+void stop_workers(int signal_number) {
+  int i;
 
-  if (is_definition(exp)) {
-    return eval_definition(exp, env);
+  workers_stopping = signal_number;
+
+  for (i = 0; i < worker_process_count; i++) {
+    if (worker_processes[i] > 0) {
+      kill(worker_processes[i], signal_number);
+    }
   }
+}
 
-  if (is_if(exp)) {
-    exp = is_true(eval(if_predicate(exp), env)) ?
-      if_consequent(exp) :
-      if_alternative(exp);
+/* Forks worker i, and returns 0 in the worker and 1 in the parent.
+ * The signals wait until worker_processes has the new worker. */
+int fork_worker(int i) {
+  sigset_t signals;
+  sigset_t saved;
+  pid_t pid;
 
-    goto tailcall;
-  }
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, &saved);
+  fflush(stdout);
+  fflush(stderr);
+  pid = fork();
 
-  if (is_lambda(exp)) {
-    return make_compound_proc(lambda_parameters(exp),
-                              lambda_body(exp),
-                              env);
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
   }
 
-  if (is_begin(exp)) {
-    exp = begin_actions(exp);
+  if (pid == 0) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
 
-    while (!is_last_exp(exp)) {
-      eval(first_exp(exp), env);
-      exp = rest_exps(exp);
+    /* a worker waits on descriptors of its own */
+    if (S(epoll_open)) {
+      close(S(epoll_fd));
+      S(epoll_open) = 0;
     }
 
-    exp = first_exp(exp);
+    /* and has no pool threads until it starts its own; their locks may
+     * have been held at the fork */
+    work_deques = NULL;
+    worker_count = 0;
+    queued_tasks = 0;
+    pthread_mutex_init(&pool_lock, NULL);
+    pthread_cond_init(&pool_work, NULL);
 
-    goto tailcall;
+    return 0;
   }
 
-  if (is_cond(exp)) {
-    exp = cond_to_if(exp);
+  worker_processes[i] = pid;
+  worker_process_starts[i] = time(NULL);
+  sigprocmask(SIG_SETMASK, &saved, NULL);
 
-    goto tailcall;
-  }
+  return 1;
+}
+
+/* Starts count workers and returns in each of them; the parent
+ * supervises them until they have all finished and then exits. */
+void run_workers(int count) {
+  struct sigaction action;
+  int running;
+  int failed;
+  int status;
+  pid_t pid;
+  int i;
 
-  if (is_let(exp)) {
-    exp = let_to_application(exp);
+  worker_processes = calloc(count, sizeof(pid_t));
+  worker_process_starts = calloc(count, sizeof(time_t));
+  worker_process_crashes = calloc(count, sizeof(int));
 
-    goto tailcall;
+  if (worker_processes == NULL || worker_process_starts == NULL ||
+      worker_process_crashes == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
   }
 
-  if (is_and(exp)) {
-    exp = and_tests(exp);
+  worker_process_count = count;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_workers;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
 
-    if (is_the_empty_list(exp)) {
-      return true;
+  for (i = 0; i < count; i++) {
+    if (!fork_worker(i)) {
+      return;
     }
+  }
 
-    while (!is_last_exp(exp)) {
-      result = eval(first_exp(exp), env);
+  running = count;
+  failed = 0;
 
-      if (is_false(result)) {
-        return result;
+  while (running > 0) {
+    pid = waitpid(-1, &status, 0);
+
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
       }
 
-      exp = rest_exps(exp);
+      break;
     }
 
-    exp = first_exp(exp);
-
-    goto tailcall;
-  }
-
-  if (is_or(exp)) {
-    exp = or_tests(exp);
+    i = 0;
 
-    if (is_the_empty_list(exp)) {
-      return false;
+    while (i < count && worker_processes[i] != pid) {
+      i++;
     }
 
-    while (!is_last_exp(exp)) {
-      result = eval(first_exp(exp), env);
+    if (i == count) {
+      continue;
+    }
 
-      if (is_true(result)) {
-        return result;
-      }
+    worker_processes[i] = 0;
+    running--;
 
-      exp = rest_exps(exp);
+    if (workers_stopping) {
+      continue;
     }
 
-    exp = first_exp(exp);
+    if (WIFEXITED(status)) {
+      if (WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "worker %ld exited with status %d\n",
+                (long)pid, WEXITSTATUS(status));
+        failed = 1;
+      }
 
-    goto tailcall;
-  }
+      continue;
+    }
 
-  if (is_application(exp)) {
-    procedure = eval(operator(exp), env);
-    arguments = list_of_values(operands(exp), env);
+    if (time(NULL) - worker_process_starts[i] <
+        WORKER_RESTART_DELAY << worker_process_crashes[i]) {
+      worker_process_crashes[i]++;
+    } else {
+      worker_process_crashes[i] = 0;
+    }
 
-    if (is_primitive_proc(procedure)) {
-      if (procedure->data.primitive_proc.fn == proc_eval) {
-        exp = eval_expression(arguments);
-        env = eval_environment(arguments);
+    if (worker_process_crashes[i] == WORKER_RESTART_LIMIT) {
+      fprintf(stderr, "worker %ld killed by signal %d, giving up on it\n",
+              (long)pid, WTERMSIG(status));
+      failed = 1;
 
-        goto tailcall;
-      }
+      continue;
+    }
 
-      if (procedure->data.primitive_proc.fn == proc_apply) {
-        procedure = apply_operator(arguments);
-        arguments = apply_operands(arguments);
-      }
+    fprintf(stderr, "worker %ld killed by signal %d, restarting\n",
+            (long)pid, WTERMSIG(status));
 
-      return (procedure->data.primitive_proc.fn)(arguments);
+    if (worker_process_crashes[i] > 0) {
+      sleep(WORKER_RESTART_DELAY << (worker_process_crashes[i] - 1));
     }
 
-    if (is_compound_proc(procedure)) {
-      env = extend_environment(procedure->data.compound_proc.parameters,
-                               arguments,
-                               procedure->data.compound_proc.env);
-
-      exp = make_begin(procedure->data.compound_proc.body);
+    if (workers_stopping) {
+      continue;
+    }
 
-      goto tailcall;
+    if (!fork_worker(i)) {
+      return;
     }
 
-    fprintf(stderr, "unknown procedure type\n");
-    exit(1);
+    running++;
   }
 
-  fprintf(stderr, "cannot eval unknown expression type\n");
-  exit(1);
+  if (workers_stopping) {
+    signal(workers_stopping, SIG_DFL);
+    raise(workers_stopping);
+  }
+
+  exit(failed);
 }
 
-/* PRINT */
+/* REPL */
 
-void write_pair(FILE *out, object *pair) {
-  object *car_obj;
-  object *cdr_obj;
+continuation *push_continuation(char escape_only);
+
+void usage(void) {
+  fprintf(stderr,
+          "usage: scheme [--image file] [--profile[=hz]] [--allocations] "
+          "[--backtrace]\n"
+          "              [--trace[=file]] [--serve socket] [--workers n] "
+          "[-q]\n"
+          "              [-l file] [-e expr] [file [arg ...]]\n"
+          "  --image file  start from a heap saved with save-image\n"
+          "  --profile     sample procedures, report on stderr at exit\n"
+          "  --allocations count allocations, report on stderr at exit\n"
+          "  --backtrace   show the procedures running at an error\n"
+          "  --trace       trace calls, write trace.json (or file) at exit\n"
+          "  --serve socket\n"
+          "                serve REPL sessions on a Unix domain socket, "
+          "instead of\n"
+          "                the REPL on stdin\n"
+          "  --workers n   load the -l files and -e expressions once, "
+          "then fork n\n"
+          "                workers to run the script or serve, "
+          "restarting any that crash\n"
+          "  -q, --quiet   no banner, prompt or echo in the REPL\n"
+          "  -l file       load file before anything else runs\n"
+          "  -e expr       evaluate expr; skips the REPL\n"
+          "  file          run a script with the remaining arguments\n");
+  exit(2);
+}
+
+void load_script(char *filename) {
+  FILE *in;
+  int c;
+  char traced;
 
-  car_obj = car(pair);
-  cdr_obj = cdr(pair);
+  in = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
 
-  write(out, car_obj);
+  if (in == NULL) {
+    fprintf(stderr, "could not open script \"%s\"\n", filename);
+    exit(1);
+  }
 
-  if (cdr_obj->type == PAIR) {
-    fprintf(out, " ");
-    write_pair(out, cdr_obj);
-  } else if (cdr_obj->type == THE_EMPTY_LIST) {
-    return;
+  /* skip a #! line so scripts can be made executable */
+  if ((c = getc(in)) == '#' && peek(in) == '!') {
+    while ((c = getc(in)) != EOF && c != '\n');
   } else {
-    fprintf(out, " . ");
-    write(out, cdr_obj);
+    ungetc(c, in);
   }
-}
 
-void write(FILE *out, object *obj) {
-  char c;
-  char *str;
-  object *body;
+  traced = tracing && !S(spawned);
 
-  switch (obj->type) {
-  case BOOLEAN:
-    fprintf(out, "#%c", is_false(obj) ? 'f' : 't');
+  if (traced) {
+    begin_traced_load(filename);
+  }
 
-    break;
+  if (in != stdin) {
+    record_source_forms(in, source_file_number(filename));
+  }
 
-  case CHARACTER:
-    c = obj->data.character.value;
-    fprintf(out, "#\\");
+  load_stream(in);
+  record_source_forms(NULL, -1);
 
-    switch (c) {
-    case '\n':
-      fprintf(out, "newline");
-      break;
-    case ' ':
-      fprintf(out, "space");
-      break;
-    default:
-      putc(c, out);
-    }
+  if (traced) {
+    end_traced_load();
+  }
 
-    break;
+  if (in != stdin) {
+    fclose(in);
+  }
+}
 
-  case COMPOUND_PROC:
-    body = obj->data.compound_proc.body;
+void eval_string(char *str) {
+  FILE *in;
 
-    fprintf(out, "(lambda ");
-    write(out, obj->data.compound_proc.parameters);
-    fprintf(out, " ");
+  in = fmemopen(str, strlen(str), "r");
 
-    if (is_pair(body)) {
-      write_pair(out, body);
-    } else {
-      write(out, body);
-    }
+  if (in == NULL) {
+    fprintf(stderr, "could not evaluate \"%s\"\n", str);
+    exit(1);
+  }
 
-    fprintf(out, ")");
+  load_stream(in);
+  fclose(in);
+}
 
-    break;
+#ifndef SCHEME_NO_MAIN
 
-  case FIXNUM:
-    fprintf(out, "%ld", obj->data.fixnum.value);
+int main(int argc, char **argv) {
+  char stack_bottom;
+  char quiet;
+  char batch;
+  char *script;
+  char *program;
+  char *socket_path;
+  object *server;
+  int server_fd;
+  long workers;
+  object *exp;
+  object *tail;
+  long profile_hz;
+  char allocations;
+  int options_end;
+  int i;
 
-    break;
+  scheme = make_context();
+  S(stack_base) = &stack_bottom;
+  profile_hz = 0;
+  allocations = 0;
+  socket_path = NULL;
+  server = NULL;
+  server_fd = -1;
+  workers = 0;
+
+  program = argv[0];
+
+  if (argc > 2 && strcmp(argv[1], "--image") == 0) {
+    init_from_image(argv[2]);
+    argv += 2;
+    argc -= 2;
+  } else {
+    init();
+  }
 
-  case PAIR:
-    fprintf(out, "(");
-    write_pair(out, obj);
-    fprintf(out, ")");
+  quiet = 0;
+  batch = 0;
+
+  /* the script, if any, ends the options */
+  for (i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "-e") == 0 ||
+         strcmp(argv[i], "--serve") == 0 ||
+         strcmp(argv[i], "--workers") == 0) &&
+        i + 1 < argc) {
+      i++;
+    } else if (strcmp(argv[i], "--") == 0 ||
+               argv[i][0] != '-' || argv[i][1] == '\0') {
+      break;
+    }
+  }
 
-    break;
+  options_end = i;
 
-  case PRIMITIVE_PROC:
-    fprintf(out, "#<procedure>");
+  for (i = 1; i < options_end; i++) {
+    if (strcmp(argv[i], "--profile") == 0) {
+      profile_hz = PROFILE_DEFAULT_HZ;
+    } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+      profile_hz = atol(argv[i] + 10);
 
-    break;
+      if (profile_hz <= 0) {
+        usage();
+      }
+    } else if (strcmp(argv[i], "--allocations") == 0) {
+      allocations = 1;
+    } else if (strcmp(argv[i], "--backtrace") == 0) {
+      backtraces = 1;
+      update_profiling();
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      trace_file = TRACE_DEFAULT_FILE;
+    } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+      trace_file = argv[i] + 8;
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < options_end) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < options_end) {
+      workers = atol(argv[++i]);
+
+      if (workers <= 0) {
+        usage();
+      }
+    }
+  }
 
-  case STRING:
-    str = obj->data.string.value;
+  /* profile everything, -l files included */
+  if (profile_hz > 0) {
+    start_profiler(profile_hz);
+    atexit(write_profile_at_exit);
+  }
 
-    putc('"', out);
+  if (allocations) {
+    start_allocation_tracking();
+    atexit(write_allocation_report_at_exit);
+  }
 
-    while (*str != '\0') {
-      switch (*str) {
-      case '\n':
-	fprintf(out, "\\n");
+  if (trace_file != NULL) {
+    start_tracing();
+    atexit(write_trace_at_exit);
+  }
 
-	break;
+  if (i < argc && strcmp(argv[i], "--") == 0) {
+    i++;
+  }
 
-      case '\\':
-	fprintf(out, "\\\\");
+  script = i < argc ? argv[i++] : NULL;
 
-	break;
+  S(command_line) = cons(make_string(script == NULL ? program : script),
+                         the_empty_list);
+  tail = S(command_line);
 
-      case '"':
-	fprintf(out, "\\\"");
-	break;
+  for (; i < argc; i++) {
+    set_cdr(tail, cons(make_string(argv[i]), the_empty_list));
+    tail = cdr(tail);
+  }
 
-      default:
-	putc(*str, out);
-      }
+  /* workers need something to run */
+  if (workers > 0 && script == NULL && socket_path == NULL) {
+    usage();
+  }
 
-      str++;
-    }
+  /* the workers share one listening socket */
+  if (socket_path != NULL) {
+    server_fd = open_unix_server(socket_path);
+  }
 
-    putc('"', out);
+  /* until the REPL starts, an unhandled error exits with status 1 */
+  for (i = 1; i < options_end; i++) {
+    if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) {
+      quiet = 1;
+    } else if (strcmp(argv[i], "-l") == 0 && i + 1 < options_end) {
+      load_script(argv[++i]);
+    } else if ((strcmp(argv[i], "--serve") == 0 ||
+                strcmp(argv[i], "--workers") == 0) && i + 1 < options_end) {
+      i++;
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < options_end) {
+      eval_string(argv[++i]);
+      batch = 1;
+    } else if (strcmp(argv[i], "--profile") != 0 &&
+               strncmp(argv[i], "--profile=", 10) != 0 &&
+               strcmp(argv[i], "--allocations") != 0 &&
+               strcmp(argv[i], "--backtrace") != 0 &&
+               strcmp(argv[i], "--trace") != 0 &&
+               strncmp(argv[i], "--trace=", 8) != 0) {
+      usage();
+    }
+  }
 
-    break;
+  /* the libraries are loaded; each worker runs the rest */
+  if (workers > 0) {
+    run_workers(workers);
+  }
 
-  case SYMBOL:
-    fprintf(out, "%s", obj->data.symbol.value);
+  /* sessions are served while the script runs */
+  if (server_fd >= 0) {
+    server = start_server(server_fd);
+  }
 
-    break;
+  if (script != NULL) {
+    load_script(script);
+    batch = 1;
+  }
 
-  case THE_EMPTY_LIST:
-    fprintf(out, "()");
-    break;
+  /* the server never finishes, unless it fails */
+  if (server != NULL) {
+    proc_thread_join(cons(server, the_empty_list));
+  }
 
-  case THE_EMPTY_STRING:
-    fprintf(out, "\"\"");
-    break;
+  if (batch) {
+    fflush(stdout);
 
-  default:
-    fprintf(stderr, "cannot write unknown type\n");
+    return 0;
+  }
 
-    exit(1);
+  if (!quiet) {
+    printf("Welcome to Bootstrap Scheme. "
+           "Use ctrl-c to exit.\n");
   }
-}
 
-/* REPL */
+  /* errors nobody handles land back here with the heap intact */
+  S(top_level) = push_continuation(1);
+  setjmp(S(top_level)->jmp);
 
-int main(void) {
-  printf("Welcome to Bootstrap Scheme. "
-	 "Use ctrl-c to exit.\n");
+  while (1) {
+    if (!quiet) {
+      printf("> ");
+    }
 
-  init();
+    exp = read_object(stdin);
 
-  while (1) {
-    printf("> ");
-    write(stdout, eval(read(stdin), the_global_environment));
+    if (exp == NULL) {
+      break;
+    }
+
+    S(toplevel_form) = exp;
+    exp = eval(analyze(exp, S(the_global_environment)),
+               S(the_global_environment));
+
+    if (!quiet) {
+      write_object(stdout, exp);
+      printf("\n");
+    }
+  }
+
+  if (!quiet) {
     printf("\n");
   }
 
   return 0;
 }
+
+#endif
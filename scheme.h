@@ -0,0 +1,32 @@
+/* Embedding Bootstrap Scheme
+ *
+ * Build libscheme.a (make libscheme.a) and link it with the program.
+ * Each context is an interpreter of its own, with its own symbols,
+ * global environment and standard library; values never cross from
+ * one to another.  A context may be used from only one thread at a
+ * time.  Nothing is collected while a context lives; what it allocated
+ * is freed by scheme_destroy.  Running out of memory still ends the
+ * process. */
+
+#ifndef SCHEME_H
+#define SCHEME_H
+
+typedef struct scheme_context scheme_context;
+
+/* Returns a new interpreter with the standard library loaded. */
+scheme_context *scheme_new(void);
+
+/* Evaluates the expressions in str and returns the last value written
+ * as write would, in a string the caller frees, or NULL if an error
+ * was not handled (it is reported on stderr) or exit was called. */
+char *scheme_eval_string(scheme_context *context, char *str);
+
+/* Returns the status exit was called with in the last
+ * scheme_eval_string on context, or -1 if it was not called. */
+int scheme_exit_status(scheme_context *context);
+
+/* Frees context and every object it allocated; the strings
+ * scheme_eval_string returned stay the caller's. */
+void scheme_destroy(scheme_context *context);
+
+#endif
@@ -1,66 +1,71 @@
-(define number? integer?)
-
-(define (caar x) (car (car x)))
-(define (cadr x) (car (cdr x)))
-(define (cdar x) (cdr (car x)))
+(define-syntax let
+  (syntax-rules ()
+    ((_ ((name val) ...) body1 body2 ...)
+     ((lambda (name ...) body1 body2 ...) val ...))))
 
-(define (caaar x) (car (car (car x))))
-(define (caadr x) (car (car (cdr x))))
-(define (cadar x) (car (cdr (car x))))
-(define (caddr x) (car (cdr (cdr x))))
-(define (cdaar x) (cdr (car (car x))))
-(define (cdadr x) (cdr (car (cdr x))))
-(define (cddar x) (cdr (cdr (car x))))
-(define (cdddr x) (cdr (cdr (cdr x))))
+(define-syntax let*
+  (syntax-rules ()
+    ((_ () body1 body2 ...)
+     (let () body1 body2 ...))
+    ((_ ((name1 val1) (name2 val2) ...) body1 body2 ...)
+     (let ((name1 val1))
+       (let* ((name2 val2) ...) body1 body2 ...)))))
 
-(define (caaaar x) (car (car (car (car x)))))
-(define (caaadr x) (car (car (car (car x)))))
-(define (caadar x) (car (car (car (car x)))))
-(define (caaddr x) (car (car (car (car x)))))
-(define (cadaar x) (car (car (car (car x)))))
-(define (cadadr x) (car (car (car (car x)))))
-(define (caddar x) (car (car (car (car x)))))
-(define (cadddr x) (car (car (car (car x)))))
-(define (cdaaar x) (car (car (car (car x)))))
-(define (cdaadr x) (car (car (car (car x)))))
-(define (cdadar x) (car (car (car (car x)))))
-(define (cdaddr x) (car (car (car (car x)))))
-(define (cddaar x) (car (car (car (car x)))))
-(define (cddadr x) (car (car (car (car x)))))
-(define (cdddar x) (car (car (car (car x)))))
-(define (cddddr x) (car (car (car (car x)))))
+(define-syntax letrec
+  (syntax-rules ()
+    ((_ ((var init) ...) body1 body2 ...)
+     (let ((var #f) ...)
+       (set! var init) ...
+       (let () body1 body2 ...)))))
 
-(define (length items)
-  (define (iter a count)
-    (if (null? a)
-	count
-	(iter (cdr a) (+ 1 count))))
-  (iter items 0))
+(define-syntax cond
+  (syntax-rules (else =>)
+    ((_ (else result1 result2 ...))
+     (begin result1 result2 ...))
+    ((_ (test => result))
+     (let ((temp test))
+       (if temp (result temp))))
+    ((_ (test => result) clause1 clause2 ...)
+     (let ((temp test))
+       (if temp
+           (result temp)
+           (cond clause1 clause2 ...))))
+    ((_ (test))
+     test)
+    ((_ (test) clause1 clause2 ...)
+     (let ((temp test))
+       (if temp
+           temp
+           (cond clause1 clause2 ...))))
+    ((_ (test result1 result2 ...))
+     (if test (begin result1 result2 ...)))
+    ((_ (test result1 result2 ...) clause1 clause2 ...)
+     (if test
+         (begin result1 result2 ...)
+         (cond clause1 clause2 ...)))))
 
-(define (append list1 list2)
-  (if (null? list1)
-      list2
-      (cons (car list1) (append (cdr list1) list2))))
+(define-syntax do
+  (syntax-rules ()
+    ((_ ((var init step ...) ...)
+        (test expr ...)
+        command ...)
+     (let loop ((var init) ...)
+       (if test
+           (begin (if #f #f) expr ...)
+           (begin
+             command ...
+             (loop (do "step" var step ...) ...)))))
+    ((_ "step" x)
+     x)
+    ((_ "step" x y)
+     y)))
 
-(define (reverse l)
-  (define (iter in out)
-    (if (pair? in)
-	(iter (cdr in) (cons (car in) out))
-	out))
-  (iter l '()))
+(define-syntax time
+  (syntax-rules ()
+    ((_ expr)
+     (call-with-timing (lambda () expr)))))
 
-(define (map f items)
-  (if (null? items)
-      '()
-      (cons (f (car items))
-	    (map f (cdr items)))))
-
-(define (for-each f l)
-  (if (null? l)
-      #t
-      (begin
-	(f (car l))
-	(for-each f (cdr l)))))
+(define number? integer?)
 
 (define (not x)
   (if x #f #t))